@@ -3,438 +3,7071 @@
 #include <limits.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#else
+#include <io.h>
+#endif
 
-#define MAX_CITIES 1000
-#define MAX_NAME 100
+// grafo congelado em CSR (structure-of-arrays): vizinhos de u ficam em
+// targets/weights[offsets[u] .. offsets[u+1]-1]
+typedef struct {
+    int n;        // cidades existentes no momento do congelamento
+    int m;        // arestas dirigidas (cada ligação conta duas vezes)
+    int *offsets;
+    int *targets;
+    int *weights;
+} GrafoCSR;
+
+// arestas acrescentadas depois do congelamento (overlay mutável da opção 5);
+// lista ligada por índice dentro de arrays, sem malloc por aresta
+typedef struct {
+    int *to;
+    int *weight;
+    int *next;
+    int len, cap;
+    int *head;  // por cidade; -1 = sem arestas novas
+    int *grau;
+} DeltaArestas;
+
+// percorre os vizinhos de uma cidade: primeiro o delta, depois o CSR (cada
+// parte em ordem de distância; viz_ordenado_proximo() intercala as duas)
+typedef struct {
+    int d;        // próximo índice no delta (-1 = acabou)
+    int i, fim;   // faixa restante no CSR
+} VizinhoIter;
+
+// vizinho com distância; usado pra ordenar cada lista ao congelar o grafo
+typedef struct {
+    int city_id;
+    int distance;
+} VizinhoInfo;
+
+// nomes internados numa arena única; cada cidade guarda só offset+tamanho.
+// ponteiros pra dentro da arena valem só até a próxima cidade nova (realloc)
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} ArenaNomes;
+
+// tipos de tamanho fixo: o mesmo layout vai pro snapshot binário
+typedef struct {
+    uint64_t off;
+    uint32_t len;
+    uint32_t reservado;
+} NomeRef;
+
+// posição geográfica opcional (colunas extras do CSV); NAN = desconhecida
+typedef struct {
+    double lat, lon;
+} Coord;
+
+// índice nome normalizado -> id (endereçamento aberto, sondagem linear)
+typedef struct {
+    int *slots;        // id da cidade ou -1
+    unsigned *hashes;  // hash guardado pra evitar strcmp à toa
+    int cap;           // potência de 2
+    int usados;
+} IndiceNomes;
+
+ArenaNomes arena_nomes = {0};
+NomeRef *city_names = NULL;  // nome como veio no CSV/entrada
+NomeRef *city_keys = NULL;   // nome normalizado, calculado uma vez na inserção
+int city_count = 0;
+int city_cap = 0;            // tamanho alocado dos arrays indexados por cidade
+Coord *city_coords = NULL;
+int cidades_com_coord = 0;
+IndiceNomes indice_nomes = {0};
+GrafoCSR csr = {0};
+DeltaArestas delta = {0};
+int delta_ordenado = 0;    // delta de saída mantido em ordem (depois do primeiro congelamento)
+// modo direcionado (--direcionado): cada linha do CSV vale só de origem pra
+// destino e as arestas de entrada ficam num segundo CSR + delta
+int grafo_direcionado = 0;
+GrafoCSR csr_entrada = {0};
+DeltaArestas delta_entrada = {0};
+GrafoCSR *csr_in = &csr;          // arestas de entrada: o próprio grafo se não direcionado
+DeltaArestas *delta_in = &delta;
+int tem_peso_negativo = 0; // radix heap só funciona sem pesos negativos
+unsigned long grafo_versao = 0; // muda a cada aresta nova; invalida dados derivados
+int grafo_compartilhado = 0;    // servidor: várias threads leem, nada é montado sob demanda na busca
+
+/* --- memória --- */
+
+// realloc que encerra o programa se faltar memória
+void *xrealloc(void *p, size_t n) {
+    void *q = realloc(p, n ? n : 1);
+    if (q == NULL) {
+        fprintf(stderr, "ERRO: memoria insuficiente\n");
+        exit(1);
+    }
+    return q;
+}
+
+// garante capacidade pra pelo menos n elementos em ptr (dobrando); cap é size_t
+#define GARANTE_CAP(ptr, cap, n) do { \
+    if ((n) > (cap)) { \
+        size_t novo_ = (cap) ? (size_t)(cap) : 16; \
+        while (novo_ < (size_t)(n)) novo_ *= 2; \
+        (ptr) = xrealloc((ptr), novo_ * sizeof(*(ptr))); \
+        (cap) = novo_; \
+    } \
+} while (0)
+
+/* --- utilitárias de string --- */
+
+/* Chave de um nome: sem acento, minúsculas e espaços juntados
+   ("  São   José " -> "sao jose"). O texto é lido como UTF-8; byte que não
+   forma UTF-8 válido vale como Latin-1, então um CSV salvo em Latin-1 dá as
+   mesmas chaves. Letras latinas acentuadas (U+00C0 a U+017F) viram a letra
+   base, marcas combinantes (U+0300 a U+036F) somem e o resto passa como
+   está (minúsculas só no ASCII). A chave ocupa no máximo o dobro do texto. */
+
+// letra base de U+00C0..U+017F; '\0' = caso especial (dobra_especial) ou símbolo
+static const char dobra_base[] =
+    "aaaaaa\0ceeeeiiiidnooooo\0ouuuuy\0\0"
+    "aaaaaa\0ceeeeiiiidnooooo\0ouuuuy\0y"
+    "aaaaaaccccccccddddeeeeeeeeeegggg"
+    "gggghhhhiiiiiiiiii\0\0jjkkklllllll"
+    "lllnnnnnnnnnoooooo\0\0rrrrrrssssss"
+    "ssttttttuuuuuuuuuuuuwwyyyzzzzzzs";
+
+static const char *dobra_especial(unsigned cp) {
+    switch (cp) {
+        case 0xC6: case 0xE6: return "ae";
+        case 0xDE: case 0xFE: return "th";
+        case 0xDF: return "ss";
+        case 0x132: case 0x133: return "ij";
+        case 0x152: case 0x153: return "oe";
+    }
+    return NULL;
+}
+
+// próximo code point de s a partir de *i (avança *i); byte inválido vale como Latin-1
+static unsigned utf8_proximo(const unsigned char *s, size_t *i) {
+    unsigned c = s[*i];
+    int extra = c >= 0xF0 && c < 0xF5 ? 3 : c >= 0xE0 && c < 0xF0 ? 2 : c >= 0xC2 && c < 0xE0 ? 1 : 0;
+    unsigned cp = c & (0x3F >> extra);
+    for (int k = 1; k <= extra; ++k) {
+        unsigned b = s[*i + k];  // o '\0' final não é continuação, então não passa do fim
+        if ((b & 0xC0) != 0x80) { extra = 0; break; }
+        cp = (cp << 6) | (b & 0x3F);
+    }
+    // sequência longa demais pro valor, surrogate ou acima de U+10FFFF
+    if ((extra == 2 && cp < 0x800) || (extra == 3 && (cp < 0x10000 || cp > 0x10FFFF))
+        || (cp >= 0xD800 && cp <= 0xDFFF)) extra = 0;
+    if (extra == 0) { (*i)++; return c; }
+    *i += extra + 1;
+    return cp;
+}
+
+static int utf8_escreve(char *o, unsigned cp) {
+    if (cp < 0x80) { o[0] = cp; return 1; }
+    if (cp < 0x800) { o[0] = 0xC0 | (cp >> 6); o[1] = 0x80 | (cp & 0x3F); return 2; }
+    if (cp < 0x10000) {
+        o[0] = 0xE0 | (cp >> 12); o[1] = 0x80 | ((cp >> 6) & 0x3F); o[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    o[0] = 0xF0 | (cp >> 18); o[1] = 0x80 | ((cp >> 12) & 0x3F);
+    o[2] = 0x80 | ((cp >> 6) & 0x3F); o[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+// grava a chave de in em out (capacidade 2 * strlen(in) + 1)
+void nome_normaliza(const char *in, char *out) {
+    const unsigned char *s = (const unsigned char *)in;
+    size_t i = 0;
+    char *o = out;
+    int espaco = 0;  // espaço pendente, só escrito antes da próxima letra
+    while (s[i]) {
+        unsigned cp = utf8_proximo(s, &i);
+        if (cp == 0xA0 || (cp < 0x80 && isspace((int)cp))) { espaco = o != out; continue; }
+        if (cp >= 0x300 && cp <= 0x36F) continue;
+        if (espaco) { *o++ = ' '; espaco = 0; }
+        if (cp < 0x80) { *o++ = tolower((int)cp); continue; }
+        if (cp >= 0xC0 && cp <= 0x17F && dobra_base[cp - 0xC0]) { *o++ = dobra_base[cp - 0xC0]; continue; }
+        const char *esp = dobra_especial(cp);
+        if (esp) { *o++ = esp[0]; *o++ = esp[1]; continue; }
+        o += utf8_escreve(o, cp);
+    }
+    *o = '\0';
+}
+
+// relógio monotônico em segundos (só serve pra diferenças)
+double agora_seg() {
+#ifdef _WIN32
+    return (double)clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* --- métricas de desempenho --- */
+
+/* Chamadas e tempo das partes quentes (carga, nomes, buscas, componentes,
+   persistência), mostrados na opção 7 e no fim com --stats. Compilando com
+   -DSEM_METRICAS as macros somem e o relógio nem é lido. Só entram chamadas
+   que terminam (saída por erro não conta). city_index() roda duas vezes
+   por linha do CSV, então só 1 em METRICA_AMOSTRA é cronometrada e o total
+   sai da média. As somas passam por uma trava porque a matriz e o servidor
+   medem em várias threads (city_index só roda em quem escreve no grafo). */
+#define METRICA_AMOSTRA 64
+
+typedef enum {
+    MET_CARGA_CSV, MET_CONGELA, MET_CITY_INDEX, MET_FUZZY, MET_DIJKSTRA, MET_ROTA,
+    MET_ALTERNATIVAS, MET_COMPONENTES, MET_ANALISE, MET_SNAPSHOT_GRAVA, MET_SNAPSHOT_CARREGA,
+    MET_WAL_COMMIT, MET_WAL_COMPACTA, MET_TOTAL
+} MetricaId;
+
+typedef struct {
+    const char *nome;
+    unsigned amostra;    // cronometra 1 a cada 'amostra' chamadas
+    unsigned pulos;
+    long chamadas;
+    long medidas;        // chamadas cronometradas
+    double seg;          // soma das medidas
+    double seg_max;
+    long long fechados;  // buscas: cidades fechadas
+    long long relaxadas; // e arestas examinadas
+} Metrica;
+
+#ifndef SEM_METRICAS
+static Metrica metricas[MET_TOTAL] = {
+    [MET_CARGA_CSV] = {"carga_csv", 1}, [MET_CONGELA] = {"congela", 1},
+    [MET_CITY_INDEX] = {"city_index", METRICA_AMOSTRA}, [MET_FUZZY] = {"fuzzy", 1},
+    [MET_DIJKSTRA] = {"dijkstra", 1}, [MET_ROTA] = {"rota", 1}, [MET_ALTERNATIVAS] = {"alternativas", 1},
+    [MET_COMPONENTES] = {"componentes", 1}, [MET_ANALISE] = {"analise", 1},
+    [MET_SNAPSHOT_GRAVA] = {"snapshot_grava", 1}, [MET_SNAPSHOT_CARREGA] = {"snapshot_carrega", 1},
+    [MET_WAL_COMMIT] = {"wal_commit", 1}, [MET_WAL_COMPACTA] = {"wal_compacta", 1},
+};
+#ifndef _WIN32
+static pthread_mutex_t metricas_trava = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// -1 = chamada contada sem cronometrar (fora da amostra)
+static double metrica_comeca(MetricaId id) {
+    Metrica *m = &metricas[id];
+    if (m->amostra > 1) {
+        if (++m->pulos < m->amostra) { m->chamadas++; return -1; }
+        m->pulos = 0;
+    }
+    return agora_seg();
+}
+
+static void metrica_soma(Metrica *m, double seg, long fechados, long relaxadas) {
+#ifndef _WIN32
+    pthread_mutex_lock(&metricas_trava);
+#endif
+    m->chamadas++;
+    m->medidas++;
+    m->seg += seg;
+    if (seg > m->seg_max) m->seg_max = seg;
+    m->fechados += fechados;
+    m->relaxadas += relaxadas;
+#ifndef _WIN32
+    pthread_mutex_unlock(&metricas_trava);
+#endif
+}
+
+static void metrica_termina(MetricaId id, double t0) {
+    if (t0 >= 0) metrica_soma(&metricas[id], agora_seg() - t0, 0, 0);
+}
+
+static void metrica_busca(MetricaId id, double t0, long fechados, long relaxadas) {
+    metrica_soma(&metricas[id], agora_seg() - t0, fechados, relaxadas);
+}
+
+#define METRICA_INICIO(id) double metrica_t0_##id = metrica_comeca(id)
+#define METRICA_FIM(id) metrica_termina(id, metrica_t0_##id)
+#define METRICA_BUSCA_INICIO(id) double metrica_t0_##id = agora_seg()
+#define METRICA_BUSCA_FIM(id, fechados, relaxadas) metrica_busca(id, metrica_t0_##id, fechados, relaxadas)
+#else
+#define METRICA_INICIO(id) ((void)0)
+#define METRICA_FIM(id) ((void)0)
+#define METRICA_BUSCA_INICIO(id) ((void)0)
+#define METRICA_BUSCA_FIM(id, fechados, relaxadas) ((void)0)
+#endif
+
+// tabela das métricas; total de city_index é estimado pela amostra
+void metricas_imprime(FILE *f) {
+#ifdef SEM_METRICAS
+    fprintf(f, "Metricas desativadas nesta compilacao (SEM_METRICAS).\n");
+#else
+    fprintf(f, "%-17s %10s %12s %11s %11s\n", "medida", "chamadas", "total ms", "media us", "max us");
+    int alguma = 0;
+    for (int i = 0; i < MET_TOTAL; ++i) {
+        const Metrica *m = &metricas[i];
+        if (m->chamadas == 0) continue;
+        alguma = 1;
+        double media = m->medidas > 0 ? m->seg / m->medidas : 0;
+        fprintf(f, "%-17s %10ld %12.3f %11.3f %11.3f%s\n", m->nome, m->chamadas,
+                media * m->chamadas * 1e3, media * 1e6, m->seg_max * 1e6,
+                m->amostra > 1 ? "  (amostrado)" : "");
+        if (m->fechados > 0 || m->relaxadas > 0)
+            fprintf(f, "%-17s cidades fechadas: %lld (%.1f por busca), arestas examinadas: %lld (%.1f por busca)\n",
+                    "", m->fechados, (double)m->fechados / m->chamadas,
+                    m->relaxadas, (double)m->relaxadas / m->chamadas);
+    }
+    if (!alguma) fprintf(f, "Nenhuma medida registrada ainda.\n");
+#endif
+}
+
+// descarta o resto da linha na entrada padrão (sem travar no fim da entrada)
+void descarta_linha() {
+    int c;
+    while ((c = getchar()) != '\n' && c != EOF);
+}
+
+// lê uma linha inteira (sem '\n') num buffer que cresce; NULL no fim da entrada.
+// o ponteiro devolvido vale até a próxima chamada
+char *ler_linha(FILE *f) {
+    static char *buf = NULL;
+    static size_t cap = 0;
+    size_t len = 0;
+    int c;
+    while ((c = fgetc(f)) != EOF && c != '\n') {
+        GARANTE_CAP(buf, cap, len + 2);
+        buf[len++] = (char)c;
+    }
+    if (c == EOF && len == 0) return NULL;
+    GARANTE_CAP(buf, cap, len + 1);
+    buf[len] = '\0';
+    return buf;
+}
+
+/* --- nomes das cidades (arena) --- */
+
+void snapshot_desanexa();
+
+static size_t arena_guarda(const char *s, int len) {
+    snapshot_desanexa();
+    GARANTE_CAP(arena_nomes.buf, arena_nomes.cap, arena_nomes.len + len + 1);
+    size_t off = arena_nomes.len;
+    memcpy(arena_nomes.buf + off, s, len);
+    arena_nomes.buf[off + len] = '\0';
+    arena_nomes.len += len + 1;
+    return off;
+}
+
+static inline const char *city_name(int i) { return arena_nomes.buf + city_names[i].off; }
+static inline const char *city_key(int i) { return arena_nomes.buf + city_keys[i].off; }
+
+static void delta_garante_cidades(int n);
+
+// cresce todos os arrays indexados por cidade pra caber n cidades
+static void cidades_garante(int n) {
+    if (n <= city_cap) return;
+    snapshot_desanexa();
+    int antigo = city_cap;
+    int cap = city_cap ? city_cap : 64;
+    while (cap < n) cap *= 2;
+    city_names = xrealloc(city_names, cap * sizeof(NomeRef));
+    city_keys = xrealloc(city_keys, cap * sizeof(NomeRef));
+    city_coords = xrealloc(city_coords, cap * sizeof(Coord));
+    for (int i = antigo; i < cap; ++i) city_coords[i].lat = city_coords[i].lon = NAN;
+    city_cap = cap;
+    delta_garante_cidades(antigo);
+}
+
+/* --- índice de nomes (hash) --- */
+
+// FNV-1a sobre a chave já normalizada
+static unsigned hash_nome(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) { h ^= (unsigned char)*s++; h *= 16777619u; }
+    return h;
+}
+
+// procura a chave normalizada; devolve o slot onde ela está ou o slot vazio onde entraria
+static int indice_slot(const char *key, unsigned h) {
+    int mask = indice_nomes.cap - 1;
+    int s = h & mask;
+    while (indice_nomes.slots[s] != -1) {
+        int id = indice_nomes.slots[s];
+        if (indice_nomes.hashes[s] == h && strcmp(city_key(id), key) == 0) return s;
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+// monta em *novo uma tabela de cap slots com as cidades da atual (que não muda)
+static void indice_monta(IndiceNomes *novo, int cap) {
+    novo->cap = cap;
+    novo->usados = indice_nomes.usados;
+    novo->slots = xrealloc(NULL, cap * sizeof(int));
+    novo->hashes = xrealloc(NULL, cap * sizeof(unsigned));
+    for (int s = 0; s < cap; ++s) novo->slots[s] = -1;
+
+    int mask = cap - 1;
+    for (int s = 0; s < indice_nomes.cap; ++s) {
+        if (indice_nomes.slots[s] == -1) continue;
+        int t = indice_nomes.hashes[s] & mask;
+        while (novo->slots[t] != -1) t = (t + 1) & mask;
+        novo->slots[t] = indice_nomes.slots[s];
+        novo->hashes[t] = indice_nomes.hashes[s];
+    }
+}
+
+// dobra a tabela (mantém fator de carga <= 1/2)
+static void indice_cresce() {
+    snapshot_desanexa();
+    IndiceNomes novo;
+    indice_monta(&novo, indice_nomes.cap ? indice_nomes.cap * 2 : 1024);
+    free(indice_nomes.slots);
+    free(indice_nomes.hashes);
+    indice_nomes = novo;
+}
+
+// normaliza o nome pra chave usada no índice; usa buf se couber, senão aloca
+// (quem chama libera com chave_libera)
+#define CHAVE_BUF 128
+static char *nome_para_chave(const char *name_in, char *buf) {
+    size_t n = strlen(name_in);
+    char *key = 2 * n < CHAVE_BUF ? buf : xrealloc(NULL, 2 * n + 1);
+    nome_normaliza(name_in, key);
+    return key;
+}
+
+static void chave_libera(char *key, char *buf) {
+    if (key != buf) free(key);
+}
+
+// busca exata pela chave já normalizada (-1 se não existe)
+static int city_lookup_key(const char *key) {
+    if (indice_nomes.cap == 0) return -1;
+    int s = indice_slot(key, hash_nome(key));
+    return indice_nomes.slots[s];
+}
+
+// retorna índice da cidade (cria se não existir)
+int city_index(const char *name_in) {
+    METRICA_INICIO(MET_CITY_INDEX);
+    char buf[CHAVE_BUF];
+    char *name = nome_para_chave(name_in, buf);
+
+    if (2 * (indice_nomes.usados + 1) > indice_nomes.cap) indice_cresce();
+    unsigned h = hash_nome(name);
+    int s = indice_slot(name, h);
+    if (indice_nomes.slots[s] != -1) {
+        chave_libera(name, buf);
+        METRICA_FIM(MET_CITY_INDEX);
+        return indice_nomes.slots[s];
+    }
+
+    snapshot_desanexa();
+    cidades_garante(city_count + 1);
+    int len = strlen(name_in);
+    city_names[city_count].off = arena_guarda(name_in, len);
+    city_names[city_count].len = len;
+    len = strlen(name);
+    city_keys[city_count].off = arena_guarda(name, len);
+    city_keys[city_count].len = len;
+    chave_libera(name, buf);
+
+    indice_nomes.slots[s] = city_count;
+    indice_nomes.hashes[s] = h;
+    indice_nomes.usados++;
+    city_count++;
+    METRICA_FIM(MET_CITY_INDEX);
+    return city_count - 1;
+}
+
+/* --- armazenamento do grafo (CSR + delta) --- */
+
+static void delta_insere_em(DeltaArestas *d, int from, int to, int w) {
+    if (d->len == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 256;
+        d->to = xrealloc(d->to, d->cap * sizeof(int));
+        d->weight = xrealloc(d->weight, d->cap * sizeof(int));
+        d->next = xrealloc(d->next, d->cap * sizeof(int));
+    }
+    int k = d->len++;
+    d->to[k] = to;
+    d->weight[k] = w;
+    d->next[k] = d->head[from];
+    d->head[from] = k;
+    d->grau[from]++;
+}
+
+// ordem das listas de vizinhos: distância, depois id (sem subtração, que
+// estoura com distâncias grandes de sinais opostos)
+int compare_vizinhos(const void *a, const void *b) {
+    const VizinhoInfo *va = a, *vb = b;
+    if (va->distance != vb->distance) return va->distance < vb->distance ? -1 : 1;
+    return (va->city_id > vb->city_id) - (va->city_id < vb->city_id);
+}
+
+static inline int vizinho_antes(int v1, int w1, int v2, int w2) {
+    return w1 < w2 || (w1 == w2 && v1 < v2);
+}
+
+// aresta de saída; depois do primeiro congelamento entra na posição certa
+// da lista do delta (O(arestas novas da cidade)), pra lista continuar ordenada
+static void delta_insere(int from, int to, int w) {
+    delta_insere_em(&delta, from, to, w);
+    if (!delta_ordenado) return;
+    int k = delta.len - 1, *elo = &delta.head[from];
+    *elo = delta.next[k];
+    while (*elo != -1 && vizinho_antes(delta.to[*elo], delta.weight[*elo], to, w)) elo = &delta.next[*elo];
+    delta.next[k] = *elo;
+    *elo = k;
+}
+
+static void delta_garante_em(DeltaArestas *d, int antigo) {
+    d->head = xrealloc(d->head, city_cap * sizeof(int));
+    d->grau = xrealloc(d->grau, city_cap * sizeof(int));
+    for (int u = antigo; u < city_cap; ++u) { d->head[u] = -1; d->grau[u] = 0; }
+}
+
+// acompanha city_cap: cidades novas começam sem arestas no delta
+static void delta_garante_cidades(int antigo) {
+    delta_garante_em(&delta, antigo);
+    if (grafo_direcionado) delta_garante_em(&delta_entrada, antigo);
+}
+
+static inline void viz_inicio(int u, VizinhoIter *it) {
+    it->d = delta.head[u];
+    if (u < csr.n) { it->i = csr.offsets[u]; it->fim = csr.offsets[u+1]; }
+    else { it->i = 0; it->fim = 0; }
+}
+
+static inline int viz_proximo(VizinhoIter *it, int *v, int *w) {
+    if (it->d != -1) {
+        *v = delta.to[it->d];
+        *w = delta.weight[it->d];
+        it->d = delta.next[it->d];
+        return 1;
+    }
+    if (it->i < it->fim) {
+        *v = csr.targets[it->i];
+        *w = csr.weights[it->i];
+        it->i++;
+        return 1;
+    }
+    return 0;
+}
+
+// mesma coisa em ordem de distância: intercala delta e CSR, O(1) por vizinho
+static inline int viz_ordenado_proximo(VizinhoIter *it, int *v, int *w) {
+    if (it->d != -1 && (it->i >= it->fim
+                        || vizinho_antes(delta.to[it->d], delta.weight[it->d], csr.targets[it->i], csr.weights[it->i]))) {
+        *v = delta.to[it->d];
+        *w = delta.weight[it->d];
+        it->d = delta.next[it->d];
+        return 1;
+    }
+    if (it->i < it->fim) {
+        *v = csr.targets[it->i];
+        *w = csr.weights[it->i];
+        it->i++;
+        return 1;
+    }
+    return 0;
+}
+
+// cidades com aresta chegando em u (o próprio viz_* quando não direcionado)
+static inline void viz_entrada_inicio(int u, VizinhoIter *it) {
+    it->d = delta_in->head[u];
+    if (u < csr_in->n) { it->i = csr_in->offsets[u]; it->fim = csr_in->offsets[u+1]; }
+    else { it->i = 0; it->fim = 0; }
+}
+
+static inline int viz_entrada_proximo(VizinhoIter *it, int *v, int *w) {
+    if (it->d != -1) {
+        *v = delta_in->to[it->d];
+        *w = delta_in->weight[it->d];
+        it->d = delta_in->next[it->d];
+        return 1;
+    }
+    if (it->i < it->fim) {
+        *v = csr_in->targets[it->i];
+        *w = csr_in->weights[it->i];
+        it->i++;
+        return 1;
+    }
+    return 0;
+}
+
+// número de conexões de u em O(1) (as que saem, no modo direcionado)
+static inline int grau(int u) {
+    int g = delta.grau[u];
+    if (u < csr.n) g += csr.offsets[u+1] - csr.offsets[u];
+    return g;
+}
+
+// ordena uma lista de vizinhos do CSR (distância, id); tmp tem espaço pra len
+static void lista_ordena(int *targets, int *weights, int len, VizinhoInfo *tmp) {
+    int i = 1;
+    while (i < len && !vizinho_antes(targets[i], weights[i], targets[i-1], weights[i-1])) i++;
+    if (i >= len) return;  // já estava em ordem (recongelamento com delta ordenado)
+    for (i = 0; i < len; ++i) { tmp[i].city_id = targets[i]; tmp[i].distance = weights[i]; }
+    qsort(tmp, len, sizeof(VizinhoInfo), compare_vizinhos);
+    for (i = 0; i < len; ++i) { targets[i] = tmp[i].city_id; weights[i] = tmp[i].distance; }
+}
+
+// funde um CSR com o seu delta num CSR novo com todas as cidades atuais;
+// monta em novo o CSR de g + d sem mexer nos dois (o servidor monta com os
+// leitores ainda usando g); com ordena != 0 cada lista sai em ordem de distância
+static void congela_monta(GrafoCSR *novo, const GrafoCSR *g, const DeltaArestas *d, int ordena) {
+    int n = city_count;
+    int m = g->m + d->len;
+    int *offsets = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *targets = xrealloc(NULL, m * sizeof(int));
+    int *weights = xrealloc(NULL, m * sizeof(int));
+
+    offsets[0] = 0;
+    for (int u = 0; u < n; ++u) {
+        int k = offsets[u];
+        for (int e = d->head[u]; e != -1; e = d->next[e]) { targets[k] = d->to[e]; weights[k] = d->weight[e]; k++; }
+        for (int i = u < g->n ? g->offsets[u] : 0, fim = u < g->n ? g->offsets[u+1] : 0; i < fim; ++i) {
+            targets[k] = g->targets[i]; weights[k] = g->weights[i]; k++;
+        }
+        offsets[u+1] = k;
+    }
+    if (ordena) {
+        int maior = 0;
+        for (int u = 0; u < n; ++u) if (offsets[u+1] - offsets[u] > maior) maior = offsets[u+1] - offsets[u];
+        VizinhoInfo *tmp = xrealloc(NULL, maior * sizeof(VizinhoInfo));
+        for (int u = 0; u < n; ++u)
+            lista_ordena(targets + offsets[u], weights + offsets[u], offsets[u+1] - offsets[u], tmp);
+        free(tmp);
+    }
+    novo->n = n; novo->m = m;
+    novo->offsets = offsets; novo->targets = targets; novo->weights = weights;
+}
+
+// põe novo no lugar de g e esvazia d; os arrays antigos voltam em velho
+static void congela_troca(GrafoCSR *g, DeltaArestas *d, const GrafoCSR *novo, GrafoCSR *velho) {
+    *velho = *g;
+    *g = *novo;
+    d->len = 0;
+    for (int u = 0; u < g->n; ++u) { d->head[u] = -1; d->grau[u] = 0; }
+}
+
+static void csr_libera(GrafoCSR *g) {
+    free(g->offsets); free(g->targets); free(g->weights);
+}
+
+// monta e troca de uma vez (ninguém lendo em paralelo)
+static void congela_em(GrafoCSR *g, DeltaArestas *d, int ordena) {
+    GrafoCSR novo, velho;
+    congela_monta(&novo, g, d, ordena);
+    congela_troca(g, d, &novo, &velho);
+    csr_libera(&velho);
+}
+
+// funde CSR + delta num CSR novo com todas as cidades atuais e esvazia o delta
+void grafo_congela() {
+    METRICA_INICIO(MET_CONGELA);
+    snapshot_desanexa();
+    congela_em(&csr, &delta, 1);
+    if (grafo_direcionado) congela_em(&csr_entrada, &delta_entrada, 0);
+    delta_ordenado = 1;
+    METRICA_FIM(MET_CONGELA);
+}
+
+// delta grande demais em relação ao CSR: hora de recongelar
+static int grafo_delta_grande() {
+    return delta.len > 1024 && delta.len > csr.m / 4;
+}
+
+static void grafo_congela_se_preciso() {
+    if (grafo_delta_grande()) grafo_congela();
+}
+
+// refaz as arestas de entrada (modo direcionado) invertendo o CSR de saída;
+// delta vazio dos dois lados
+static void grafo_transpoe() {
+    int n = csr.n, m = csr.m;
+    free(csr_entrada.offsets); free(csr_entrada.targets); free(csr_entrada.weights);
+    int *offsets = xrealloc(NULL, (n + 1) * sizeof(int));
+    int *targets = xrealloc(NULL, m * sizeof(int));
+    int *weights = xrealloc(NULL, m * sizeof(int));
+    memset(offsets, 0, (n + 1) * sizeof(int));
+    for (int i = 0; i < m; ++i) offsets[csr.targets[i] + 1]++;
+    for (int v = 0; v < n; ++v) offsets[v+1] += offsets[v];
+    int *pos = xrealloc(NULL, (n + 1) * sizeof(int));
+    memcpy(pos, offsets, (n + 1) * sizeof(int));
+    for (int u = 0; u < n; ++u)
+        for (int i = csr.offsets[u]; i < csr.offsets[u+1]; ++i) {
+            int k = pos[csr.targets[i]]++;
+            targets[k] = u;
+            weights[k] = csr.weights[i];
+        }
+    free(pos);
+    csr_entrada.n = n; csr_entrada.m = m;
+    csr_entrada.offsets = offsets; csr_entrada.targets = targets; csr_entrada.weights = weights;
+}
+
+/* Junta conexões repetidas do CSR recém-congelado: entre o mesmo par de
+   cidades fica só a de menor distância, e laços (cidade ligada a ela mesma)
+   saem, porque nunca encurtam caminho. Como cada lista já está em ordem de
+   distância, a primeira ocorrência de um destino é a menor e as outras só
+   são puladas (a lista continua em ordem). Uma passada O(V + E) com marca
+   por destino.
+   No modo não direcionado A,B e B,A são o mesmo par e cada par aparece nas
+   duas listas; a contagem é de conexões, não de entradas. */
+typedef struct {
+    long repetidas;  // conexões descartadas por já existir o par
+    long lacos;
+} Consolidacao;
+
+static Consolidacao grafo_consolida() {
+    Consolidacao c = {0, 0};
+    int n = csr.n;
+    if (n == 0) return c;
+    snapshot_desanexa();
+    int *marca = xrealloc(NULL, n * sizeof(int));  // u + 1 se v já apareceu na lista de u
+    memset(marca, 0, n * sizeof(int));
+    long removidas = 0, lacos = 0;
+    int k = 0;
+    for (int u = 0; u < n; ++u) {
+        int ini = csr.offsets[u], fim = csr.offsets[u+1];
+        csr.offsets[u] = k;
+        for (int i = ini; i < fim; ++i) {
+            int v = csr.targets[i], w = csr.weights[i];
+            if (v == u) { lacos++; continue; }
+            if (marca[v] == u + 1) { removidas++; continue; }
+            marca[v] = u + 1;
+            csr.targets[k] = v;
+            csr.weights[k] = w;
+            k++;
+        }
+    }
+    csr.offsets[n] = k;
+    free(marca);
+    if (k < csr.m) {
+        csr.m = k;
+        csr.targets = xrealloc(csr.targets, k * sizeof(int));
+        csr.weights = xrealloc(csr.weights, k * sizeof(int));
+        grafo_versao++;
+    }
+    if (grafo_direcionado) grafo_transpoe();
+    c.repetidas = grafo_direcionado ? removidas : removidas / 2;
+    c.lacos = grafo_direcionado ? lacos : lacos / 2;
+    return c;
+}
+
+/* --- componentes conexas (união-busca) --- */
+
+/* Componente de cada cidade mantida junto com o grafo: add_edge() une as
+   duas pontas, então saber se duas cidades estão ligadas não exige varrer
+   nada. Depois de mapear um snapshot a estrutura é refeita a partir das
+   arestas na primeira consulta. A busca da raiz não comprime caminho (a
+   união por tamanho já limita a altura a O(log V)), então consultar só lê.
+   No modo direcionado a componente ignora o sentido: cidades em componentes
+   diferentes nunca têm caminho, mas na mesma pode faltar caminho de ida. */
+typedef struct {
+    int *pai;
+    int *tam;
+    int cap;
+    int unioes;  // componentes = city_count - unioes
+    int valido;
+} UniaoBusca;
+
+static UniaoBusca uniao = {NULL, NULL, 0, 0, 1};
+
+static void uniao_garante(int n) {
+    if (n <= uniao.cap) return;
+    uniao.pai = xrealloc(uniao.pai, n * sizeof(int));
+    uniao.tam = xrealloc(uniao.tam, n * sizeof(int));
+    for (int i = uniao.cap; i < n; ++i) { uniao.pai[i] = i; uniao.tam[i] = 1; }
+    uniao.cap = n;
+}
+
+static int uniao_raiz(int v) {
+    while (uniao.pai[v] != v) v = uniao.pai[v];
+    return v;
+}
+
+static void uniao_une(int a, int b) {
+    a = uniao_raiz(a);
+    b = uniao_raiz(b);
+    if (a == b) return;
+    if (uniao.tam[a] < uniao.tam[b]) { int t = a; a = b; b = t; }
+    uniao.pai[b] = a;
+    uniao.tam[a] += uniao.tam[b];
+    uniao.unioes++;
+}
+
+static void uniao_reconstroi() {
+    METRICA_INICIO(MET_COMPONENTES);
+    free(uniao.pai); free(uniao.tam);
+    uniao.pai = uniao.tam = NULL;
+    uniao.cap = 0;
+    uniao.unioes = 0;
+    uniao_garante(city_cap);
+    for (int u = 0; u < city_count; ++u) {
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) if (v > u || grafo_direcionado) uniao_une(u, v);
+    }
+    uniao.valido = 1;
+    METRICA_FIM(MET_COMPONENTES);
+}
+
+// id da componente de v (a raiz); duas cidades estão ligadas se os ids batem
+int componente_de(int v) {
+    if (!uniao.valido) uniao_reconstroi();
+    return v < uniao.cap ? uniao_raiz(v) : v;  // cidade que nunca ganhou aresta
+}
+
+int componentes_total() {
+    if (!uniao.valido) uniao_reconstroi();
+    return city_count - uniao.unioes;
+}
+
+/* --- ranking de graus --- */
+
+/* Cidades em ordem decrescente de conexões e, no mesmo grau, por nome (o
+   desempate da opção 2 desde sempre). As cidades com grau >= g ocupam o
+   prefixo ordem[0 .. lim[g]), cada faixa de grau em ordem de nome. As k
+   mais conectadas são ordem[0 .. k) e a listagem completa (opção 2) anda
+   pelas faixas sem ordenar nada. Montado por contagem na primeira consulta
+   (a carga do grafo já terminou), com cada faixa ordenada por nome. Quando
+   u passa de g pra g + 1, o lugar dela na faixa g + 1 sai de uma busca
+   binária e só as cidades entre esse lugar e o antigo andam uma casa. */
+typedef struct {
+    int *ordem;     // cidades, grau decrescente
+    int *pos;       // posição de cada cidade em ordem
+    int *lim;       // lim[g] = cidades com grau >= g, g = 0..grau_max+1
+    size_t cap_lim;
+    int n, cap;
+    int grau_max;
+    int valido;
+} RankingGraus;
+
+static RankingGraus ranking = {0};
+
+// ordem dentro de uma faixa: nome, depois id
+static int ranking_antes(int a, int b) {
+    int c = strcmp(city_name(a), city_name(b));
+    return c < 0 || (c == 0 && a < b);
+}
+
+static int compara_ranking(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x == y ? 0 : ranking_antes(x, y) ? -1 : 1;
+}
+
+// põe u (que está em p) na posição da sua ordem dentro de ordem[ini .. fim),
+// com ini <= fim <= p; as cidades entre a posição e p andam uma casa
+static void ranking_encaixa(int u, int p, int ini, int fim) {
+    while (ini < fim) {
+        int meio = ini + (fim - ini) / 2;
+        if (ranking_antes(ranking.ordem[meio], u)) ini = meio + 1; else fim = meio;
+    }
+    memmove(ranking.ordem + ini + 1, ranking.ordem + ini, (p - ini) * sizeof(int));
+    ranking.ordem[ini] = u;
+    for (int i = ini; i <= p; ++i) ranking.pos[ranking.ordem[i]] = i;
+}
+
+static void ranking_monta() {
+    int n = city_count;
+    ranking.grau_max = 0;
+    for (int u = 0; u < n; ++u) if (grau(u) > ranking.grau_max) ranking.grau_max = grau(u);
+    GARANTE_CAP(ranking.ordem, ranking.cap, n);
+    ranking.pos = xrealloc(ranking.pos, ranking.cap * sizeof(int));
+    GARANTE_CAP(ranking.lim, ranking.cap_lim, (size_t)ranking.grau_max + 2);
+    memset(ranking.lim, 0, (ranking.grau_max + 2) * sizeof(int));
+    for (int u = 0; u < n; ++u) ranking.lim[grau(u)]++;
+    // lim[g] vira o começo da faixa de g (cidades com grau > g) e, depois de
+    // distribuir, o fim dela
+    for (int g = ranking.grau_max, acima = 0; g >= 0; --g) {
+        int c = ranking.lim[g];
+        ranking.lim[g] = acima;
+        acima += c;
+    }
+    for (int u = 0; u < n; ++u) ranking.ordem[ranking.lim[grau(u)]++] = u;
+    for (int g = 0; g <= ranking.grau_max; ++g)
+        qsort(ranking.ordem + ranking.lim[g + 1], ranking.lim[g] - ranking.lim[g + 1], sizeof(int), compara_ranking);
+    for (int p = 0; p < n; ++p) ranking.pos[ranking.ordem[p]] = p;
+    ranking.n = n;
+    ranking.valido = 1;
+}
+
+// monta se preciso e põe na faixa de grau 0 as cidades criadas desde então
+static void ranking_garante() {
+    if (!ranking.valido) { ranking_monta(); return; }
+    int cap = ranking.cap;
+    GARANTE_CAP(ranking.ordem, ranking.cap, city_count);
+    if (ranking.cap != cap) ranking.pos = xrealloc(ranking.pos, ranking.cap * sizeof(int));
+    for (; ranking.n < city_count; ranking.n++) {
+        ranking_encaixa(ranking.n, ranking.n, ranking.lim[1], ranking.n);
+        ranking.lim[0]++;
+    }
+}
+
+// u acabou de ganhar uma conexão (grau(u) já conta a nova)
+static void ranking_sobe(int u) {
+    if (!ranking.valido) return;
+    int g = grau(u) - 1;
+    if (g + 1 > ranking.grau_max) {
+        ranking.grau_max = g + 1;
+        GARANTE_CAP(ranking.lim, ranking.cap_lim, (size_t)ranking.grau_max + 2);
+        ranking.lim[ranking.grau_max + 1] = 0;
+    }
+    // a faixa g + 1 ganha uma casa no fim, tomada do começo da faixa g
+    ranking_encaixa(u, ranking.pos[u], ranking.lim[g + 2], ranking.lim[g + 1]);
+    ranking.lim[g + 1]++;
+}
+
+void rota_cache_aresta(int a, int b, int w);
+static void geo_escala_aresta(int a, int b, int w);
+
+// adiciona aresta no overlay (nos dois sentidos, ou a -> b no modo
+// direcionado); grafo_congela() leva pro CSR
+void add_edge(int a, int b, int w) {
+    rota_cache_aresta(a, b, w);
+    if (ranking.valido) ranking_garante();
+    delta_insere(a, b, w);
+    ranking_sobe(a);
+    if (grafo_direcionado) delta_insere_em(&delta_entrada, b, a, w);
+    else { delta_insere(b, a, w); ranking_sobe(b); }
+    if (w < 0) tem_peso_negativo = 1;
+    geo_escala_aresta(a, b, w);
+    if (uniao.valido) {
+        uniao_garante(city_cap);
+        uniao_une(a, b);
+    }
+    grafo_versao++;
+}
+
+/* --- carga do CSV --- */
+
+// campos da linha atual do CSV, copiados pra buffers que crescem
+#define CSV_MAX_CAMPOS 8
+typedef struct {
+    char *buf[CSV_MAX_CAMPOS];
+    size_t cap[CSV_MAX_CAMPOS];
+    int len[CSV_MAX_CAMPOS];
+    int nf;        // campos lidos (pode passar de CSV_MAX_CAMPOS; o excesso é descartado)
+} CamposCSV;
+
+typedef struct {
+    long long bytes;
+    long linhas;      // linhas de dados aceitas
+    long invalidas;   // linhas ignoradas por erro de formato
+    double segundos;
+} CargaStats;
+
+const char *arquivo_csv = "cidades_rs_grafo.csv";
+
+#define CSV_AVISOS_MAX 10     // quantas linhas inválidas detalho antes de só contar
+#define CSV_BLOCO (4 << 20)   // leitura bufferizada (pipes, Windows)
+
+// começa um campo novo (vazio) e devolve o índice dele
+static int campo_novo(CamposCSV *c) {
+    int k = c->nf++;
+    if (k < CSV_MAX_CAMPOS) {
+        GARANTE_CAP(c->buf[k], c->cap[k], 1);
+        c->buf[k][0] = '\0';
+        c->len[k] = 0;
+    }
+    return k;
+}
+
+static void campo_acrescenta(CamposCSV *c, int k, const char *s, int len) {
+    if (k >= CSV_MAX_CAMPOS) return;
+    GARANTE_CAP(c->buf[k], c->cap[k], (size_t)c->len[k] + len + 1);
+    memcpy(c->buf[k] + c->len[k], s, len);
+    c->len[k] += len;
+    c->buf[k][c->len[k]] = '\0';
+}
+
+/* Lê um registro a partir de p. Retorna 1 se leu (prox aponta pro próximo),
+   0 se o registro não terminou dentro do bloco e ainda vem mais dado.
+   quebras recebe quantas linhas físicas o registro ocupou.
+   Caminho rápido: linha sem aspas é cortada só com memchr (vetorizado na libc);
+   com aspas, uma máquina de estados aceita "" e quebra de linha dentro do campo. */
+static int csv_registro(const char *p, const char *fim, int final, CamposCSV *c,
+                        const char **prox, int *quebras) {
+    const char *nl = memchr(p, '\n', fim - p);
+    if (nl == NULL && !final) return 0;
+    const char *lin_fim = nl ? nl : fim;
+    c->nf = 0;
+
+    if (memchr(p, '"', lin_fim - p) == NULL) {
+        const char *e = lin_fim;
+        if (e > p && e[-1] == '\r') e--;
+        const char *s = p;
+        for (;;) {
+            const char *virg = memchr(s, ',', e - s);
+            int k = campo_novo(c);
+            if (virg == NULL) { campo_acrescenta(c, k, s, e - s); break; }
+            campo_acrescenta(c, k, s, virg - s);
+            s = virg + 1;
+        }
+        *prox = nl ? nl + 1 : fim;
+        *quebras = 1;
+        return 1;
+    }
+
+    int linhas = 1;
+    int entre_aspas = 0;
+    const char *s = p;
+    int k = campo_novo(c);
+    for (;;) {
+        if (s == fim) {
+            if (!final) return 0;
+            break;
+        }
+        char ch = *s++;
+        if (entre_aspas) {
+            if (ch == '"') {
+                if (s == fim && !final) return 0;
+                if (s < fim && *s == '"') { campo_acrescenta(c, k, "\"", 1); s++; }
+                else entre_aspas = 0;
+            } else {
+                if (ch == '\n') linhas++;
+                campo_acrescenta(c, k, &ch, 1);
+            }
+        } else if (ch == '"') {
+            entre_aspas = 1;
+        } else if (ch == ',') {
+            k = campo_novo(c);
+        } else if (ch == '\n') {
+            break;
+        } else if (ch != '\r' || (s < fim && *s != '\n')) {
+            campo_acrescenta(c, k, &ch, 1);
+        }
+    }
+    *prox = s;
+    *quebras = linhas;
+    return 1;
+}
+
+// devolve o campo k sem espaços nas pontas (altera o buffer do campo)
+static char *campo_trim(CamposCSV *c, int k, int *len) {
+    char *s = c->buf[k];
+    int n = c->len[k];
+    while (n > 0 && isspace((unsigned char)s[n-1])) n--;
+    s[n] = '\0';
+    while (*s && isspace((unsigned char)*s)) { s++; n--; }
+    *len = n;
+    return s;
+}
+
+// inteiro decimal com sinal opcional, sem depender de locale; 0 se inválido
+static int parse_int(const char *s, int len, int *out) {
+    int i = 0, neg = 0;
+    long long v = 0;
+    if (i < len && (s[i] == '-' || s[i] == '+')) { neg = s[i] == '-'; i++; }
+    if (i == len) return 0;
+    for (; i < len; ++i) {
+        unsigned d = (unsigned)(s[i] - '0');
+        if (d > 9) return 0;
+        v = v * 10 + d;
+        if (v > INT_MAX) return 0;
+    }
+    *out = neg ? (int)-v : (int)v;
+    return 1;
+}
+
+// lat/lon em graus nos campos k e k+1; campos vazios = sem coordenada (NAN)
+static int parse_coord(CamposCSV *c, int k, Coord *out) {
+    double v[2];
+    for (int i = 0; i < 2; ++i) {
+        int len;
+        char *s = campo_trim(c, k + i, &len), *fim;
+        if (len == 0) { out->lat = out->lon = NAN; return 1; }
+        v[i] = strtod(s, &fim);
+        if (fim != s + len) return 0;
+    }
+    if (v[0] < -90 || v[0] > 90 || v[1] < -180 || v[1] > 180) return 0;
+    out->lat = v[0];
+    out->lon = v[1];
+    return 1;
+}
+
+// primeira coordenada conhecida de uma cidade vale
+static void city_define_coord(int id, Coord c) {
+    if (isnan(c.lat) || !isnan(city_coords[id].lat)) return;
+    city_coords[id] = c;
+    cidades_com_coord++;
+}
+
+typedef struct {
+    CamposCSV campos;
+    CargaStats *st;
+    const char *arquivo;  // pra mensagens
+    long linha;           // linha física do próximo registro
+    int cabecalho;        // a primeira linha ainda não foi pulada
+} EstadoCarga;
+
+static void csv_aviso(EstadoCarga *e, long linha, const char *motivo) {
+    e->st->invalidas++;
+    if (e->st->invalidas <= CSV_AVISOS_MAX)
+        fprintf(stderr, "Aviso: %s:%ld ignorada (%s)\n", e->arquivo, linha, motivo);
+}
+
+// valida os campos do registro e cria a aresta
+static void csv_processa(EstadoCarga *e, long linha) {
+    CamposCSV *c = &e->campos;
+    if (e->cabecalho) { e->cabecalho = 0; return; }
+    if (c->nf == 1 && c->len[0] == 0) return;  // linha em branco
+    if (c->nf != 3 && c->nf != 7) {
+        csv_aviso(e, linha, "esperava origem,destino,distancia[,lat_o,lon_o,lat_d,lon_d]");
+        return;
+    }
+
+    int la, lb, ld, distancia;
+    char *a = campo_trim(c, 0, &la);
+    char *b = campo_trim(c, 1, &lb);
+    char *d = campo_trim(c, 2, &ld);
+    if (la == 0 || lb == 0) { csv_aviso(e, linha, "nome de cidade vazio"); return; }
+    if (!parse_int(d, ld, &distancia)) { csv_aviso(e, linha, "distancia invalida"); return; }
+    Coord co, cd;
+    if (c->nf == 7 && !(parse_coord(c, 3, &co) && parse_coord(c, 5, &cd))) {
+        csv_aviso(e, linha, "coordenada invalida");
+        return;
+    }
+
+    int id_origem = city_index(a);
+    int id_destino = city_index(b);
+    add_edge(id_origem, id_destino, distancia);
+    if (c->nf == 7) { city_define_coord(id_origem, co); city_define_coord(id_destino, cd); }
+    e->st->linhas++;
+}
+
+// consome os registros completos do bloco; devolve quantos bytes foram usados
+static size_t csv_bloco(EstadoCarga *e, const char *p, size_t n, int final) {
+    const char *ini = p, *fim = p + n, *prox;
+    int quebras;
+    while (p < fim && csv_registro(p, fim, final, &e->campos, &prox, &quebras)) {
+        csv_processa(e, e->linha);
+        e->linha += quebras;
+        p = prox;
+    }
+    return p - ini;
+}
+
+/* Carrega o CSV origem,destino,distancia. Arquivo regular é mapeado na memória
+   (mmap) e lido de uma vez; pipe ou sistema sem mmap cai em leituras grandes
+   com fread. A primeira linha é o cabeçalho. Retorna -1 se não abrir. */
+int carrega_csv(const char *caminho, CargaStats *st) {
+    memset(st, 0, sizeof(*st));
+    METRICA_INICIO(MET_CARGA_CSV);
+    double t0 = agora_seg();
+    EstadoCarga e;
+    memset(&e, 0, sizeof(e));
+    e.st = st;
+    e.arquivo = caminho;
+    e.linha = 1;
+    e.cabecalho = 1;
+
+    FILE *f = NULL;
+#ifndef _WIN32
+    int fd = open(caminho, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        void *m = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, sb.st_size, MADV_SEQUENTIAL);
+            csv_bloco(&e, m, sb.st_size, 1);
+            st->bytes = sb.st_size;
+            munmap(m, sb.st_size);
+            close(fd);
+            goto fim;
+        }
+    }
+    f = fdopen(fd, "rb");
+    if (f == NULL) { close(fd); return -1; }
+#else
+    f = fopen(caminho, "rb");
+    if (f == NULL) return -1;
+#endif
+
+    size_t cap = CSV_BLOCO, len = 0;
+    char *buf = xrealloc(NULL, cap);
+    for (;;) {
+        size_t lidos = fread(buf + len, 1, cap - len, f);
+        st->bytes += lidos;
+        len += lidos;
+        int final = feof(f) || ferror(f);
+        size_t usado = csv_bloco(&e, buf, len, final);
+        memmove(buf, buf + usado, len - usado);
+        len -= usado;
+        if (final) break;
+        if (len == cap) { cap *= 2; buf = xrealloc(buf, cap); }  // registro maior que o bloco
+    }
+    free(buf);
+    fclose(f);
+
+#ifndef _WIN32
+fim:
+#endif
+    for (int k = 0; k < CSV_MAX_CAMPOS; ++k) free(e.campos.buf[k]);
+    st->segundos = agora_seg() - t0;
+    if (st->invalidas > CSV_AVISOS_MAX)
+        fprintf(stderr, "Aviso: mais %ld linha(s) invalida(s) omitida(s)\n", st->invalidas - CSV_AVISOS_MAX);
+    METRICA_FIM(MET_CARGA_CSV);
+    return 0;
+}
+
+/* --- snapshot binário do grafo --- */
+
+/* Formato (versão 5, inteiros na ordem de bytes da máquina que gravou):
+   cabeçalho | arena de nomes | NomeRef nomes[n] | NomeRef chaves[n] |
+   slots[indice_cap] | hashes[indice_cap] | offsets[n+1] | targets[m] | weights[m] |
+   Coord coords[n]
+   Cada seção começa alinhada em 8 bytes. O checksum cobre tudo depois do
+   cabeçalho. O arquivo é mapeado só leitura e os arrays globais apontam
+   direto pra dentro dele; antes de qualquer mudança que precise realocar
+   (cidade nova, recongelar) snapshot_desanexa() copia tudo pro heap. */
+#define SNAPSHOT_MAGIC "GRAFOA3"
+#define SNAPSHOT_VERSAO 5  // 5: vizinhos em ordem de distância
+#define SNAPSHOT_BOM 0x01020304u
+
+typedef struct {
+    char magic[8];
+    uint32_t versao;
+    uint32_t bom;          // detecta ordem de bytes diferente
+    uint32_t n, m;
+    uint32_t indice_cap;
+    uint32_t flags;        // bit 0: tem_peso_negativo; bit 1: grafo direcionado
+    uint64_t csv_tamanho;  // CSV de onde o snapshot saiu
+    int64_t csv_mtime;
+    uint64_t off_arena, len_arena;
+    uint64_t off_nomes, off_chaves;
+    uint64_t off_slots, off_hashes;
+    uint64_t off_offsets, off_targets, off_weights;
+    uint64_t off_coords;
+    uint64_t tamanho;      // tamanho total do arquivo
+    uint64_t checksum;
+} CabecalhoSnapshot;
+
+// região de onde os arrays do grafo estão sendo lidos (NULL = tudo no heap)
+typedef struct {
+    void *mapa;
+    size_t len;
+    int mapeado;  // 1 = mmap, 0 = lido pro heap (sem mmap)
+} SnapshotAtivo;
+
+static SnapshotAtivo snapshot = {0};
+int usar_snapshot = 1;
+
+#define SNAPSHOT_ALINHA(x) (((x) + 7) & ~(uint64_t)7)
+
+// FNV-1a de 64 bits consumindo 8 bytes por passo
+static uint64_t checksum_bytes(const unsigned char *p, size_t n) {
+    uint64_t h = 1469598103934665603ull;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 1099511628211ull;
+    }
+    for (; i < n; ++i) h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+static void *copia_heap(const void *src, size_t n) {
+    void *p = xrealloc(NULL, n);
+    memcpy(p, src, n);
+    return p;
+}
+
+// passa os arrays que apontam pro snapshot pro heap e solta o mapeamento
+void snapshot_desanexa() {
+    if (snapshot.mapa == NULL) return;
+    int n = city_count;
+    arena_nomes.buf = copia_heap(arena_nomes.buf, arena_nomes.len);
+    arena_nomes.cap = arena_nomes.len;
+    city_names = copia_heap(city_names, n * sizeof(NomeRef));
+    city_keys = copia_heap(city_keys, n * sizeof(NomeRef));
+    indice_nomes.slots = copia_heap(indice_nomes.slots, indice_nomes.cap * sizeof(int));
+    indice_nomes.hashes = copia_heap(indice_nomes.hashes, indice_nomes.cap * sizeof(unsigned));
+    csr.offsets = copia_heap(csr.offsets, (csr.n + 1) * sizeof(int));
+    csr.targets = copia_heap(csr.targets, csr.m * sizeof(int));
+    csr.weights = copia_heap(csr.weights, csr.m * sizeof(int));
+    city_coords = copia_heap(city_coords, n * sizeof(Coord));
+#ifndef _WIN32
+    if (snapshot.mapeado) munmap(snapshot.mapa, snapshot.len);
+    else free(snapshot.mapa);
+#else
+    free(snapshot.mapa);
+#endif
+    snapshot.mapa = NULL;
+}
+
+// nome do snapshot que acompanha o CSV
+static void snapshot_caminho(const char *csv, char *out, size_t cap) {
+    snprintf(out, cap, "%s.snap", csv);
+}
+
+static int grava_secao(FILE *f, uint64_t *pos, const void *p, size_t n, uint64_t *off) {
+    static const char zeros[8] = {0};
+    uint64_t alinhado = SNAPSHOT_ALINHA(*pos);
+    if (alinhado > *pos && fwrite(zeros, 1, alinhado - *pos, f) != alinhado - *pos) return -1;
+    *off = alinhado;
+    if (n > 0 && fwrite(p, 1, n, f) != n) return -1;
+    *pos = alinhado + n;
+    return 0;
+}
+
+/* Grava o grafo congelado (delta precisa estar vazio) num arquivo temporário
+   e renomeia por cima do snapshot antigo. Retorna 0 se deu certo. */
+int snapshot_grava(const char *caminho, const char *csv) {
+    METRICA_INICIO(MET_SNAPSHOT_GRAVA);
+    struct stat sb;
+    if (stat(csv, &sb) != 0) return -1;
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", caminho);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) return -1;
+
+    CabecalhoSnapshot h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.versao = SNAPSHOT_VERSAO;
+    h.bom = SNAPSHOT_BOM;
+    h.n = csr.n;
+    h.m = csr.m;
+    h.indice_cap = indice_nomes.cap;
+    h.flags = (tem_peso_negativo ? 1 : 0) | (grafo_direcionado ? 2 : 0);
+    h.csv_tamanho = sb.st_size;
+    h.csv_mtime = sb.st_mtime;
+    h.len_arena = arena_nomes.len;
+
+    // cabeçalho provisório; o definitivo vai no fim, com offsets e checksum
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint64_t pos = sizeof(h);
+    ok = ok && grava_secao(f, &pos, arena_nomes.buf, arena_nomes.len, &h.off_arena) == 0;
+    ok = ok && grava_secao(f, &pos, city_names, (size_t)h.n * sizeof(NomeRef), &h.off_nomes) == 0;
+    ok = ok && grava_secao(f, &pos, city_keys, (size_t)h.n * sizeof(NomeRef), &h.off_chaves) == 0;
+    ok = ok && grava_secao(f, &pos, indice_nomes.slots, (size_t)h.indice_cap * sizeof(int), &h.off_slots) == 0;
+    ok = ok && grava_secao(f, &pos, indice_nomes.hashes, (size_t)h.indice_cap * sizeof(unsigned), &h.off_hashes) == 0;
+    ok = ok && grava_secao(f, &pos, csr.offsets, ((size_t)h.n + 1) * sizeof(int), &h.off_offsets) == 0;
+    ok = ok && grava_secao(f, &pos, csr.targets, (size_t)h.m * sizeof(int), &h.off_targets) == 0;
+    ok = ok && grava_secao(f, &pos, csr.weights, (size_t)h.m * sizeof(int), &h.off_weights) == 0;
+    ok = ok && grava_secao(f, &pos, city_coords, (size_t)h.n * sizeof(Coord), &h.off_coords) == 0;
+    h.tamanho = pos;
+    ok = ok && fflush(f) == 0;
+
+    // checksum relendo o que foi escrito (mais simples que acumular por seção)
+    if (ok) {
+        size_t corpo = pos - sizeof(h);
+        unsigned char *buf = xrealloc(NULL, corpo);
+        FILE *r = fopen(tmp, "rb");
+        ok = r != NULL && fseek(r, sizeof(h), SEEK_SET) == 0 && fread(buf, 1, corpo, r) == corpo;
+        if (r) fclose(r);
+        if (ok) h.checksum = checksum_bytes(buf, corpo);
+        free(buf);
+    }
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) { remove(tmp); return -1; }
+#ifdef _WIN32
+    remove(caminho);
+#endif
+    if (rename(tmp, caminho) != 0) { remove(tmp); return -1; }
+    METRICA_FIM(MET_SNAPSHOT_GRAVA);
+    return 0;
+}
+
+// o snapshot existe e foi gerado a partir do CSV atual?
+int snapshot_atual(const char *caminho, const char *csv) {
+    struct stat s_csv, s_snap;
+    if (stat(csv, &s_csv) != 0 || stat(caminho, &s_snap) != 0) return 0;
+    if (!S_ISREG(s_csv.st_mode)) return 0;
+    return s_snap.st_mtime >= s_csv.st_mtime;
+}
+
+/* Mapeia o snapshot e aponta os arrays do grafo pra dentro dele.
+   Retorna 0 se carregou; qualquer inconsistência devolve -1 sem mexer no grafo. */
+int snapshot_carrega(const char *caminho, const char *csv) {
+    METRICA_INICIO(MET_SNAPSHOT_CARREGA);
+    struct stat s_csv;
+    if (stat(csv, &s_csv) != 0) return -1;
+
+    void *mapa = NULL;
+    size_t len = 0;
+    int mapeado = 0;
+#ifndef _WIN32
+    int fd = open(caminho, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(CabecalhoSnapshot)) { close(fd); return -1; }
+    len = sb.st_size;
+    mapa = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapa == MAP_FAILED) return -1;
+    mapeado = 1;
+#else
+    FILE *f = fopen(caminho, "rb");
+    if (f == NULL) return -1;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len < sizeof(CabecalhoSnapshot)) { fclose(f); return -1; }
+    mapa = xrealloc(NULL, len);
+    if (fread(mapa, 1, len, f) != len) { fclose(f); free(mapa); return -1; }
+    fclose(f);
+#endif
+
+    const unsigned char *base = mapa;
+    const CabecalhoSnapshot *h = mapa;
+    int ok = memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+          && h->versao == SNAPSHOT_VERSAO && h->bom == SNAPSHOT_BOM
+          && ((h->flags >> 1) & 1) == (uint32_t)grafo_direcionado
+          && h->tamanho == len
+          && h->csv_tamanho == (uint64_t)s_csv.st_size && h->csv_mtime == (int64_t)s_csv.st_mtime
+          && h->off_coords + (uint64_t)h->n * sizeof(Coord) <= len
+          && (h->indice_cap & (h->indice_cap - 1)) == 0 && h->indice_cap >= 2 * (uint64_t)h->n
+          && checksum_bytes(base + sizeof(*h), len - sizeof(*h)) == h->checksum;
+    if (!ok) {
+#ifndef _WIN32
+        munmap(mapa, len);
+#else
+        free(mapa);
+#endif
+        return -1;
+    }
+
+    snapshot.mapa = mapa;
+    snapshot.len = len;
+    snapshot.mapeado = mapeado;
+
+    arena_nomes.buf = (char *)(base + h->off_arena);
+    arena_nomes.len = h->len_arena;
+    arena_nomes.cap = h->len_arena;
+    city_names = (NomeRef *)(base + h->off_nomes);
+    city_keys = (NomeRef *)(base + h->off_chaves);
+    city_count = h->n;
+    city_cap = h->n;
+    indice_nomes.slots = (int *)(base + h->off_slots);
+    indice_nomes.hashes = (unsigned *)(base + h->off_hashes);
+    indice_nomes.cap = h->indice_cap;
+    indice_nomes.usados = h->n;
+    csr.n = h->n;
+    csr.m = h->m;
+    csr.offsets = (int *)(base + h->off_offsets);
+    csr.targets = (int *)(base + h->off_targets);
+    csr.weights = (int *)(base + h->off_weights);
+    tem_peso_negativo = h->flags & 1;
+    city_coords = (Coord *)(base + h->off_coords);
+    cidades_com_coord = 0;
+    for (int i = 0; i < city_count; ++i) if (!isnan(city_coords[i].lat)) cidades_com_coord++;
+    delta_garante_cidades(0);
+    delta_ordenado = 1;  // as listas foram gravadas já ordenadas
+    if (grafo_direcionado) grafo_transpoe();  // só o sentido de saída vai pro arquivo
+    uniao.valido = 0;  // refeita na primeira consulta
+    METRICA_FIM(MET_SNAPSHOT_CARREGA);
+    return 0;
+}
+
+/* Levenshtein - tabela completa; versão de referência pro --bench=levenshtein */
+int levenshtein(const char *s, const char *t) {
+    int n = strlen(s), m = strlen(t);
+    if (n == 0) return m;
+    if (m == 0) return n;
+    int *v0 = malloc((m+1)*sizeof(int));
+    int *v1 = malloc((m+1)*sizeof(int));
+    for (int j=0;j<=m;++j) v0[j] = j;
+    for (int i=1;i<=n;++i) {
+        v1[0] = i;
+        for (int j=1;j<=m;++j) {
+            int cost = (s[i-1] == t[j-1]) ? 0 : 1;
+            int deletion = v0[j] + 1;
+            int insertion = v1[j-1] + 1;
+            int substitution = v0[j-1] + cost;
+            int v = deletion;
+            if (insertion < v) v = insertion;
+            if (substitution < v) v = substitution;
+            v1[j] = v;
+        }
+        memcpy(v0, v1, (m+1)*sizeof(int));
+    }
+    int res = v0[m];
+    free(v0); free(v1);
+    return res;
+}
+
+/* Distância de edição limitada: devolve a distância se for <= limite, senão
+   limite + 1. Não aloca nada pra nomes de até LEV_PILHA bytes.
+   - o menor dos dois com até 64 bytes: bit-paralelo (Myers/Hyyrö), uma
+     coluna da tabela por palavra de 64 bits;
+   - senão: programação dinâmica só na faixa |i - j| <= limite, parando
+     quando a linha inteira passa do limite.
+   Nos dois casos para cedo quando nem o resto do texto consegue trazer a
+   distância de volta pra dentro do limite. */
+#define LEV_PILHA 256
+
+static int lev_bits(const char *p, int m, const char *t, int n, int limite) {
+    // tabela por thread que fica zerada entre chamadas: só as letras do
+    // padrão são postas e tiradas, em vez de limpar 2 KB a cada par
+    static _Thread_local uint64_t peq[256];
+    for (int i = 0; i < m; ++i) peq[(unsigned char)p[i]] |= 1ULL << i;
+    uint64_t pv = m == 64 ? ~0ULL : (1ULL << m) - 1, mv = 0;
+    uint64_t ultimo = 1ULL << (m - 1);
+    int score = m;
+    for (int j = 0; j < n; ++j) {
+        uint64_t eq = peq[(unsigned char)t[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & ultimo) score++;
+        else if (mh & ultimo) score--;
+        // cada coluna restante baixa a última linha em no máximo 1
+        if (score - (n - j - 1) > limite) { score = limite + 1; break; }
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    for (int i = 0; i < m; ++i) peq[(unsigned char)p[i]] = 0;
+    return score <= limite ? score : limite + 1;
+}
+
+static int lev_faixa(const char *s, int n, const char *t, int m, int k, int linha[]) {
+    for (int j = 0; j <= m; ++j) linha[j] = j <= k ? j : k + 1;
+    for (int i = 1; i <= n; ++i) {
+        int lo = i - k > 1 ? i - k : 1;
+        int hi = i + k < m ? i + k : m;
+        int diag = linha[lo - 1];                       // D[i-1][lo-1]
+        int esq = lo == 1 && i <= k ? i : k + 1;        // D[i][lo-1]
+        linha[lo - 1] = esq;
+        int menor = esq;
+        for (int j = lo; j <= hi; ++j) {
+            int cima = linha[j];
+            int v = diag + (s[i-1] != t[j-1]);
+            if (cima + 1 < v) v = cima + 1;
+            if (esq + 1 < v) v = esq + 1;
+            if (v > k + 1) v = k + 1;
+            diag = cima;
+            linha[j] = esq = v;
+            if (v < menor) menor = v;
+        }
+        if (hi < m) linha[hi + 1] = k + 1;              // fora da faixa na linha i
+        if (menor > k) return k + 1;
+    }
+    return linha[m] <= k ? linha[m] : k + 1;
+}
+
+int levenshtein_limitado(const char *s, int n, const char *t, int m, int limite) {
+    if (limite < 0) return 0;
+    // o texto é o maior dos dois
+    if (n > m) { const char *x = s; s = t; t = x; int y = n; n = m; m = y; }
+    if (limite > m) limite = m;  // a distância nunca passa do maior tamanho
+    if (m - n > limite) return limite + 1;
+    if (n == 0) return m;
+    if (n <= 64) return lev_bits(s, n, t, m, limite);
+    if (m < LEV_PILHA) {
+        int linha[LEV_PILHA];
+        return lev_faixa(s, n, t, m, limite, linha);
+    }
+    int *linha = xrealloc(NULL, (m + 1) * sizeof(int));
+    int r = lev_faixa(s, n, t, m, limite, linha);
+    free(linha);
+    return r;
+}
+
+/* Compara levenshtein() com levenshtein_limitado() em pares de nomes do
+   grafo (metade com erros de digitação), conferindo que dão o mesmo
+   resultado dentro do limite. Roda com --bench=levenshtein. */
+int bench_levenshtein(int pares) {
+    if (city_count == 0) { fprintf(stderr, "ERRO: grafo sem cidades\n"); return 1; }
+    char (*a)[CHAVE_BUF] = xrealloc(NULL, pares * sizeof(*a));
+    char (*b)[CHAVE_BUF] = xrealloc(NULL, pares * sizeof(*b));
+    int *la = xrealloc(NULL, pares * sizeof(int)), *lb = xrealloc(NULL, pares * sizeof(int));
+    srand(12345);
+    for (int i = 0; i < pares; ++i) {
+        snprintf(a[i], CHAVE_BUF, "%s", city_key(rand() % city_count));
+        if (i % 2) {
+            snprintf(b[i], CHAVE_BUF, "%s", city_key(rand() % city_count));
+            continue;
+        }
+        // mesma cidade com até 3 trocas de letra
+        snprintf(b[i], CHAVE_BUF, "%s", a[i]);
+        int len = strlen(b[i]);
+        for (int e = rand() % 4; len > 0 && e > 0; --e) b[i][rand() % len] = 'a' + rand() % 26;
+    }
+    for (int i = 0; i < pares; ++i) { la[i] = strlen(a[i]); lb[i] = strlen(b[i]); }
+    int limites[] = {2, 4, INT_MAX};
+    volatile long soma = 0;
+    double t0 = agora_seg();
+    for (int i = 0; i < pares; ++i) soma += levenshtein(a[i], b[i]);
+    double ref = agora_seg() - t0;
+    printf("levenshtein (tabela completa): %8.1f ns/par\n", ref * 1e9 / pares);
+    int erros = 0;
+    for (int l = 0; l < 3; ++l) {
+        t0 = agora_seg();
+        for (int i = 0; i < pares; ++i)
+            soma += levenshtein_limitado(a[i], la[i], b[i], lb[i], limites[l]);
+        double seg = agora_seg() - t0;
+        for (int i = 0; i < pares; ++i) {
+            int d = levenshtein(a[i], b[i]);
+            int esperado = d <= limites[l] ? d : limites[l] + 1;
+            if (levenshtein_limitado(a[i], la[i], b[i], lb[i], limites[l]) != esperado) erros++;
+        }
+        if (limites[l] == INT_MAX) printf("limitado, sem limite:          ");
+        else printf("limitado, limite %d:            ", limites[l]);
+        printf("%8.1f ns/par (%.1fx)\n", seg * 1e9 / pares, ref / (seg > 0 ? seg : 1e-9));
+    }
+    printf("%d pares, %d divergencia(s)\n", pares, erros);
+    free(a); free(b); free(la); free(lb);
+    return erros ? 1 : 0;
+}
+
+/* --- busca aproximada de nomes (índice de trigramas) --- */
+
+/* Cada chave normalizada entra no índice pelos seus trigramas, com duas
+   marcas de borda de cada lado ("##sa", ..., "ia##"), e cada trigrama guarda
+   a lista crescente das cidades que o têm. A ordem dos candidatos é a mesma
+   da varredura antiga: nome exato, depois quem contém o texto digitado (por
+   id), depois quem está a até 'limiar' edições (por distância, depois id).
+   - contém o texto: a cidade tem todos os trigramas do texto; ando pela
+     lista mais curta e confiro as outras por busca binária;
+   - erro de digitação: uma edição destrói no máximo 3 trigramas do texto,
+     então quem está a d edições tem pelo menos T = trigramas(texto) - 3d em
+     comum. Conto os trigramas em comum uma vez e subo d de 1 até o limiar,
+     parando assim que já tenho candidatos suficientes; só quando T <= 0
+     (texto curto, d alto) caio na varredura, filtrada pelo tamanho.
+   O índice é montado na primeira busca e recebe as cidades novas depois. */
+#define TRIGRAMA_BORDA 1         // byte de borda (não aparece em nome)
+#define TRIGRAMA_VAZIO 0xFFFFFFFFu
+#define FUZZY_TOPK 5             // candidatos mostrados quando o nome é ambíguo
+
+typedef struct {
+    int city_id;
+    int distancia;  // edições até o texto (quem contém o texto: sobra de letras)
+} CandidatoNome;
+
+typedef struct {
+    int *ids;
+    int len, cap;
+} ListaTrigrama;
+
+typedef struct {
+    uint32_t *codigos;     // trigrama em 24 bits ou TRIGRAMA_VAZIO (sondagem linear)
+    ListaTrigrama *listas; // paralelo a codigos
+    int cap, usados;       // cap potência de 2
+    int indexadas;         // cidades [0, indexadas) já estão no índice
+} IndiceTrigramas;
+
+static IndiceTrigramas trigramas;
+
+// listas vazias já alocadas pra trigramas que ainda não estão no índice: o
+// servidor separa antes da trava exclusiva (ver escrita_reserva)
+#define TRIGRAMA_LISTA_INICIAL 4
+static struct {
+    int **ids;
+    int n;
+    size_t cap;
+} listas_prontas;
+
+// trigramas do nome que está entrando no índice (o servidor também reserva)
+static uint32_t *trigramas_nome = NULL;
+static size_t cap_trigramas_nome = 0;
+
+// memória de trabalho de uma busca, indexada por cidade; o índice acima só
+// é lido na busca, então cada thread que procura nomes precisa só desta
+typedef struct {
+    int *conta, *edicoes, *tocadas, *nivel;
+    unsigned *marca, *marca_ed, *visto;
+    unsigned rodada;
+    int cap;
+    uint32_t *t;           // trigramas do texto
+    size_t cap_t;
+} FuzzyScratch;
+
+static FuzzyScratch fuzzy_scratch_padrao;
+
+// trigramas com borda de s[0..len) em out (len + 2 códigos)
+static int trigramas_de(const char *s, int len, uint32_t out[]) {
+    uint32_t janela = (TRIGRAMA_BORDA << 8) | TRIGRAMA_BORDA;
+    int n = 0;
+    for (int i = 0; i < len + 2; ++i) {
+        uint32_t c = i < len ? (unsigned char)s[i] : TRIGRAMA_BORDA;
+        janela = ((janela << 8) | c) & 0xFFFFFF;
+        out[n++] = janela;
+    }
+    return n;
+}
+
+static int compara_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// ordena e tira repetidos
+static int trigramas_unicos(uint32_t t[], int n) {
+    qsort(t, n, sizeof(uint32_t), compara_u32);
+    int k = 0;
+    for (int i = 0; i < n; ++i) if (k == 0 || t[k-1] != t[i]) t[k++] = t[i];
+    return k;
+}
+
+static int trigrama_slot_em(const IndiceTrigramas *x, uint32_t codigo) {
+    unsigned s = (codigo * 2654435761u) & (x->cap - 1);
+    while (x->codigos[s] != TRIGRAMA_VAZIO && x->codigos[s] != codigo)
+        s = (s + 1) & (x->cap - 1);
+    return s;
+}
+
+static int trigrama_slot(uint32_t codigo) {
+    return trigrama_slot_em(&trigramas, codigo);
+}
+
+// monta em *novo uma tabela de cap slots com os trigramas da atual; as
+// listas passam pra nova sem cópia
+static void trigramas_monta(IndiceTrigramas *novo, int cap) {
+    *novo = trigramas;
+    novo->cap = cap;
+    novo->codigos = xrealloc(NULL, cap * sizeof(uint32_t));
+    novo->listas = xrealloc(NULL, cap * sizeof(ListaTrigrama));
+    for (int s = 0; s < cap; ++s) novo->codigos[s] = TRIGRAMA_VAZIO;
+    for (int s = 0; s < trigramas.cap; ++s) {
+        if (trigramas.codigos[s] == TRIGRAMA_VAZIO) continue;
+        int t = trigrama_slot_em(novo, trigramas.codigos[s]);
+        novo->codigos[t] = trigramas.codigos[s];
+        novo->listas[t] = trigramas.listas[s];
+    }
+}
+
+static void trigramas_cresce() {
+    IndiceTrigramas novo;
+    trigramas_monta(&novo, trigramas.cap ? trigramas.cap * 2 : 4096);
+    free(trigramas.codigos);
+    free(trigramas.listas);
+    trigramas = novo;
+}
+
+// lista do trigrama ou NULL se nenhuma cidade tem
+static ListaTrigrama *trigrama_lista(uint32_t codigo) {
+    if (trigramas.cap == 0) return NULL;
+    int s = trigrama_slot(codigo);
+    return trigramas.codigos[s] == TRIGRAMA_VAZIO ? NULL : &trigramas.listas[s];
+}
+
+// põe no índice as cidades criadas desde a última busca
+static void trigramas_atualiza() {
+    if (trigramas.indexadas == city_count) return;
+    for (int id = trigramas.indexadas; id < city_count; ++id) {
+        int len = city_keys[id].len;
+        GARANTE_CAP(trigramas_nome, cap_trigramas_nome, (size_t)len + 2);
+        uint32_t *t = trigramas_nome;
+        int n = trigramas_de(city_key(id), len, t);
+        for (int i = 0; i < n; ++i) {
+            if (2 * (trigramas.usados + 1) > trigramas.cap) trigramas_cresce();
+            int s = trigrama_slot(t[i]);
+            ListaTrigrama *l = &trigramas.listas[s];
+            if (trigramas.codigos[s] == TRIGRAMA_VAZIO) {
+                trigramas.codigos[s] = t[i];
+                l->ids = NULL; l->len = l->cap = 0;
+                if (listas_prontas.n > 0) {
+                    l->ids = listas_prontas.ids[--listas_prontas.n];
+                    l->cap = TRIGRAMA_LISTA_INICIAL;
+                }
+                trigramas.usados++;
+            }
+            if (l->len > 0 && l->ids[l->len - 1] == id) continue;  // trigrama repetido no nome
+            if (l->len == l->cap) {
+                l->cap = l->cap ? l->cap * 2 : TRIGRAMA_LISTA_INICIAL;
+                l->ids = xrealloc(l->ids, l->cap * sizeof(int));
+            }
+            l->ids[l->len++] = id;
+        }
+    }
+    trigramas.indexadas = city_count;
+}
+
+static void fuzzy_scratch_garante(FuzzyScratch *s, int n) {
+    if (n <= s->cap) return;
+    s->conta = xrealloc(s->conta, n * sizeof(int));
+    s->edicoes = xrealloc(s->edicoes, n * sizeof(int));
+    s->tocadas = xrealloc(s->tocadas, n * sizeof(int));
+    s->nivel = xrealloc(s->nivel, n * sizeof(int));
+    s->marca = xrealloc(s->marca, n * sizeof(unsigned));
+    s->marca_ed = xrealloc(s->marca_ed, n * sizeof(unsigned));
+    s->visto = xrealloc(s->visto, n * sizeof(unsigned));
+    for (int i = s->cap; i < n; ++i) s->marca[i] = s->marca_ed[i] = s->visto[i] = 0;
+    s->cap = n;
+}
+
+static int lista_contem(const ListaTrigrama *l, int id) {
+    int lo = 0, hi = l->len - 1;
+    while (lo <= hi) {
+        int meio = (lo + hi) / 2;
+        if (l->ids[meio] == id) return 1;
+        if (l->ids[meio] < id) lo = meio + 1; else hi = meio - 1;
+    }
+    return 0;
+}
+
+// distância de edição (até limiar; acima disso, limiar + 1) com cache por busca
+static int fuzzy_edicoes(FuzzyScratch *s, const char *key, int len, int id, int limiar) {
+    if (s->marca_ed[id] != s->rodada) {
+        s->marca_ed[id] = s->rodada;
+        s->edicoes[id] = levenshtein_limitado(key, len, city_key(id), city_keys[id].len, limiar);
+    }
+    return s->edicoes[id];
+}
+
+static int compara_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int compara_candidatos(const void *a, const void *b) {
+    const CandidatoNome *x = a, *y = b;
+    if (x->distancia != y->distancia) return x->distancia - y->distancia;
+    return x->city_id - y->city_id;
+}
+
+/* Até k candidatos pro texto digitado, do melhor pro pior (ver acima),
+   usando a memória de trabalho s. O índice só muda em trigramas_atualiza(). */
+int fuzzy_candidatos_com(FuzzyScratch *s, const char *input, CandidatoNome out[], int k) {
+    METRICA_INICIO(MET_FUZZY);
+    char buf[CHAVE_BUF];
+    char *key = nome_para_chave(input, buf);
+    int qlen = strlen(key);
+    int limiar = qlen > 3 ? 4 : 2;
+    int n = 0;
+    if (qlen == 0 || k <= 0) { chave_libera(key, buf); return 0; }
+
+    trigramas_atualiza();
+    fuzzy_scratch_garante(s, city_cap);
+    s->rodada++;
+
+    // nome exato: resolve direto pelo índice de nomes
+    int exato = city_lookup_key(key);
+    if (exato >= 0) {
+        out[n].city_id = exato; out[n].distancia = 0; n++;
+        s->visto[exato] = s->rodada;
+    }
+
+    GARANTE_CAP(s->t, s->cap_t, (size_t)qlen + 2);
+    uint32_t *t = s->t;
+
+    // quem contém o texto, em ordem de id
+    if (n < k && qlen < 3) {
+        for (int id = 0; id < city_count && n < k; ++id) {
+            if (s->visto[id] == s->rodada || strstr(city_key(id), key) == NULL) continue;
+            out[n].city_id = id; out[n].distancia = city_keys[id].len - qlen; n++;
+            s->visto[id] = s->rodada;
+        }
+    } else if (n < k) {
+        // trigramas internos do texto (sem borda)
+        int m = 0;
+        for (int i = 0; i + 2 < qlen; ++i)
+            t[m++] = ((uint32_t)(unsigned char)key[i] << 16) | ((unsigned char)key[i+1] << 8) | (unsigned char)key[i+2];
+        m = trigramas_unicos(t, m);
+        ListaTrigrama *menor = NULL;
+        int falta = 0;
+        for (int i = 0; i < m && !falta; ++i) {
+            ListaTrigrama *l = trigrama_lista(t[i]);
+            if (l == NULL) falta = 1;
+            else if (menor == NULL || l->len < menor->len) menor = l;
+        }
+        for (int j = 0; !falta && j < menor->len && n < k; ++j) {
+            int id = menor->ids[j], todos = 1;
+            if (s->visto[id] == s->rodada) continue;
+            for (int i = 0; i < m && todos; ++i) {
+                ListaTrigrama *l = trigrama_lista(t[i]);
+                if (l != menor && !lista_contem(l, id)) todos = 0;
+            }
+            if (!todos || strstr(city_key(id), key) == NULL) continue;
+            out[n].city_id = id; out[n].distancia = city_keys[id].len - qlen; n++;
+            s->visto[id] = s->rodada;
+        }
+    }
+
+    // erros de digitação: conto os trigramas (com borda) em comum
+    int m = 0, tocadas = 0;
+    if (n < k) {
+        m = trigramas_unicos(t, trigramas_de(key, qlen, t));
+        for (int i = 0; i < m; ++i) {
+            ListaTrigrama *l = trigrama_lista(t[i]);
+            for (int j = 0; l != NULL && j < l->len; ++j) {
+                int id = l->ids[j];
+                if (s->marca[id] != s->rodada) {
+                    s->marca[id] = s->rodada;
+                    s->conta[id] = 0;
+                    s->tocadas[tocadas++] = id;
+                }
+                s->conta[id]++;
+            }
+        }
+    }
+    for (int d = 1; d <= limiar && n < k; ++d) {
+        int inicio = n;
+        if (m - 3 * d >= 1) {
+            // cada candidato a d edições foi tocado pelo menos m - 3d vezes
+            int achados = 0;
+            for (int i = 0; i < tocadas; ++i) {
+                int id = s->tocadas[i];
+                if (s->visto[id] == s->rodada || s->conta[id] < m - 3 * d) continue;
+                int dl = (int)city_keys[id].len - qlen;
+                if (dl > d || -dl > d || fuzzy_edicoes(s, key, qlen, id, limiar) != d) continue;
+                s->visto[id] = s->rodada;
+                s->nivel[achados++] = id;
+            }
+            qsort(s->nivel, achados, sizeof(int), compara_int);
+            for (int i = 0; i < achados && n < k; ++i) {
+                out[n].city_id = s->nivel[i]; out[n].distancia = d; n++;
+            }
+        } else {
+            // filtro fraco demais: varro quem tem tamanho compatível
+            for (int id = 0; id < city_count; ++id) {
+                if (s->visto[id] == s->rodada) continue;
+                int dl = (int)city_keys[id].len - qlen;
+                if (dl > limiar || -dl > limiar) continue;
+                int e = fuzzy_edicoes(s, key, qlen, id, limiar);
+                if (e > limiar) continue;
+                CandidatoNome c = {id, e};
+                // insere mantendo out[inicio..n) ordenado, no máximo k
+                if (n == k && compara_candidatos(&c, &out[k-1]) >= 0) continue;
+                int p = n < k ? n++ : k - 1;
+                while (p > inicio && compara_candidatos(&c, &out[p-1]) < 0) { out[p] = out[p-1]; p--; }
+                out[p] = c;
+            }
+            break;
+        }
+    }
+
+    chave_libera(key, buf);
+    METRICA_FIM(MET_FUZZY);
+    return n;
+}
+
+int fuzzy_candidatos(const char *input, CandidatoNome out[], int k) {
+    return fuzzy_candidatos_com(&fuzzy_scratch_padrao, input, out, k);
+}
+
+/* Busca aproximada: tenta achar cidade pelo input do usuário */
+int fuzzy_match_city_com(FuzzyScratch *s, const char *input) {
+    CandidatoNome c;
+    return fuzzy_candidatos_com(s, input, &c, 1) > 0 ? c.city_id : -1;
+}
+
+int fuzzy_match_city(const char *input) {
+    return fuzzy_match_city_com(&fuzzy_scratch_padrao, input);
+}
+
+int threads_lote = 0;  // --threads=N; 0 = um por núcleo
+
+static int threads_padrao() {
+#ifdef _WIN32
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* --- filas de prioridade pro Dijkstra --- */
+
+// motor usado em dijkstra(); escolhido na linha de comando (--dijkstra=...)
+typedef enum { DIJKSTRA_LINEAR, DIJKSTRA_BINARIO, DIJKSTRA_RADIX, DIJKSTRA_DELTA } DijkstraMotor;
+DijkstraMotor dijkstra_motor = DIJKSTRA_BINARIO;
+
+// heap binário indexado: heap[] guarda vértices, pos[] a posição de cada um (-1 = fora)
+// a chave é (dist, id), assim o desempate é o mesmo da busca linear
+typedef struct {
+    int *heap;
+    int *pos;
+    int size;
+} HeapBinario;
+
+static int heap_menor(const int dist[], int a, int b) {
+    if (dist[a] != dist[b]) return dist[a] < dist[b];
+    return a < b;
+}
+
+static void heap_troca(HeapBinario *h, int i, int j) {
+    int tmp = h->heap[i];
+    h->heap[i] = h->heap[j];
+    h->heap[j] = tmp;
+    h->pos[h->heap[i]] = i;
+    h->pos[h->heap[j]] = j;
+}
+
+static void heap_sobe(HeapBinario *h, const int dist[], int i) {
+    while (i > 0) {
+        int pai = (i - 1) / 2;
+        if (!heap_menor(dist, h->heap[i], h->heap[pai])) break;
+        heap_troca(h, i, pai);
+        i = pai;
+    }
+}
+
+static void heap_desce(HeapBinario *h, const int dist[], int i) {
+    for (;;) {
+        int menor = i;
+        int l = 2*i + 1, r = 2*i + 2;
+        if (l < h->size && heap_menor(dist, h->heap[l], h->heap[menor])) menor = l;
+        if (r < h->size && heap_menor(dist, h->heap[r], h->heap[menor])) menor = r;
+        if (menor == i) break;
+        heap_troca(h, i, menor);
+        i = menor;
+    }
+}
+
+// insere v ou, se já estiver no heap, ajusta depois de dist[v] ter diminuído
+static void heap_insere_ou_diminui(HeapBinario *h, const int dist[], int v) {
+    if (h->pos[v] == -1) {
+        h->heap[h->size] = v;
+        h->pos[v] = h->size;
+        h->size++;
+    }
+    heap_sobe(h, dist, h->pos[v]);
+}
+
+// reposiciona v depois de dist[v] mudar em qualquer sentido
+static void heap_atualiza(HeapBinario *h, const int dist[], int v) {
+    if (h->pos[v] == -1) return;
+    heap_sobe(h, dist, h->pos[v]);
+    heap_desce(h, dist, h->pos[v]);
+}
+
+static int heap_remove_min(HeapBinario *h, const int dist[]) {
+    int u = h->heap[0];
+    h->size--;
+    if (h->size > 0) {
+        h->heap[0] = h->heap[h->size];
+        h->pos[h->heap[0]] = 0;
+        heap_desce(h, dist, 0);
+    }
+    h->pos[u] = -1;
+    return u;
+}
+
+/* Radix heap: aproveita que as distâncias são inteiros e nunca diminuem abaixo
+   do último mínimo extraído. O balde 0 guarda tudo que tem chave == ultimo e é
+   mantido como heap por id, pra sair na mesma ordem da busca linear.
+   Os outros baldes usam remoção preguiçosa (entrada velha é ignorada). */
+#define RADIX_BALDES 33
+
+typedef struct {
+    int v;
+    unsigned key;
+} RadixItem;
+
+typedef struct {
+    RadixItem *balde[RADIX_BALDES];
+    int len[RADIX_BALDES];
+    int cap[RADIX_BALDES];
+    int *zero;
+    int zero_len;
+    unsigned ultimo;
+} HeapRadix;
+
+// memória de trabalho de uma busca, reaproveitada entre consultas;
+// cada thread que roda Dijkstra precisa da sua
+typedef struct {
+    HeapBinario bin;
+    HeapRadix radix;
+    char *fechado;
+    int cap;
+    long fechados;   // contadores da última busca
+    long relaxadas;  // arestas examinadas
+    int paralelo;    // pode abrir threads (--dijkstra=delta); só nas buscas da thread principal
+} DijkstraScratch;
+
+static DijkstraScratch dijkstra_scratch_padrao = { .paralelo = 1 };
+
+static void dijkstra_scratch_garante(DijkstraScratch *s, int n) {
+    if (n <= s->cap) return;
+    s->bin.heap = xrealloc(s->bin.heap, n * sizeof(int));
+    s->bin.pos = xrealloc(s->bin.pos, n * sizeof(int));
+    s->radix.zero = xrealloc(s->radix.zero, n * sizeof(int));
+    s->fechado = xrealloc(s->fechado, n);
+    s->cap = n;
+}
+
+static int radix_balde_de(unsigned key, unsigned ultimo) {
+    if (key == ultimo) return 0;
+    int b = 0;
+    for (unsigned x = key ^ ultimo; x; x >>= 1) b++;
+    return b;
+}
+
+static void radix_zero_insere(HeapRadix *h, int v) {
+    int i = h->zero_len++;
+    h->zero[i] = v;
+    while (i > 0 && h->zero[(i-1)/2] > h->zero[i]) {
+        int pai = (i-1)/2;
+        int tmp = h->zero[pai]; h->zero[pai] = h->zero[i]; h->zero[i] = tmp;
+        i = pai;
+    }
+}
+
+static int radix_zero_remove(HeapRadix *h) {
+    int v = h->zero[0];
+    h->zero[0] = h->zero[--h->zero_len];
+    int i = 0;
+    for (;;) {
+        int menor = i, l = 2*i + 1, r = 2*i + 2;
+        if (l < h->zero_len && h->zero[l] < h->zero[menor]) menor = l;
+        if (r < h->zero_len && h->zero[r] < h->zero[menor]) menor = r;
+        if (menor == i) break;
+        int tmp = h->zero[menor]; h->zero[menor] = h->zero[i]; h->zero[i] = tmp;
+        i = menor;
+    }
+    return v;
+}
+
+static void radix_insere(HeapRadix *h, int v, unsigned key) {
+    int b = radix_balde_de(key, h->ultimo);
+    if (b == 0) { radix_zero_insere(h, v); return; }
+    if (h->len[b] == h->cap[b]) {
+        h->cap[b] = h->cap[b] ? h->cap[b] * 2 : 64;
+        h->balde[b] = xrealloc(h->balde[b], h->cap[b] * sizeof(RadixItem));
+    }
+    h->balde[b][h->len[b]].v = v;
+    h->balde[b][h->len[b]].key = key;
+    h->len[b]++;
+}
+
+static void radix_limpa(HeapRadix *h) {
+    for (int b = 0; b < RADIX_BALDES; ++b) h->len[b] = 0;
+    h->zero_len = 0;
+    h->ultimo = 0;
+}
+
+// entrada ainda válida: vértice não fechado e chave igual à distância atual
+static int radix_valido(const RadixItem *it, const int dist[], const char fechado[]) {
+    return !fechado[it->v] && (unsigned)dist[it->v] == it->key;
+}
+
+// retorna o próximo vértice a fechar ou -1 se não há mais nenhum
+static int radix_remove_min(HeapRadix *h, const int dist[], const char fechado[]) {
+    while (h->zero_len == 0) {
+        int b = 1;
+        while (b < RADIX_BALDES && h->len[b] == 0) b++;
+        if (b == RADIX_BALDES) return -1;
+
+        // novo mínimo entre as entradas válidas do balde e redistribuo
+        unsigned novo = UINT_MAX;
+        int achou = 0;
+        for (int i = 0; i < h->len[b]; ++i) {
+            if (!radix_valido(&h->balde[b][i], dist, fechado)) continue;
+            if (!achou || h->balde[b][i].key < novo) novo = h->balde[b][i].key;
+            achou = 1;
+        }
+        int n = h->len[b];
+        h->len[b] = 0;
+        if (!achou) continue;
+        h->ultimo = novo;
+        for (int i = 0; i < n; ++i) {
+            RadixItem it = h->balde[b][i];
+            if (radix_valido(&it, dist, fechado)) radix_insere(h, it.v, it.key);
+        }
+    }
+    return radix_zero_remove(h);
+}
+
+/* Dijkstra (menor distância) */
+
+// versão original: varre todas as cidades a cada iteração, O(V²)
+static void dijkstra_linear(DijkstraScratch *s, int dist[], int prev[]) {
+    char *visited = s->fechado;
+
+    for (int it=0; it<city_count; ++it) {
+        int u = -1;
+        int best = INT_MAX;
+        for (int i=0;i<city_count;++i) if (!visited[i] && dist[i] < best) { best = dist[i]; u = i; }
+        if (u == -1) break;
+        visited[u] = 1;
+        s->fechados++;
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) {
+            s->relaxadas++;
+            if (!visited[v] && dist[u] != INT_MAX && dist[u] + w < dist[v]) {
+                dist[v] = dist[u] + w;
+                prev[v] = u;
+            }
+        }
+    }
+}
+
+// heap binário com decrease-key, O((V+E) log V)
+static void dijkstra_binario(DijkstraScratch *s, int src, int dist[], int prev[]) {
+    HeapBinario *h = &s->bin;
+    for (int i = 0; i < city_count; ++i) h->pos[i] = -1;
+    h->size = 0;
+    char *visited = s->fechado;
+
+    heap_insere_ou_diminui(h, dist, src);
+    while (h->size > 0) {
+        int u = heap_remove_min(h, dist);
+        visited[u] = 1;
+        s->fechados++;
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) {
+            s->relaxadas++;
+            if (!visited[v] && dist[u] + w < dist[v]) {
+                dist[v] = dist[u] + w;
+                prev[v] = u;
+                heap_insere_ou_diminui(h, dist, v);
+            }
+        }
+    }
+}
+
+// radix heap: só serve com pesos não negativos (chaves monótonas)
+static void dijkstra_radix(DijkstraScratch *s, int src, int dist[], int prev[]) {
+    HeapRadix *h = &s->radix;
+    radix_limpa(h);
+    char *visited = s->fechado;
+
+    radix_insere(h, src, 0);
+    int u;
+    while ((u = radix_remove_min(h, dist, visited)) != -1) {
+        visited[u] = 1;
+        s->fechados++;
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) {
+            s->relaxadas++;
+            if (!visited[v] && dist[u] + w < dist[v]) {
+                dist[v] = dist[u] + w;
+                prev[v] = u;
+                radix_insere(h, v, (unsigned)dist[v]);
+            }
+        }
+    }
+}
+
+/* --- Dijkstra paralelo (delta-stepping) --- */
+
+/* Com uma origem só, o heap usa um núcleo, e em grafos de milhões de cidades
+   isso é o gargalo. --dijkstra=delta troca a fila por baldes de largura delta
+   (--delta=N km; padrão: média dos pesos): o balde i guarda as cidades com
+   distância provisória em [i*delta, (i+1)*delta). A cada rodada as --threads
+   threads esvaziam juntas a fronteira (o menor balde não vazio) e relaxam as
+   arestas com compare-and-swap em dist[]; quem melhora vai pro balde local da
+   thread que achou. Cada thread começa pela sua fatia da fronteira e, quando
+   acaba, rouba blocos das fatias das outras. Entre rodadas os baldes locais do
+   índice seguinte viram a fronteira nova (o mesmo índice volta enquanto
+   arestas curtas o realimentam). Os baldes são um anel: nenhuma distância
+   provisória passa de (balde atual + 1) * delta + maior peso.
+   As distâncias saem iguais às do Dijkstra. prev[] é refeito no fim: entre os
+   antecessores com dist[u] + w == dist[v] fica o de menor (dist, id), que é
+   quem o heap fecha primeiro, então o resultado é o mesmo dos outros motores.
+   Isso exige pesos positivos; com peso zero ou negativo, no Windows e nas
+   buscas das threads de trabalho (matriz, servidor) fica o heap binário. */
+#define DELTA_BLOCO 256  // cidades por bloco tomado da fronteira
+
+int delta_largura = 0;  // --delta=N; 0 = média dos pesos
+
+// resumo dos pesos do grafo atual (largura padrão e tamanho do anel)
+static struct {
+    int valido;
+    unsigned long versao;
+    int n;
+    int nao_positivo;  // alguma aresta com peso <= 0
+    int media, maximo;
+} delta_pesos;
+
+static void delta_pesos_atualiza() {
+    if (delta_pesos.valido && delta_pesos.versao == grafo_versao && delta_pesos.n == city_count) return;
+    long long soma = 0, arestas = 0;
+    int maximo = 1, nao_positivo = 0;
+    for (int u = 0; u < city_count; ++u) {
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) {
+            if (w <= 0) nao_positivo = 1;
+            if (w > maximo) maximo = w;
+            soma += w;
+            arestas++;
+        }
+    }
+    delta_pesos.nao_positivo = nao_positivo;
+    delta_pesos.maximo = maximo;
+    delta_pesos.media = arestas > 0 && soma / arestas > 0 ? (int)(soma / arestas) : 1;
+    delta_pesos.versao = grafo_versao;
+    delta_pesos.n = city_count;
+    delta_pesos.valido = 1;
+}
+
+// --threads, mas nunca mais que os núcleos: thread a mais só espera na barreira
+static int delta_threads() {
+    int n = threads_lote > 0 ? threads_lote : threads_padrao();
+    return n < threads_padrao() ? n : threads_padrao();
+}
+
+#ifndef _WIN32
+// barreira com espera ativa: as rodadas são curtas demais pra dormir numa
+// variável de condição a cada uma (medido: dormir sai mais caro até com mais
+// threads que núcleos, por isso delta_threads() não passa dos núcleos)
+typedef struct {
+    int n;
+    int chegaram;
+    unsigned geracao;
+} DeltaBarreira;
+
+static void delta_barreira(DeltaBarreira *b) {
+    unsigned g = __atomic_load_n(&b->geracao, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&b->chegaram, 1, __ATOMIC_ACQ_REL) == b->n) {
+        __atomic_store_n(&b->chegaram, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->geracao, g + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    for (int giros = 0; __atomic_load_n(&b->geracao, __ATOMIC_ACQUIRE) == g; ++giros)
+        if (giros > 1000) sched_yield();
+}
+
+typedef struct {
+    int **balde;           // anel de baldes locais (índice % anel)
+    int *len, *cap;
+    long prox, fim;        // fatia da fronteira; prox também é disputado por quem rouba
+    long copia;            // onde o balde local entra na fronteira nova
+    int menor;             // menor balde local não vazio (-1 = nenhum)
+    long fechados, relaxadas;
+    char sep[64];          // fatias de threads vizinhas em linhas de cache diferentes
+} DeltaThread;
+
+static struct {
+    DeltaThread *t;
+    int threads, cap_threads;
+    int anel, cap_anel;
+    int delta;
+    int *fronteira;
+    size_t cap_fronteira;
+    int atual;             // balde desta rodada
+    int acabou;
+    long prox_prev;        // próximo bloco de cidades no refazer de prev[]
+    int *dist, *prev;
+    DeltaBarreira barreira;
+} delta_busca;
+
+static void delta_balde_poe(DeltaThread *t, int b, int v) {
+    int k = b % delta_busca.anel;
+    if (t->len[k] == t->cap[k]) {
+        t->cap[k] = t->cap[k] ? t->cap[k] * 2 : 64;
+        t->balde[k] = xrealloc(t->balde[k], t->cap[k] * sizeof(int));
+    }
+    t->balde[k][t->len[k]++] = v;
+}
+
+// relaxa as arestas de u se ele ainda está no balde da rodada
+static void delta_expande(DeltaThread *eu, int u) {
+    int *dist = delta_busca.dist;
+    int du = __atomic_load_n(&dist[u], __ATOMIC_RELAXED);
+    if (du / delta_busca.delta != delta_busca.atual) return;  // já saiu num balde anterior
+    eu->fechados++;
+    int v, w;
+    VizinhoIter viz;
+    viz_inicio(u, &viz);
+    while (viz_proximo(&viz, &v, &w)) {
+        eu->relaxadas++;
+        int nd = du + w;
+        int dv = __atomic_load_n(&dist[v], __ATOMIC_RELAXED);
+        while (nd < dv) {
+            if (__atomic_compare_exchange_n(&dist[v], &dv, nd, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                delta_balde_poe(eu, nd / delta_busca.delta, v);
+                break;
+            }
+        }
+    }
+}
+
+// reparte a fronteira em fatias iguais, uma por thread
+static void delta_fatias(long total) {
+    int n = delta_busca.threads;
+    for (int k = 0; k < n; ++k) {
+        delta_busca.t[k].prox = total * k / n;
+        delta_busca.t[k].fim = total * (k + 1) / n;
+    }
+}
+
+// (só a thread 0) escolhe o próximo balde e reserva o lugar de cada thread na fronteira
+static void delta_proxima_rodada() {
+    int menor = -1;
+    for (int k = 0; k < delta_busca.threads; ++k) {
+        int m = delta_busca.t[k].menor;
+        if (m != -1 && (menor == -1 || m < menor)) menor = m;
+    }
+    if (menor == -1) { delta_busca.acabou = 1; return; }
+    delta_busca.atual = menor;
+    int slot = menor % delta_busca.anel;
+    long total = 0;
+    for (int k = 0; k < delta_busca.threads; ++k) {
+        delta_busca.t[k].copia = total;
+        total += delta_busca.t[k].len[slot];
+    }
+    GARANTE_CAP(delta_busca.fronteira, delta_busca.cap_fronteira, (size_t)total);
+    delta_fatias(total);
+}
+
+// prev[v] = antecessor justo de menor (dist, id), como o heap escolheria
+static void delta_refaz_prev() {
+    const int *dist = delta_busca.dist;
+    long i;
+    while ((i = __atomic_fetch_add(&delta_busca.prox_prev, DELTA_BLOCO, __ATOMIC_RELAXED)) < city_count) {
+        long fim = i + DELTA_BLOCO < city_count ? i + DELTA_BLOCO : city_count;
+        for (int v = (int)i; v < fim; ++v) {
+            int d = dist[v];
+            if (d == INT_MAX || d == 0) continue;
+            int melhor = -1, u, w;
+            VizinhoIter viz;
+            viz_entrada_inicio(v, &viz);
+            while (viz_entrada_proximo(&viz, &u, &w)) {
+                if (dist[u] == INT_MAX || dist[u] + w != d) continue;
+                if (melhor == -1 || dist[u] < dist[melhor] || (dist[u] == dist[melhor] && u < melhor)) melhor = u;
+            }
+            delta_busca.prev[v] = melhor;
+        }
+    }
+}
+
+static void *delta_trabalhador(void *arg) {
+    int k = (int)(intptr_t)arg, n = delta_busca.threads;
+    DeltaThread *eu = &delta_busca.t[k];
+    for (;;) {
+        // a minha fatia primeiro, depois o que sobrou nas outras
+        for (int j = 0; j < n; ++j) {
+            DeltaThread *dono = &delta_busca.t[(k + j) % n];
+            long i;
+            while ((i = __atomic_fetch_add(&dono->prox, DELTA_BLOCO, __ATOMIC_RELAXED)) < dono->fim) {
+                long fim = i + DELTA_BLOCO < dono->fim ? i + DELTA_BLOCO : dono->fim;
+                for (; i < fim; ++i) delta_expande(eu, delta_busca.fronteira[i]);
+            }
+        }
+        eu->menor = -1;
+        for (int b = delta_busca.atual; b < delta_busca.atual + delta_busca.anel; ++b)
+            if (eu->len[b % delta_busca.anel] > 0) { eu->menor = b; break; }
+        delta_barreira(&delta_busca.barreira);
+        if (k == 0) delta_proxima_rodada();
+        delta_barreira(&delta_busca.barreira);
+        if (delta_busca.acabou) break;
+        int slot = delta_busca.atual % delta_busca.anel;
+        if (eu->len[slot] > 0) memcpy(delta_busca.fronteira + eu->copia, eu->balde[slot], eu->len[slot] * sizeof(int));
+        eu->len[slot] = 0;
+        delta_barreira(&delta_busca.barreira);
+    }
+    delta_refaz_prev();
+    return NULL;
+}
+
+// 1 se fez a busca; 0 se o grafo tem peso <= 0 (aí fica pro heap)
+static int dijkstra_delta(DijkstraScratch *s, int src, int dist[], int prev[]) {
+    delta_pesos_atualiza();
+    if (delta_pesos.nao_positivo) return 0;
+    int n = delta_threads();
+    int delta = delta_largura > 0 ? delta_largura : delta_pesos.media;
+    int anel = delta_pesos.maximo / delta + 2;
+
+    if (n > delta_busca.cap_threads) {
+        delta_busca.t = xrealloc(delta_busca.t, n * sizeof(DeltaThread));
+        memset(delta_busca.t + delta_busca.cap_threads, 0, (n - delta_busca.cap_threads) * sizeof(DeltaThread));
+        for (int k = delta_busca.cap_threads; k < n; ++k) {
+            DeltaThread *t = &delta_busca.t[k];
+            t->balde = xrealloc(NULL, delta_busca.cap_anel * sizeof(int *));
+            t->len = xrealloc(NULL, delta_busca.cap_anel * sizeof(int));
+            t->cap = xrealloc(NULL, delta_busca.cap_anel * sizeof(int));
+            for (int b = 0; b < delta_busca.cap_anel; ++b) { t->balde[b] = NULL; t->len[b] = t->cap[b] = 0; }
+        }
+        delta_busca.cap_threads = n;
+    }
+    if (anel > delta_busca.cap_anel) {
+        for (int k = 0; k < delta_busca.cap_threads; ++k) {
+            DeltaThread *t = &delta_busca.t[k];
+            t->balde = xrealloc(t->balde, anel * sizeof(int *));
+            t->len = xrealloc(t->len, anel * sizeof(int));
+            t->cap = xrealloc(t->cap, anel * sizeof(int));
+            for (int b = delta_busca.cap_anel; b < anel; ++b) { t->balde[b] = NULL; t->len[b] = t->cap[b] = 0; }
+        }
+        delta_busca.cap_anel = anel;
+    }
+    for (int k = 0; k < n; ++k) delta_busca.t[k].fechados = delta_busca.t[k].relaxadas = 0;
+
+    delta_busca.threads = n;
+    delta_busca.anel = anel;
+    delta_busca.delta = delta;
+    delta_busca.dist = dist;
+    delta_busca.prev = prev;
+    GARANTE_CAP(delta_busca.fronteira, delta_busca.cap_fronteira, 1);
+    delta_busca.fronteira[0] = src;
+    delta_busca.atual = 0;
+    delta_busca.acabou = 0;
+    delta_busca.prox_prev = 0;
+    delta_busca.barreira.n = n;
+    delta_busca.barreira.chegaram = 0;
+    delta_fatias(1);
+
+    pthread_t *ids = xrealloc(NULL, n * sizeof(pthread_t));
+    for (int k = 1; k < n; ++k)
+        if (pthread_create(&ids[k], NULL, delta_trabalhador, (void *)(intptr_t)k) != 0) {
+            fprintf(stderr, "ERRO: nao foi possivel criar thread\n");
+            exit(1);
+        }
+    delta_trabalhador((void *)(intptr_t)0);
+    for (int k = 1; k < n; ++k) pthread_join(ids[k], NULL);
+    free(ids);
+
+    for (int k = 0; k < n; ++k) {
+        s->fechados += delta_busca.t[k].fechados;
+        s->relaxadas += delta_busca.t[k].relaxadas;
+    }
+    return 1;
+}
+#else
+static int dijkstra_delta(DijkstraScratch *s, int src, int dist[], int prev[]) {
+    (void)s; (void)src; (void)dist; (void)prev;
+    return 0;
+}
+#endif
+
+// preenche dist[]/prev[] a partir de src com o motor selecionado, usando a
+// memória de trabalho s; todos os motores desempatam por id, então o
+// resultado é idêntico entre eles
+void dijkstra_com(DijkstraScratch *s, int src, int dist[], int prev[]) {
+    METRICA_BUSCA_INICIO(MET_DIJKSTRA);
+    dijkstra_scratch_garante(s, city_count);
+    for (int i=0;i<city_count;++i) { dist[i] = INT_MAX; prev[i] = -1; }
+    memset(s->fechado, 0, city_count);
+    dist[src] = 0;
+    s->fechados = s->relaxadas = 0;
+
+    switch (dijkstra_motor) {
+        case DIJKSTRA_LINEAR: dijkstra_linear(s, dist, prev); break;
+        case DIJKSTRA_RADIX:
+            if (!tem_peso_negativo) { dijkstra_radix(s, src, dist, prev); break; }
+            dijkstra_binario(s, src, dist, prev);
+            break;
+        case DIJKSTRA_DELTA:
+            if (s->paralelo && dijkstra_delta(s, src, dist, prev)) break;
+            dijkstra_binario(s, src, dist, prev);
+            break;
+        default: dijkstra_binario(s, src, dist, prev);
+    }
+    METRICA_BUSCA_FIM(MET_DIJKSTRA, s->fechados, s->relaxadas);
+}
+
+void dijkstra(int src, int dist[], int prev[]) {
+    dijkstra_com(&dijkstra_scratch_padrao, src, dist, prev);
+}
+
+/* --- reparo incremental de árvores de caminhos mínimos --- */
+
+/* Conserta dist[]/prev[] de uma árvore já calculada depois que a aresta
+   (a, b, w) entra no grafo, sem refazer o Dijkstra: se a aresta encurta a
+   distância até uma das pontas (só b no modo direcionado), essa ponta vira
+   a semente de um Dijkstra que só anda enquanto consegue baixar alguma
+   distância (propagação de decréscimo, como em Ramalingam-Reps). Só as
+   cidades que ficaram mais perto passam pela fila. Vale com a aresta já inserida ou ainda não (a outra ponta
+   nunca melhora pela própria aresta). dist/prev precisam cobrir city_count
+   cidades (as novas com INT_MAX/-1). As distâncias ficam iguais às de um
+   Dijkstra novo; prev pode escolher outro caminho de mesmo tamanho.
+   Devolve quantas cidades mudaram, ou -1 se w < 0 (aí só recalculando). */
+static HeapBinario reparo_heap;
+static int reparo_cap;
+
+int sssp_repara(int dist[], int prev[], int a, int b, int w) {
+    if (w < 0) return -1;
+    if (reparo_cap < city_count) {
+        reparo_heap.heap = xrealloc(reparo_heap.heap, city_count * sizeof(int));
+        reparo_heap.pos = xrealloc(reparo_heap.pos, city_count * sizeof(int));
+        // a fila sempre termina vazia, então pos[] volta todo pra -1 sozinho
+        for (int v = reparo_cap; v < city_count; ++v) reparo_heap.pos[v] = -1;
+        reparo_cap = city_count;
+    }
+    HeapBinario *h = &reparo_heap;
+    if (dist[a] != INT_MAX && (long long)dist[a] + w < dist[b]) {
+        dist[b] = dist[a] + w;
+        prev[b] = a;
+        heap_insere_ou_diminui(h, dist, b);
+    } else if (!grafo_direcionado && dist[b] != INT_MAX && (long long)dist[b] + w < dist[a]) {
+        dist[a] = dist[b] + w;
+        prev[a] = b;
+        heap_insere_ou_diminui(h, dist, a);
+    } else {
+        return 0;
+    }
+
+    int mudaram = 0;
+    while (h->size > 0) {
+        int u = heap_remove_min(h, dist);
+        mudaram++;
+        int v, wv;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &wv)) {
+            if ((long long)dist[u] + wv < dist[v]) {
+                dist[v] = dist[u] + wv;
+                prev[v] = u;
+                heap_insere_ou_diminui(h, dist, v);
+            }
+        }
+    }
+    return mudaram;
+}
+
+// confere uma árvore contra um Dijkstra novo: mesmas distâncias e cada prev[v]
+// é vizinho de v por uma aresta de peso dist[v] - dist[prev[v]]; devolve as divergências
+static int sssp_confere(int src, const int dist[], const int prev[], int ref_dist[], int ref_prev[]) {
+    dijkstra(src, ref_dist, ref_prev);
+    int erros = 0;
+    for (int v = 0; v < city_count; ++v) {
+        if (dist[v] != ref_dist[v]) { erros++; continue; }
+        if (v == src || dist[v] == INT_MAX) continue;
+        int u = prev[v], ok = 0, x, w;
+        if (u < 0 || u >= city_count || dist[u] == INT_MAX) { erros++; continue; }
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (!ok && viz_proximo(&viz, &x, &w)) ok = x == v && dist[u] + w == dist[v];
+        if (!ok) erros++;
+    }
+    return erros;
+}
+
+/* --bench=incremental: calcula árvores de algumas origens, insere conexões
+   aleatórias (algumas com cidade nova) e depois de cada uma conserta as
+   árvores com sssp_repara() e compara com um Dijkstra novo. Mede as duas
+   coisas; sai com 1 se alguma árvore divergir. O grafo só muda na memória. */
+int bench_incremental(int origens, int insercoes) {
+    if (city_count < 2) { fprintf(stderr, "ERRO: grafo com menos de 2 cidades\n"); return 1; }
+    if (tem_peso_negativo) { fprintf(stderr, "ERRO: reparo incremental exige pesos nao negativos\n"); return 1; }
+    int maior_peso = 1;
+    for (int u = 0; u < city_count; ++u) {
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) if (w > maior_peso) maior_peso = w;
+    }
+    srand(12345);
+    if (origens > city_count) origens = city_count;
+    int cap = city_count + insercoes;  // no máximo uma cidade nova por inserção
+    int *fontes = xrealloc(NULL, origens * sizeof(int));
+    int **dist = xrealloc(NULL, origens * sizeof(int *));
+    int **prev = xrealloc(NULL, origens * sizeof(int *));
+    int *ref_dist = xrealloc(NULL, cap * sizeof(int)), *ref_prev = xrealloc(NULL, cap * sizeof(int));
+    for (int k = 0; k < origens; ++k) {
+        fontes[k] = rand() % city_count;
+        dist[k] = xrealloc(NULL, cap * sizeof(int));
+        prev[k] = xrealloc(NULL, cap * sizeof(int));
+        dijkstra(fontes[k], dist[k], prev[k]);
+    }
+
+    double t_reparo = 0, t_novo = 0;
+    long mudaram = 0;
+    int erros = 0, novas = 0;
+    for (int i = 0; i < insercoes; ++i) {
+        int a = rand() % city_count, b, antes = city_count;
+        if (i % 10 == 9) {
+            char nome[32];
+            snprintf(nome, sizeof(nome), "Bench Incremental %d", novas++);
+            b = city_index(nome);
+        } else {
+            do b = rand() % city_count; while (b == a);
+        }
+        // sem isso quase nenhuma aresta sorteada encurta alguma coisa
+        int w = 1 + rand() % (maior_peso > 4 ? maior_peso / 4 : 1);
+        add_edge(a, b, w);
+        grafo_congela_se_preciso();
+        for (int k = 0; k < origens; ++k) {
+            if (city_count > antes) { dist[k][antes] = INT_MAX; prev[k][antes] = -1; }
+            double t0 = agora_seg();
+            mudaram += sssp_repara(dist[k], prev[k], a, b, w);
+            t_reparo += agora_seg() - t0;
+            t0 = agora_seg();
+            erros += sssp_confere(fontes[k], dist[k], prev[k], ref_dist, ref_prev) != 0;
+            t_novo += agora_seg() - t0;
+        }
+    }
+    long n = (long)origens * insercoes;
+    printf("%d origens x %d conexoes novas (%d cidades novas), grafo com %d cidades\n",
+           origens, insercoes, novas, city_count);
+    printf("reparo incremental: %10.1f us/arvore (%.1f cidades alteradas em media)\n",
+           t_reparo * 1e6 / n, (double)mudaram / n);
+    printf("dijkstra + conferencia: %6.1f us/arvore (%.0fx)\n",
+           t_novo * 1e6 / n, t_novo / (t_reparo > 0 ? t_reparo : 1e-9));
+    printf("%d arvore(s) divergente(s)\n", erros);
+    for (int k = 0; k < origens; ++k) { free(dist[k]); free(prev[k]); }
+    free(dist); free(prev); free(fontes); free(ref_dist); free(ref_prev);
+    return erros ? 1 : 0;
+}
+
+int reconstruct_path(int prev[], int from, int to, int caminho[]);
+
+/* --- consultas ponto a ponto --- */
+
+/* A opção 4 só precisa de dist[destino], então não vale a pena fechar o grafo
+   inteiro. Os motores aqui param assim que o destino é resolvido:
+   - parada: Dijkstra normal que para ao fechar o destino (mesmo caminho que dijkstra())
+   - bidir:  Dijkstra bidirecional, origem e destino crescendo ao mesmo tempo
+   - geo:    A* com a distância em linha reta (haversine) como limite inferior;
+             supõe que nenhuma estrada é mais curta que a linha reta
+   - alt:    A* com limites de marcos (ALT, desigualdade triangular)
+   - ch:     hierarquia de contração pré-processada (mais abaixo)
+   Para não pagar O(V) por consulta, dist/prev valem só onde marca[v] == rodada. */
+typedef enum { ROTA_DIJKSTRA, ROTA_PARADA, ROTA_BIDIR, ROTA_GEO, ROTA_ALT, ROTA_CH } RotaMotor;
+RotaMotor rota_motor = ROTA_PARADA;
+int rota_explicita = 0;  // veio --rota=... (o benchmark de rotas mede só esse motor)
+static const char *rota_nomes[] = { "dijkstra", "parada", "bidir", "geo", "alt", "ch" };
+
+typedef struct {
+    int dist;          // INT_MAX se não há caminho
+    int tam;           // cidades no caminho (0 se não há)
+    long fechados;     // vértices retirados da fila (settled)
+    long relaxadas;    // arestas examinadas
+    RotaMotor motor;   // motor que respondeu (a CH desatualizada cai pra 'parada')
+    int do_cache;      // resposta veio do cache de rotas (sem busca)
+} ResultadoRota;
+
+// um sentido da busca (o bidirecional usa dois)
+typedef struct {
+    int *dist, *prev;
+    int *chave;          // prioridade na fila: dist (+ h no A*)
+    int *meio;           // CH: cidade do meio da aresta que chegou em v
+    unsigned *marca;     // dist/prev/chave valem se marca[v] == rodada
+    unsigned *fechado;   // fechado se fechado[v] == rodada
+    HeapBinario heap;
+} BuscaLado;
+
+typedef struct {
+    BuscaLado lado[2];
+    unsigned rodada;
+    int cap;
+    int *dist_cheio, *prev_cheio;  // motor ROTA_DIJKSTRA
+    DijkstraScratch dij;
+    int *cadeia;                   // CH: cadeia antes de desempacotar
+} RotaScratch;
+
+static RotaScratch rota_scratch_padrao = { .dij = { .paralelo = 1 } };
+
+// cresce um lado de antigo pra n cidades (as novas sem marca e fora do heap)
+static void lado_garante(BuscaLado *l, int antigo, int n) {
+    l->dist = xrealloc(l->dist, n * sizeof(int));
+    l->prev = xrealloc(l->prev, n * sizeof(int));
+    l->chave = xrealloc(l->chave, n * sizeof(int));
+    l->meio = xrealloc(l->meio, n * sizeof(int));
+    l->marca = xrealloc(l->marca, n * sizeof(unsigned));
+    l->fechado = xrealloc(l->fechado, n * sizeof(unsigned));
+    l->heap.heap = xrealloc(l->heap.heap, n * sizeof(int));
+    l->heap.pos = xrealloc(l->heap.pos, n * sizeof(int));
+    for (int i = antigo; i < n; ++i) { l->marca[i] = 0; l->fechado[i] = 0; l->heap.pos[i] = -1; }
+}
+
+static void rota_scratch_garante(RotaScratch *s, int n) {
+    if (n <= s->cap) return;
+    for (int k = 0; k < 2; ++k) lado_garante(&s->lado[k], s->cap, n);
+    s->dist_cheio = xrealloc(s->dist_cheio, n * sizeof(int));
+    s->prev_cheio = xrealloc(s->prev_cheio, n * sizeof(int));
+    s->cadeia = xrealloc(s->cadeia, n * sizeof(int));
+    s->cap = n;
+}
+
+// começa uma consulta nova: troca a rodada (zera as marcas só quando dá a volta)
+static void rota_nova_rodada(RotaScratch *s) {
+    if (++s->rodada == 0) {
+        for (int k = 0; k < 2; ++k)
+            for (int i = 0; i < s->cap; ++i) s->lado[k].marca[i] = s->lado[k].fechado[i] = 0;
+        s->rodada = 1;
+    }
+    for (int k = 0; k < 2; ++k) s->lado[k].heap.size = 0;
+}
+
+static inline int lado_dist(const BuscaLado *l, unsigned rodada, int v) {
+    return l->marca[v] == rodada ? l->dist[v] : INT_MAX;
+}
+
+static inline void lado_poe(BuscaLado *l, unsigned rodada, int v, int d, int prev, int chave) {
+    l->marca[v] = rodada;
+    l->dist[v] = d;
+    l->prev[v] = prev;
+    l->chave[v] = chave;
+    heap_insere_ou_diminui(&l->heap, l->chave, v);
+}
+
+// devolve os vértices que sobraram no heap com pos = -1 (pra próxima consulta)
+static void lado_esvazia(BuscaLado *l) {
+    for (int i = 0; i < l->heap.size; ++i) l->heap.pos[l->heap.heap[i]] = -1;
+    l->heap.size = 0;
+}
+
+// copia a cadeia de prev de v até a raiz pra caminho[] (ordem raiz -> v)
+static int rota_cadeia(const BuscaLado *l, int v, int caminho[]) {
+    int tam = 0;
+    for (int x = v; x != -1; x = l->prev[x]) caminho[tam++] = x;
+    for (int i = 0; i < tam/2; ++i) {
+        int tmp = caminho[i]; caminho[i] = caminho[tam-1-i]; caminho[tam-1-i] = tmp;
+    }
+    return tam;
+}
+
+/* --- limites inferiores pro A* --- */
+
+#define RAIO_TERRA_KM 6371.0
+
+static double haversine_km(Coord a, Coord b) {
+    const double rad = 3.14159265358979323846 / 180.0;
+    double dlat = (b.lat - a.lat) * rad, dlon = (b.lon - a.lon) * rad;
+    double x = sin(dlat/2) * sin(dlat/2) + cos(a.lat * rad) * cos(b.lat * rad) * sin(dlon/2) * sin(dlon/2);
+    return 2 * RAIO_TERRA_KM * asin(sqrt(x < 1 ? x : 1));
+}
+
+// marcos do ALT: distância de cada marco pra todas as cidades
+#define ALT_MARCOS 8
+typedef struct {
+    int k;                // marcos calculados
+    int n;                // cidades quando calculou
+    int *dist;            // dist[i*n + v]
+    unsigned long versao; // grafo_versao quando calculou
+    int valido;
+} MarcosALT;
+
+static MarcosALT marcos = {0};
+
+/* Escolhe os marcos pelo mais distante: cada marco novo é a cidade mais longe
+   de todos os anteriores (cidade inalcançável conta como infinitamente longe,
+   assim cada componente acaba ganhando um marco). */
+static inline int alt_atual() {
+    return marcos.valido && marcos.versao == grafo_versao && marcos.n == city_count;
+}
+
+static void alt_prepara() {
+    if (alt_atual()) return;
+    int n = city_count;
+    int k = n < ALT_MARCOS ? n : ALT_MARCOS;
+    marcos.dist = xrealloc(marcos.dist, (size_t)k * n * sizeof(int));
+    int *prev = xrealloc(NULL, n * sizeof(int));
+    int *menor = xrealloc(NULL, n * sizeof(int));
+    for (int v = 0; v < n; ++v) menor[v] = INT_MAX;
+
+    int marco = 0;
+    for (int i = 0; i < k; ++i) {
+        int *d = marcos.dist + (size_t)i * n;
+        dijkstra(marco, d, prev);
+        int melhor = -1;
+        for (int v = 0; v < n; ++v) {
+            if (d[v] < menor[v]) menor[v] = d[v];
+            if (menor[v] > 0 && (melhor == -1 || menor[v] > menor[melhor])) melhor = v;
+        }
+        if (melhor == -1) { k = i + 1; break; }
+        marco = melhor;
+    }
+    free(prev);
+    free(menor);
+    marcos.k = k;
+    marcos.n = n;
+    marcos.versao = grafo_versao;
+    marcos.valido = 1;
+}
+
+static inline int alt_limite(int v, int t) {
+    int h = 0;
+    for (int i = 0; i < marcos.k; ++i) {
+        const int *d = marcos.dist + (size_t)i * marcos.n;
+        if (d[v] == INT_MAX || d[t] == INT_MAX) continue;
+        int x = d[t] - d[v];
+        if (x < 0) x = -x;
+        if (x > h) h = x;
+    }
+    return h;
+}
+
+/* A linha reta só é limite inferior se nenhuma estrada for mais curta que
+   ela. O CSV não garante isso (km arredondado, coordenada da sede do
+   município), então o limite do motor geo é a linha reta vezes o menor
+   km / linha reta entre as estradas com coordenada nas duas pontas (até 1):
+   qualquer caminho mede pelo menos esse fator vezes a soma das linhas retas
+   dos seus trechos, que já passa da linha reta até o destino. Calculado uma
+   vez (O(E)) e depois só diminui a cada aresta nova, em O(1). */
+static struct {
+    double fator;
+    int valido;
+} geo_escala = { 1.0, 0 };
+
+static void geo_escala_aresta(int a, int b, int w) {
+    if (!geo_escala.valido) return;
+    Coord ca = city_coords[a], cb = city_coords[b];
+    if (isnan(ca.lat) || isnan(cb.lat)) return;
+    double reta = haversine_km(ca, cb);
+    if (reta > 0 && w < geo_escala.fator * reta) geo_escala.fator = w > 0 ? w / reta : 0;
+}
+
+static void geo_escala_calcula() {
+    geo_escala.fator = 1.0;
+    geo_escala.valido = 1;
+    for (int u = 0; u < city_count; ++u) {
+        if (isnan(city_coords[u].lat)) continue;
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) if (v > u || grafo_direcionado) geo_escala_aresta(u, v, w);
+    }
+}
+
+static inline int geo_limite(int v, int t) {
+    Coord a = city_coords[v], b = city_coords[t];
+    if (isnan(a.lat) || isnan(b.lat)) return 0;
+    return (int)(haversine_km(a, b) * geo_escala.fator);
+}
+
+static inline int rota_limite(RotaMotor motor, int v, int t) {
+    if (motor == ROTA_GEO) return geo_limite(v, t);
+    if (motor == ROTA_ALT) return alt_limite(v, t);
+    return 0;
+}
+
+/* Busca num sentido só (parada, geo, alt). Com h = 0 é Dijkstra com parada
+   antecipada e chave (dist, id), então fecha as cidades na mesma ordem que
+   dijkstra() e devolve o mesmo caminho. Um vértice fechado volta pra fila se
+   achar caminho melhor, pra continuar certo mesmo se o limite não for consistente. */
+static void rota_unidirecional(RotaScratch *s, RotaMotor motor, int origem, int destino, ResultadoRota *r) {
+    BuscaLado *l = &s->lado[0];
+    unsigned rod = s->rodada;
+    lado_poe(l, rod, origem, 0, -1, rota_limite(motor, origem, destino));
+    while (l->heap.size > 0) {
+        int u = heap_remove_min(&l->heap, l->chave);
+        l->fechado[u] = rod;
+        r->fechados++;
+        if (u == destino) break;
+        int du = l->dist[u], v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) {
+            r->relaxadas++;
+            int nd = du + w;
+            if (nd >= lado_dist(l, rod, v)) continue;
+            if (l->fechado[v] == rod && motor == ROTA_PARADA) continue;
+            l->fechado[v] = 0;
+            lado_poe(l, rod, v, nd, u, nd + rota_limite(motor, v, destino));
+        }
+    }
+    lado_esvazia(l);
+    r->dist = lado_dist(l, rod, destino);
+}
+
+/* Bidirecional: expande sempre o lado com menor topo de fila e guarda a
+   melhor ligação mu = df[u] + w + db[v] vista até agora. Quando a soma dos
+   topos passa de mu, nenhum caminho melhor pode existir. */
+static void rota_bidirecional(RotaScratch *s, int origem, int destino, ResultadoRota *r, int *meio) {
+    unsigned rod = s->rodada;
+    BuscaLado *f = &s->lado[0], *b = &s->lado[1];
+    lado_poe(f, rod, origem, 0, -1, 0);
+    lado_poe(b, rod, destino, 0, -1, 0);
+    int mu = INT_MAX;
+    *meio = -1;
+    if (origem == destino) { mu = 0; *meio = origem; }
+
+    while (f->heap.size > 0 && b->heap.size > 0) {
+        int topo_f = f->chave[f->heap.heap[0]], topo_b = b->chave[b->heap.heap[0]];
+        if (mu != INT_MAX && (long long)topo_f + topo_b >= mu) break;
+        int lado = topo_f <= topo_b ? 0 : 1;
+        BuscaLado *l = &s->lado[lado], *o = &s->lado[1 - lado];
+
+        int u = heap_remove_min(&l->heap, l->chave);
+        l->fechado[u] = rod;
+        r->fechados++;
+        int du = l->dist[u], v, w;
+        VizinhoIter viz;
+        // o lado do destino anda pelas arestas de entrada (iguais às de saída
+        // se o grafo não é direcionado)
+        if (lado == 0) viz_inicio(u, &viz); else viz_entrada_inicio(u, &viz);
+        while (lado == 0 ? viz_proximo(&viz, &v, &w) : viz_entrada_proximo(&viz, &v, &w)) {
+            r->relaxadas++;
+            int nd = du + w;
+            if (l->fechado[v] != rod && nd < lado_dist(l, rod, v)) lado_poe(l, rod, v, nd, u, nd);
+            int dv = lado_dist(o, rod, v);
+            if (dv != INT_MAX && (long long)lado_dist(l, rod, v) + dv < mu) {
+                mu = lado_dist(l, rod, v) + dv;
+                *meio = v;
+            }
+        }
+    }
+    lado_esvazia(f);
+    lado_esvazia(b);
+    r->dist = mu;
+}
+
+/* --- hierarquia de contração (CH) --- */
+
+/* Pré-processamento opcional (--rota=ch). As cidades são contraídas uma a uma
+   em ordem de importância; ao tirar v, cada par de vizinhos (u, w) cujo menor
+   caminho passava por v ganha um atalho u-w. Sobra um grafo "pra cima"
+   (cada aresta vai pra cidade contraída depois), e a consulta é um Dijkstra
+   bidirecional só subindo. Os atalhos guardam a cidade do meio pra serem
+   desempacotados no trajeto completo. Aresta nova (opção 5) deixa a
+   hierarquia desatualizada; aí a consulta volta pra busca comum até a
+   hierarquia ser refeita (o arquivo .ch fica velho junto com o CSV). */
+#define CH_TESTEMUNHA_MAX 500   // vértices fechados por busca de testemunha
+#define CH_TESTEMUNHA_SIMULA 25 // idem, só pra estimar a prioridade
+
+typedef struct {
+    int n, m;                // cidades e arestas pra cima
+    int *rank;               // ordem de contração
+    int *offsets;            // arestas pra cima de v: [offsets[v], offsets[v+1])
+    int *targets, *weights;
+    int *meio;               // cidade do meio do atalho (-1 = estrada original)
+    int atalhos;
+    unsigned long versao;    // grafo_versao quando foi construída
+    int valida;
+} HierarquiaCH;
+
+static HierarquiaCH ch = {0};
+
+// lista de adjacência mutável usada só durante a contração
+typedef struct {
+    int *v, *w, *m;
+    int len, cap;
+} ListaCH;
+
+static void lista_ch_poe(ListaCH *l, int v, int w, int m) {
+    for (int i = 0; i < l->len; ++i) {
+        if (l->v[i] != v) continue;
+        if (w < l->w[i]) { l->w[i] = w; l->m[i] = m; }
+        return;
+    }
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4;
+        l->v = xrealloc(l->v, l->cap * sizeof(int));
+        l->w = xrealloc(l->w, l->cap * sizeof(int));
+        l->m = xrealloc(l->m, l->cap * sizeof(int));
+    }
+    l->v[l->len] = v; l->w[l->len] = w; l->m[l->len] = m;
+    l->len++;
+}
+
+static void lista_ch_tira(ListaCH *l, int v) {
+    for (int i = 0; i < l->len; ++i) {
+        if (l->v[i] != v) continue;
+        l->len--;
+        l->v[i] = l->v[l->len]; l->w[i] = l->w[l->len]; l->m[i] = l->m[l->len];
+        return;
+    }
+}
+
+typedef struct {
+    ListaCH *adj;
+    int *apagados;          // vizinhos já contraídos (espalha a contração)
+    // busca de testemunha
+    int *dist;
+    unsigned *marca, *alvo;  // alvo[x] == rodada: vizinho de v ainda por fechar
+    unsigned rodada;
+    HeapBinario heap;
+} ContracaoCH;
+
+/* Dijkstra local a partir de u ignorando 'sem', até fechar os 'alvos' marcados,
+   fechar limite ou passar de max; depois dist[x] (se marca[x] == rodada) é
+   limite superior de d(u, x). A rodada já vem incrementada por quem marca. */
+static void ch_testemunha(ContracaoCH *c, int u, int sem, int max, int limite, int alvos) {
+    HeapBinario *h = &c->heap;
+    c->marca[u] = c->rodada;
+    c->dist[u] = 0;
+    heap_insere_ou_diminui(h, c->dist, u);
+    int fechados = 0;
+    while (h->size > 0) {
+        int x = heap_remove_min(h, c->dist);
+        if (c->dist[x] > max || ++fechados > limite) break;
+        if (c->alvo[x] == c->rodada && --alvos == 0) break;
+        ListaCH *l = &c->adj[x];
+        for (int i = 0; i < l->len; ++i) {
+            int y = l->v[i];
+            if (y == sem) continue;
+            int nd = c->dist[x] + l->w[i];
+            if (nd > max) continue;
+            if (c->marca[y] != c->rodada || nd < c->dist[y]) {
+                c->marca[y] = c->rodada;
+                c->dist[y] = nd;
+                heap_insere_ou_diminui(h, c->dist, y);
+            }
+        }
+    }
+    for (int i = 0; i < h->size; ++i) h->pos[h->heap[i]] = -1;
+    h->size = 0;
+}
+
+/* Contrai v (ou só simula, se fazer == 0) e devolve quantos atalhos precisa. */
+static int ch_contrai(ContracaoCH *c, int v, int fazer) {
+    ListaCH *l = &c->adj[v];
+    int atalhos = 0;
+    int max_w = 0;
+    for (int i = 0; i < l->len; ++i) if (l->w[i] > max_w) max_w = l->w[i];
+
+    for (int i = 0; i < l->len; ++i) {
+        int u = l->v[i];
+        if (i + 1 == l->len) break;
+        c->rodada++;
+        for (int j = i + 1; j < l->len; ++j) c->alvo[l->v[j]] = c->rodada;
+        ch_testemunha(c, u, v, l->w[i] + max_w, fazer ? CH_TESTEMUNHA_MAX : CH_TESTEMUNHA_SIMULA,
+                      l->len - i - 1);
+        for (int j = i + 1; j < l->len; ++j) {
+            int w = l->v[j];
+            int via = l->w[i] + l->w[j];
+            if (c->marca[w] == c->rodada && c->dist[w] <= via) continue;
+            atalhos++;
+            if (fazer) {
+                lista_ch_poe(&c->adj[u], w, via, v);
+                lista_ch_poe(&c->adj[w], u, via, v);
+            }
+        }
+    }
+    return atalhos;
+}
+
+static int ch_prioridade(ContracaoCH *c, int v) {
+    return 2 * (ch_contrai(c, v, 0) - c->adj[v].len) + c->apagados[v];
+}
+
+static void ch_libera() {
+    free(ch.rank); free(ch.offsets); free(ch.targets); free(ch.weights); free(ch.meio);
+    memset(&ch, 0, sizeof(ch));
+}
+
+/* Constrói a hierarquia sobre o grafo atual. Devolve -1 se o grafo tiver peso
+   negativo (a CH depende de distâncias não negativas). */
+int ch_constroi() {
+    if (tem_peso_negativo) return -1;
+    int n = city_count;
+    ContracaoCH c;
+    memset(&c, 0, sizeof(c));
+    c.adj = xrealloc(NULL, n * sizeof(ListaCH));
+    memset(c.adj, 0, n * sizeof(ListaCH));
+    c.apagados = xrealloc(NULL, n * sizeof(int));
+    c.dist = xrealloc(NULL, n * sizeof(int));
+    c.marca = xrealloc(NULL, n * sizeof(unsigned));
+    c.alvo = xrealloc(NULL, n * sizeof(unsigned));
+    c.heap.heap = xrealloc(NULL, n * sizeof(int));
+    c.heap.pos = xrealloc(NULL, n * sizeof(int));
+    for (int v = 0; v < n; ++v) { c.apagados[v] = 0; c.marca[v] = c.alvo[v] = 0; c.heap.pos[v] = -1; }
+
+    // grafo simples: uma aresta por par, a de menor peso
+    for (int u = 0; u < n; ++u) {
+        int v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) if (v != u) lista_ch_poe(&c.adj[u], v, w, -1);
+    }
+
+    // fila de contração por prioridade (atualização preguiçosa)
+    int *prio = xrealloc(NULL, n * sizeof(int));
+    HeapBinario fila;
+    fila.heap = xrealloc(NULL, n * sizeof(int));
+    fila.pos = xrealloc(NULL, n * sizeof(int));
+    fila.size = 0;
+    for (int v = 0; v < n; ++v) fila.pos[v] = -1;
+    for (int v = 0; v < n; ++v) { prio[v] = ch_prioridade(&c, v); heap_insere_ou_diminui(&fila, prio, v); }
+
+    ch_libera();
+    ch.n = n;
+    ch.rank = xrealloc(NULL, n * sizeof(int));
+    int cap = 0, m = 0;
+    int *src = NULL, *dst = NULL, *pes = NULL, *mei = NULL;
+
+    int ordem = 0;
+    while (fila.size > 0) {
+        int v = heap_remove_min(&fila, prio);
+        int p = ch_prioridade(&c, v);
+        if (fila.size > 0 && p > prio[fila.heap[0]]) {
+            prio[v] = p;
+            heap_insere_ou_diminui(&fila, prio, v);
+            continue;
+        }
+        ListaCH *l = &c.adj[v];
+        // as arestas que sobraram em v vão todas pra cidades contraídas depois
+        for (int i = 0; i < l->len; ++i) {
+            if (m == cap) {
+                cap = cap ? cap * 2 : 1024;
+                src = xrealloc(src, cap * sizeof(int)); dst = xrealloc(dst, cap * sizeof(int));
+                pes = xrealloc(pes, cap * sizeof(int)); mei = xrealloc(mei, cap * sizeof(int));
+            }
+            src[m] = v; dst[m] = l->v[i]; pes[m] = l->w[i]; mei[m] = l->m[i];
+            if (l->m[i] != -1) ch.atalhos++;
+            m++;
+        }
+        ch_contrai(&c, v, 1);
+        for (int i = 0; i < l->len; ++i) {
+            lista_ch_tira(&c.adj[l->v[i]], v);
+            c.apagados[l->v[i]]++;
+        }
+        // a vizinhança mudou: reavalio a prioridade dos vizinhos
+        for (int i = 0; i < l->len; ++i) {
+            int x = l->v[i];
+            prio[x] = ch_prioridade(&c, x);
+            heap_atualiza(&fila, prio, x);
+        }
+        ch.rank[v] = ordem++;
+    }
+
+    // CSR das arestas pra cima
+    ch.m = m;
+    ch.offsets = xrealloc(NULL, (n + 1) * sizeof(int));
+    ch.targets = xrealloc(NULL, m * sizeof(int));
+    ch.weights = xrealloc(NULL, m * sizeof(int));
+    ch.meio = xrealloc(NULL, m * sizeof(int));
+    for (int v = 0; v <= n; ++v) ch.offsets[v] = 0;
+    for (int i = 0; i < m; ++i) ch.offsets[src[i] + 1]++;
+    for (int v = 0; v < n; ++v) ch.offsets[v + 1] += ch.offsets[v];
+    int *pos = xrealloc(NULL, n * sizeof(int));
+    memcpy(pos, ch.offsets, n * sizeof(int));
+    for (int i = 0; i < m; ++i) {
+        int k = pos[src[i]]++;
+        ch.targets[k] = dst[i]; ch.weights[k] = pes[i]; ch.meio[k] = mei[i];
+    }
+
+    free(pos); free(src); free(dst); free(pes); free(mei);
+    free(prio); free(fila.heap); free(fila.pos);
+    for (int v = 0; v < n; ++v) { free(c.adj[v].v); free(c.adj[v].w); free(c.adj[v].m); }
+    free(c.adj); free(c.apagados); free(c.dist); free(c.marca); free(c.alvo);
+    free(c.heap.heap); free(c.heap.pos);
+
+    ch.versao = grafo_versao;
+    ch.valida = 1;
+    return 0;
+}
+
+static inline int ch_atual() {
+    return ch.valida && ch.versao == grafo_versao && ch.n == city_count;
+}
+
+// aresta pra cima de a (rank menor) até b: devolve o índice ou -1
+static int ch_aresta(int a, int b) {
+    for (int k = ch.offsets[a]; k < ch.offsets[a+1]; ++k) if (ch.targets[k] == b) return k;
+    return -1;
+}
+
+/* Escreve em caminho[] as cidades depois de a até b (inclusive), trocando
+   cada atalho pelas duas metades; pilha explícita, sem recursão. */
+static int ch_desempacota(int a, int b, int meio, int caminho[], int tam) {
+    int cap = 64, topo = 0;
+    int *pilha = xrealloc(NULL, cap * 3 * sizeof(int));
+    pilha[0] = a; pilha[1] = b; pilha[2] = meio; topo = 1;
+    while (topo > 0) {
+        topo--;
+        int x = pilha[3*topo], y = pilha[3*topo+1], m = pilha[3*topo+2];
+        if (m == -1) { caminho[tam++] = y; continue; }
+        if (topo + 2 > cap) { cap *= 2; pilha = xrealloc(pilha, cap * 3 * sizeof(int)); }
+        int k1 = ch_aresta(m, x), k2 = ch_aresta(m, y);
+        // empilho a segunda metade antes pra primeira sair primeiro
+        pilha[3*topo] = m; pilha[3*topo+1] = y; pilha[3*topo+2] = ch.meio[k2]; topo++;
+        pilha[3*topo] = x; pilha[3*topo+1] = m; pilha[3*topo+2] = ch.meio[k1]; topo++;
+    }
+    free(pilha);
+    return tam;
+}
+
+/* Consulta: Dijkstra bidirecional só por arestas pra cima. Cada lado para
+   quando o topo da fila já não melhora a melhor ligação. */
+static void rota_ch(RotaScratch *s, int origem, int destino, ResultadoRota *r, int caminho[]) {
+    unsigned rod = s->rodada;
+    lado_poe(&s->lado[0], rod, origem, 0, -1, 0);
+    lado_poe(&s->lado[1], rod, destino, 0, -1, 0);
+    s->lado[0].meio[origem] = s->lado[1].meio[destino] = -1;
+    int melhor = INT_MAX, encontro = -1;
+
+    for (;;) {
+        int ativo[2];
+        for (int k = 0; k < 2; ++k) {
+            BuscaLado *l = &s->lado[k];
+            ativo[k] = l->heap.size > 0 && l->chave[l->heap.heap[0]] < melhor;
+        }
+        if (!ativo[0] && !ativo[1]) break;
+        int k = ativo[0] && (!ativo[1] || s->lado[0].chave[s->lado[0].heap.heap[0]]
+                                         <= s->lado[1].chave[s->lado[1].heap.heap[0]]) ? 0 : 1;
+        BuscaLado *l = &s->lado[k], *o = &s->lado[1 - k];
+        int u = heap_remove_min(&l->heap, l->chave);
+        l->fechado[u] = rod;
+        r->fechados++;
+        int du = l->dist[u];
+        int dou = lado_dist(o, rod, u);
+        if (dou != INT_MAX && du + dou < melhor) { melhor = du + dou; encontro = u; }
+        for (int e = ch.offsets[u]; e < ch.offsets[u+1]; ++e) {
+            r->relaxadas++;
+            int v = ch.targets[e], nd = du + ch.weights[e];
+            if (nd < lado_dist(l, rod, v)) {
+                lado_poe(l, rod, v, nd, u, nd);
+                l->meio[v] = ch.meio[e];
+            }
+        }
+    }
+    lado_esvazia(&s->lado[0]);
+    lado_esvazia(&s->lado[1]);
+    r->dist = melhor;
+    if (melhor == INT_MAX) return;
+
+    // origem .. encontro: cadeia do lado da frente, de trás pra frente
+    BuscaLado *f = &s->lado[0], *b = &s->lado[1];
+    int n_cad = rota_cadeia(f, encontro, s->cadeia);
+    int tam = 0;
+    caminho[tam++] = origem;
+    for (int i = 1; i < n_cad; ++i)
+        tam = ch_desempacota(s->cadeia[i-1], s->cadeia[i], f->meio[s->cadeia[i]], caminho, tam);
+    // encontro .. destino: seguindo prev do lado de trás
+    for (int x = encontro; b->prev[x] != -1; x = b->prev[x])
+        tam = ch_desempacota(x, b->prev[x], b->meio[x], caminho, tam);
+    r->tam = tam;
+}
+
+/* Persistência: <csv>.ch, mesmo esquema de validade do snapshot
+   (tamanho e mtime do CSV no cabeçalho, checksum no corpo). */
+#define CH_MAGIC "GRAFOCH"
+#define CH_VERSAO 2  // 2: ids de cidade mudaram com as chaves sem acento
+
+typedef struct {
+    char magic[8];
+    uint32_t versao;
+    uint32_t bom;
+    uint32_t n, m;
+    uint32_t atalhos;
+    uint32_t reservado;
+    uint64_t csv_tamanho;
+    int64_t csv_mtime;
+    uint64_t checksum;
+} CabecalhoCH;
+
+static void ch_caminho(const char *csv, char *out, size_t cap) {
+    snprintf(out, cap, "%s.ch", csv);
+}
+
+int ch_grava(const char *caminho, const char *csv) {
+    struct stat sb;
+    if (!ch.valida || stat(csv, &sb) != 0) return -1;
+    size_t n = ch.n, m = ch.m;
+    size_t corpo = (2 * n + 1 + 3 * m) * sizeof(int);
+    unsigned char *buf = xrealloc(NULL, corpo);
+    unsigned char *p = buf;
+    memcpy(p, ch.rank, n * sizeof(int)); p += n * sizeof(int);
+    memcpy(p, ch.offsets, (n + 1) * sizeof(int)); p += (n + 1) * sizeof(int);
+    memcpy(p, ch.targets, m * sizeof(int)); p += m * sizeof(int);
+    memcpy(p, ch.weights, m * sizeof(int)); p += m * sizeof(int);
+    memcpy(p, ch.meio, m * sizeof(int));
+
+    CabecalhoCH h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CH_MAGIC, sizeof(CH_MAGIC));
+    h.versao = CH_VERSAO;
+    h.bom = SNAPSHOT_BOM;
+    h.n = n; h.m = m; h.atalhos = ch.atalhos;
+    h.csv_tamanho = sb.st_size;
+    h.csv_mtime = sb.st_mtime;
+    h.checksum = checksum_bytes(buf, corpo);
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", caminho);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f != NULL && fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(buf, 1, corpo, f) == corpo;
+    if (f) ok = (fclose(f) == 0) && ok;
+    free(buf);
+    if (!ok) { remove(tmp); return -1; }
+#ifdef _WIN32
+    remove(caminho);
+#endif
+    if (rename(tmp, caminho) != 0) { remove(tmp); return -1; }
+    return 0;
+}
+
+// versao_csv: grafo_versao do grafo como veio do CSV; conexões reaplicadas
+// do log depois disso deixam a hierarquia desatualizada
+int ch_carrega(const char *caminho, const char *csv, unsigned long versao_csv) {
+    struct stat sb;
+    if (stat(csv, &sb) != 0) return -1;
+    FILE *f = fopen(caminho, "rb");
+    if (f == NULL) return -1;
+    CabecalhoCH h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1
+          && memcmp(h.magic, CH_MAGIC, sizeof(CH_MAGIC)) == 0
+          && h.versao == CH_VERSAO && h.bom == SNAPSHOT_BOM
+          && h.n == (uint32_t)city_count
+          && h.csv_tamanho == (uint64_t)sb.st_size && h.csv_mtime == (int64_t)sb.st_mtime;
+    size_t corpo = ok ? (2 * (size_t)h.n + 1 + 3 * (size_t)h.m) * sizeof(int) : 0;
+    unsigned char *buf = ok ? xrealloc(NULL, corpo) : NULL;
+    ok = ok && fread(buf, 1, corpo, f) == corpo && checksum_bytes(buf, corpo) == h.checksum;
+    fclose(f);
+    if (!ok) { free(buf); return -1; }
+
+    ch_libera();
+    size_t n = h.n, m = h.m;
+    unsigned char *p = buf;
+    ch.rank = copia_heap(p, n * sizeof(int)); p += n * sizeof(int);
+    ch.offsets = copia_heap(p, (n + 1) * sizeof(int)); p += (n + 1) * sizeof(int);
+    ch.targets = copia_heap(p, m * sizeof(int)); p += m * sizeof(int);
+    ch.weights = copia_heap(p, m * sizeof(int)); p += m * sizeof(int);
+    ch.meio = copia_heap(p, m * sizeof(int));
+    free(buf);
+    ch.n = n; ch.m = m; ch.atalhos = h.atalhos;
+    ch.versao = versao_csv;
+    ch.valida = 1;
+    return 0;
+}
+
+/* Menor caminho origem -> destino com o motor escolhido em rota_motor.
+   Preenche caminho[] (origem primeiro, precisa de espaço pra city_count)
+   e devolve o resultado com os contadores da busca. */
+ResultadoRota rota_ponto_a_ponto_com(RotaScratch *s, int origem, int destino, int caminho[]) {
+    ResultadoRota r = { INT_MAX, 0, 0, 0, rota_motor, 0 };
+    if (componente_de(origem) != componente_de(destino)) return r;  // nem busca
+    METRICA_BUSCA_INICIO(MET_ROTA);
+    rota_scratch_garante(s, city_count);
+    rota_nova_rodada(s);
+    RotaMotor motor = rota_motor;
+    if (motor == ROTA_GEO && cidades_com_coord == 0) motor = ROTA_PARADA;
+    if (motor == ROTA_GEO && !geo_escala.valido) {
+        if (grafo_compartilhado) motor = ROTA_PARADA;  // nenhum leitor monta nada
+        else geo_escala_calcula();
+    }
+    if (motor == ROTA_CH && !ch_atual()) motor = ROTA_PARADA;
+    // marcos e hierarquia supõem distância igual nos dois sentidos
+    if (grafo_direcionado && (motor == ROTA_ALT || motor == ROTA_CH)) motor = ROTA_PARADA;
+    if (motor == ROTA_ALT && !alt_atual()) {
+        if (grafo_compartilhado) motor = ROTA_PARADA;  // marcos velhos, como a CH
+        else alt_prepara();
+    }
+    r.motor = motor;
+
+    if (motor == ROTA_CH) {
+        rota_ch(s, origem, destino, &r, caminho);
+    } else if (motor == ROTA_DIJKSTRA) {
+        dijkstra_com(&s->dij, origem, s->dist_cheio, s->prev_cheio);
+        for (int v = 0; v < city_count; ++v)
+            if (s->dist_cheio[v] != INT_MAX) { r.fechados++; r.relaxadas += grau(v); }
+        r.dist = s->dist_cheio[destino];
+        if (r.dist != INT_MAX) r.tam = reconstruct_path(s->prev_cheio, origem, destino, caminho);
+    } else if (motor == ROTA_BIDIR) {
+        int meio;
+        rota_bidirecional(s, origem, destino, &r, &meio);
+        if (r.dist != INT_MAX) {
+            r.tam = rota_cadeia(&s->lado[0], meio, caminho);
+            for (int x = s->lado[1].prev[meio]; x != -1; x = s->lado[1].prev[x]) caminho[r.tam++] = x;
+        }
+    } else {
+        rota_unidirecional(s, motor, origem, destino, &r);
+        if (r.dist != INT_MAX) r.tam = rota_cadeia(&s->lado[0], destino, caminho);
+    }
+    METRICA_BUSCA_FIM(MET_ROTA, r.fechados, r.relaxadas);
+    return r;
+}
+
+/* --- cache de rotas --- */
+
+/* Guarda respostas de rota_ponto_a_ponto() em LRU com limite de memória
+   (--cache-mb=N, 0 desliga). Dois tipos de entrada na mesma lista:
+   - par (origem, destino): resultado e caminho da busca;
+   - árvore de origem: dist[] e prev[] de um Dijkstra completo, que responde
+     qualquer destino. A árvore é montada na segunda falha da mesma origem
+     (na primeira com --rota=dijkstra, que já calcula a árvore toda); com
+     --rota=ch não compensa, a consulta já é mais barata que a árvore.
+   Conexão nova (add_edge) só derruba o que ela muda: uma árvore cai se a
+   aresta encurta a distância de uma das pontas; um par cai se a árvore da
+   origem ou do destino cairia, ou, sem árvore, se as duas pontas estão na
+   componente dele e a aresta é mais curta que a rota guardada. */
+typedef struct {
+    int origem, destino;  // destino -1 = árvore de origem
+    int n;                // árvore: cidades cobertas (as criadas depois ficam de fora)
+    ResultadoRota r;      // par: resultado guardado
+    int *dados;           // árvore: dist[n] e prev[n]; par: caminho[r.tam]
+    size_t bytes;
+    int ant, prox;        // lista LRU, mais recente na cabeça; prox também encadeia as livres
+    int hprox;            // próxima entrada no mesmo balde
+} EntradaCache;
+
+typedef struct {
+    EntradaCache *e;
+    int cap_e, livre;
+    int *baldes;
+    int n_baldes;
+    int cabeca, cauda;
+    int usadas;
+    size_t bytes;
+    int *falhas_fonte;
+    int cap_fontes;
+    long acertos_par, acertos_arvore, falhas, arvores, reparadas, invalidadas, despejadas;
+} CacheRotas;
+
+long cache_rotas_mb = 64;  // --cache-mb=N
+static CacheRotas cache_rotas = { NULL, 0, -1, NULL, 0, -1, -1, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static inline unsigned cache_hash(int origem, int destino) {
+    return ((unsigned)origem * 2654435761u) ^ ((unsigned)(destino + 1) * 40503u);
+}
+
+static int cache_acha(int origem, int destino) {
+    if (cache_rotas.n_baldes == 0) return -1;
+    int i = cache_rotas.baldes[cache_hash(origem, destino) & (cache_rotas.n_baldes - 1)];
+    while (i != -1 && (cache_rotas.e[i].origem != origem || cache_rotas.e[i].destino != destino))
+        i = cache_rotas.e[i].hprox;
+    return i;
+}
+
+static void cache_lru_tira(int i) {
+    EntradaCache *e = &cache_rotas.e[i];
+    if (e->ant != -1) cache_rotas.e[e->ant].prox = e->prox; else cache_rotas.cabeca = e->prox;
+    if (e->prox != -1) cache_rotas.e[e->prox].ant = e->ant; else cache_rotas.cauda = e->ant;
+}
+
+static void cache_lru_frente(int i) {
+    EntradaCache *e = &cache_rotas.e[i];
+    e->ant = -1;
+    e->prox = cache_rotas.cabeca;
+    if (cache_rotas.cabeca != -1) cache_rotas.e[cache_rotas.cabeca].ant = i;
+    else cache_rotas.cauda = i;
+    cache_rotas.cabeca = i;
+}
+
+static void cache_balde_liga(int i) {
+    int b = cache_hash(cache_rotas.e[i].origem, cache_rotas.e[i].destino) & (cache_rotas.n_baldes - 1);
+    cache_rotas.e[i].hprox = cache_rotas.baldes[b];
+    cache_rotas.baldes[b] = i;
+}
+
+static void cache_remove(int i) {
+    EntradaCache *e = &cache_rotas.e[i];
+    int *p = &cache_rotas.baldes[cache_hash(e->origem, e->destino) & (cache_rotas.n_baldes - 1)];
+    while (*p != i) p = &cache_rotas.e[*p].hprox;
+    *p = e->hprox;
+    cache_lru_tira(i);
+    free(e->dados);
+    e->dados = NULL;
+    cache_rotas.bytes -= e->bytes;
+    cache_rotas.usadas--;
+    e->prox = cache_rotas.livre;
+    cache_rotas.livre = i;
+}
+
+// entrada nova (dados ainda por preencher) na cabeça da LRU; -1 se não cabe
+static int cache_nova(int origem, int destino, size_t bytes) {
+    size_t limite = (size_t)cache_rotas_mb << 20;
+    if (bytes > limite) return -1;
+    while (cache_rotas.bytes + bytes > limite && cache_rotas.cauda != -1) {
+        cache_remove(cache_rotas.cauda);
+        cache_rotas.despejadas++;
+    }
+    if (cache_rotas.livre == -1) {
+        int antigo = cache_rotas.cap_e;
+        GARANTE_CAP(cache_rotas.e, cache_rotas.cap_e, antigo + 1);
+        for (int k = cache_rotas.cap_e - 1; k >= antigo; --k) {
+            cache_rotas.e[k].dados = NULL;
+            cache_rotas.e[k].prox = cache_rotas.livre;
+            cache_rotas.livre = k;
+        }
+    }
+    if (cache_rotas.usadas + 1 > cache_rotas.n_baldes) {
+        // ~1 entrada por balde: dobra e religa todas
+        cache_rotas.n_baldes = cache_rotas.n_baldes ? cache_rotas.n_baldes * 2 : 64;
+        cache_rotas.baldes = xrealloc(cache_rotas.baldes, cache_rotas.n_baldes * sizeof(int));
+        for (int b = 0; b < cache_rotas.n_baldes; ++b) cache_rotas.baldes[b] = -1;
+        for (int k = cache_rotas.cabeca; k != -1; k = cache_rotas.e[k].prox) cache_balde_liga(k);
+    }
+    int i = cache_rotas.livre;
+    cache_rotas.livre = cache_rotas.e[i].prox;
+    EntradaCache *e = &cache_rotas.e[i];
+    e->origem = origem;
+    e->destino = destino;
+    e->bytes = bytes;
+    e->dados = xrealloc(NULL, bytes);
+    cache_rotas.bytes += bytes;
+    cache_rotas.usadas++;
+    cache_balde_liga(i);
+    cache_lru_frente(i);
+    return i;
+}
+
+// resposta de uma árvore guardada
+static ResultadoRota cache_responde_arvore(const EntradaCache *e, int destino, int caminho[]) {
+    ResultadoRota r = { INT_MAX, 0, 0, 0, ROTA_DIJKSTRA, 1 };
+    if (destino < e->n && e->dados[destino] != INT_MAX) {
+        r.dist = e->dados[destino];
+        r.tam = reconstruct_path(e->dados + e->n, e->origem, destino, caminho);
+    }
+    return r;
+}
+
+// a aresta nova (a, b, w) muda alguma distância a partir da origem da árvore?
+static int cache_arvore_afetada(const EntradaCache *e, int a, int b, int w) {
+    long long da = a < e->n ? e->dados[a] : INT_MAX;
+    long long db = b < e->n ? e->dados[b] : INT_MAX;
+    if (da != INT_MAX && da + w < db) return 1;
+    if (!grafo_direcionado && db != INT_MAX && db + w < da) return 1;
+    return 0;
+}
+
+// árvore guardada passa a cobrir as cidades criadas depois dela
+static void cache_arvore_estende(EntradaCache *e) {
+    int n = city_count;
+    if (e->n >= n) return;
+    size_t bytes = 2 * (size_t)n * sizeof(int);
+    e->dados = xrealloc(e->dados, bytes);
+    memmove(e->dados + n, e->dados + e->n, e->n * sizeof(int));
+    for (int v = e->n; v < n; ++v) { e->dados[v] = INT_MAX; e->dados[n + v] = -1; }
+    cache_rotas.bytes += bytes - e->bytes;
+    e->bytes = bytes;
+    e->n = n;
+}
+
+// chamada por add_edge antes de inserir a aresta; primeiro os pares (que
+// olham as árvores como estavam), depois as árvores, que são consertadas
+void rota_cache_aresta(int a, int b, int w) {
+    if (cache_rotas.usadas == 0) return;
+    for (int i = cache_rotas.cabeca, prox; i != -1; i = prox) {
+        EntradaCache *e = &cache_rotas.e[i];
+        prox = e->prox;
+        if (e->destino != -1 || w >= 0) continue;
+        cache_remove(i);  // sem garantia nenhuma com peso negativo
+        cache_rotas.invalidadas++;
+    }
+    for (int i = cache_rotas.cabeca, prox; i != -1; i = prox) {
+        EntradaCache *e = &cache_rotas.e[i];
+        prox = e->prox;
+        int cai;
+        if (e->destino == -1) continue;
+        if (w < 0) cai = 1;
+        else {
+            int t = cache_acha(e->origem, -1);
+            if (t == -1 && !grafo_direcionado) t = cache_acha(e->destino, -1);  // serve a do destino
+            if (t != -1) cai = cache_arvore_afetada(&cache_rotas.e[t], a, b, w);
+            else {
+                int c = componente_de(e->origem);
+                cai = w < e->r.dist && componente_de(a) == c && componente_de(b) == c;
+            }
+        }
+        if (cai) { cache_remove(i); cache_rotas.invalidadas++; }
+    }
+    for (int i = cache_rotas.cabeca; w >= 0 && i != -1; i = cache_rotas.e[i].prox) {
+        EntradaCache *e = &cache_rotas.e[i];
+        if (e->destino != -1 || !cache_arvore_afetada(e, a, b, w)) continue;
+        cache_arvore_estende(e);
+        sssp_repara(e->dados, e->dados + e->n, a, b, w);
+        cache_rotas.reparadas++;
+    }
+}
+
+static void cache_fontes_garante(int n) {
+    if (n <= cache_rotas.cap_fontes) return;
+    int antigo = cache_rotas.cap_fontes;
+    GARANTE_CAP(cache_rotas.falhas_fonte, cache_rotas.cap_fontes, n);
+    memset(cache_rotas.falhas_fonte + antigo, 0, (cache_rotas.cap_fontes - antigo) * sizeof(int));
+}
+
+ResultadoRota rota_ponto_a_ponto(int origem, int destino, int caminho[]) {
+    if (cache_rotas_mb <= 0) return rota_ponto_a_ponto_com(&rota_scratch_padrao, origem, destino, caminho);
+
+    int i = cache_acha(origem, destino);
+    if (i != -1) {
+        EntradaCache *e = &cache_rotas.e[i];
+        cache_lru_tira(i);
+        cache_lru_frente(i);
+        cache_rotas.acertos_par++;
+        memcpy(caminho, e->dados, e->r.tam * sizeof(int));
+        ResultadoRota r = e->r;
+        r.do_cache = 1;
+        return r;
+    }
+    if ((i = cache_acha(origem, -1)) != -1) {
+        cache_lru_tira(i);
+        cache_lru_frente(i);
+        cache_rotas.acertos_arvore++;
+        return cache_responde_arvore(&cache_rotas.e[i], destino, caminho);
+    }
+
+    cache_rotas.falhas++;
+    ResultadoRota r = rota_ponto_a_ponto_com(&rota_scratch_padrao, origem, destino, caminho);
+    if (r.dist == INT_MAX) return r;  // componentes diferentes: já sai sem busca
+
+    cache_fontes_garante(city_count);
+    int limiar = rota_motor == ROTA_DIJKSTRA ? 1 : 2;
+    size_t bytes_arvore = 2 * (size_t)city_count * sizeof(int);
+    if (rota_motor != ROTA_CH && ++cache_rotas.falhas_fonte[origem] >= limiar
+        && bytes_arvore <= ((size_t)cache_rotas_mb << 20) / 2
+        && (i = cache_nova(origem, -1, bytes_arvore)) != -1) {
+        EntradaCache *e = &cache_rotas.e[i];
+        e->n = city_count;
+        dijkstra(origem, e->dados, e->dados + e->n);
+        cache_rotas.falhas_fonte[origem] = 0;
+        cache_rotas.arvores++;
+    } else if ((i = cache_nova(origem, destino, r.tam * sizeof(int))) != -1) {
+        cache_rotas.e[i].r = r;
+        memcpy(cache_rotas.e[i].dados, caminho, r.tam * sizeof(int));
+    }
+    return r;
+}
+
+void rota_cache_resumo(FILE *f) {
+    if (cache_rotas_mb <= 0) return;
+    fprintf(f, "Cache de rotas: %ld acertos (%ld por par, %ld por arvore), %ld falhas, "
+               "%ld arvores montadas, %ld consertadas, %ld invalidadas, %ld despejadas, %.1f MB em uso\n",
+            cache_rotas.acertos_par + cache_rotas.acertos_arvore, cache_rotas.acertos_par,
+            cache_rotas.acertos_arvore, cache_rotas.falhas, cache_rotas.arvores,
+            cache_rotas.reparadas, cache_rotas.invalidadas, cache_rotas.despejadas, cache_rotas.bytes / (1024.0 * 1024.0));
+}
+
+/* --- rotas alternativas (k menores caminhos) --- */
+
+/* Opção 8 e consulta "alternativas": as k rotas mais curtas sem cidade
+   repetida, em ordem (algoritmo de Yen). Cada rota nova sai de uma já
+   aceita P: pra cada cidade de desvio d de P, a raiz (P até d) fica fixa,
+   as cidades da raiz antes de d saem do grafo, e também as arestas d -> x
+   que as rotas aceitas com a mesma raiz usam; o melhor trecho de d até o
+   destino nesse grafo reduzido, somado à raiz, vira candidata, e a melhor
+   candidata é a próxima rota. Pra responder na hora em grafo grande:
+   - a árvore de caminhos mínimos até o destino (busca reversa) é montada só
+     até fechar a origem e retomada se outra consulta pro mesmo destino
+     precisar ir mais longe; vale até o grafo mudar. A distância nela é um
+     limite inferior exato pro A* de cada desvio (fora da árvore, o raio já
+     fechado), e se o caminho da árvore a partir de d não passa pela raiz
+     nem começa por aresta proibida, ele já é o trecho, sem busca;
+   - só viram desvio as cidades de P a partir de onde ela se separou da rota
+     de que saiu (as de antes já foram tentadas, melhoria de Lawler);
+   - só as k - aceitas melhores candidatas ficam guardadas e, com a lista
+     cheia, o A* de um desvio para quando não consegue mais bater a pior.
+   Empates saem por km, depois número de cidades, depois a sequência de ids.
+   Exige pesos não negativos. */
+#define ALTERNATIVAS_MAX 20
+#define ALTERNATIVAS_PADRAO 3
+
+typedef struct {
+    int dist;
+    int *cidades;
+    int tam;
+    size_t cap;
+    int desvio;        // posição onde se separou da rota de que saiu
+} RotaAlternativa;
+
+// memória de uma consulta de alternativas; no servidor, uma por thread
+typedef struct {
+    BuscaLado arvore;           // busca reversa: dist = km até o destino, prev = próxima cidade
+    unsigned rodada_arvore;
+    int arvore_valida;
+    int destino, n;             // destino e city_count da árvore
+    unsigned long versao;       // grafo_versao da árvore
+    int raio;                   // maior distância já fechada na árvore
+    BuscaLado busca;            // A* de um desvio
+    unsigned rodada;
+    unsigned *bloqueada;        // raiz do desvio: bloqueada[v] == bloqueio
+    unsigned bloqueio;
+    int *trecho;
+    int cap;
+    char igual_raiz[ALTERNATIVAS_MAX];
+    RotaAlternativa aceitas[ALTERNATIVAS_MAX];
+    RotaAlternativa candidatas[ALTERNATIVAS_MAX + 1];  // a última é rascunho
+    int n_aceitas, n_candidatas;
+    long desvios, pela_arvore;  // da última consulta: trechos por A* e direto da árvore
+    long fechados, relaxadas;
+} AlternativasScratch;
+
+static AlternativasScratch alternativas_scratch_padrao;
+
+static void alternativas_garante(AlternativasScratch *s, int n) {
+    if (n <= s->cap) return;
+    lado_garante(&s->arvore, s->cap, n);
+    lado_garante(&s->busca, s->cap, n);
+    s->bloqueada = xrealloc(s->bloqueada, n * sizeof(unsigned));
+    for (int i = s->cap; i < n; ++i) s->bloqueada[i] = 0;
+    s->trecho = xrealloc(s->trecho, n * sizeof(int));
+    s->cap = n;
+}
+
+// rodada nova num lado só (zera as marcas quando dá a volta)
+static unsigned lado_nova_rodada(BuscaLado *l, unsigned rodada, int cap) {
+    if (++rodada == 0) {
+        for (int i = 0; i < cap; ++i) l->marca[i] = l->fechado[i] = 0;
+        rodada = 1;
+    }
+    l->heap.size = 0;
+    return rodada;
+}
+
+// fecha a árvore reversa até alvo, ou até acabar o que chega no destino
+static void alternativas_arvore_ate(AlternativasScratch *s, int alvo) {
+    BuscaLado *l = &s->arvore;
+    unsigned rod = s->rodada_arvore;
+    while (l->fechado[alvo] != rod && l->heap.size > 0) {
+        int x = heap_remove_min(&l->heap, l->chave);
+        l->fechado[x] = rod;
+        s->raio = l->dist[x];
+        s->fechados++;
+        int u, w;
+        VizinhoIter viz;
+        viz_entrada_inicio(x, &viz);
+        while (viz_entrada_proximo(&viz, &u, &w)) {
+            s->relaxadas++;
+            int nd = l->dist[x] + w;
+            if (l->fechado[u] != rod && nd < lado_dist(l, rod, u)) lado_poe(l, rod, u, nd, x, nd);
+        }
+    }
+}
+
+// limite inferior dos km de v até o destino; INT_MAX se v não chega lá
+static inline int alternativas_limite(const AlternativasScratch *s, int v) {
+    const BuscaLado *l = &s->arvore;
+    if (l->fechado[v] == s->rodada_arvore) return l->dist[v];
+    return l->heap.size > 0 ? s->raio : INT_MAX;
+}
+
+static int alternativa_proibida(int v, const int proibidas[], int n) {
+    for (int j = 0; j < n; ++j) if (proibidas[j] == v) return 1;
+    return 0;
+}
+
+// caminho da árvore a partir de d em s->trecho, se não passa pela raiz nem
+// começa por aresta proibida; devolve o tamanho (0 = não serve)
+static int alternativas_trecho_arvore(AlternativasScratch *s, int d, const int proibidas[], int n_proibidas) {
+    const BuscaLado *l = &s->arvore;
+    if (l->fechado[d] != s->rodada_arvore || alternativa_proibida(l->prev[d], proibidas, n_proibidas)) return 0;
+    int tam = 0;
+    for (int x = d; x != -1; x = l->prev[x]) {
+        if (s->bloqueada[x] == s->bloqueio) return 0;
+        s->trecho[tam++] = x;
+    }
+    return tam;
+}
+
+// A* de d até o destino sem a raiz nem as arestas d -> proibidas; desiste
+// se não dá pra chegar com até 'limite' km. Devolve os km (INT_MAX = não
+// chegou) e o trecho fica em s->busca
+static int alternativas_desvio(AlternativasScratch *s, int d, int destino,
+                               const int proibidas[], int n_proibidas, int limite) {
+    BuscaLado *l = &s->busca;
+    unsigned rod = s->rodada = lado_nova_rodada(l, s->rodada, s->cap);
+    int h = alternativas_limite(s, d), km = INT_MAX;
+    if (h > limite) return INT_MAX;
+    s->desvios++;
+    lado_poe(l, rod, d, 0, -1, h);
+    while (l->heap.size > 0) {
+        int u = heap_remove_min(&l->heap, l->chave);
+        if (l->chave[u] > limite) break;
+        l->fechado[u] = rod;
+        s->fechados++;
+        if (u == destino) { km = l->dist[u]; break; }
+        int du = l->dist[u], v, w;
+        VizinhoIter viz;
+        viz_inicio(u, &viz);
+        while (viz_proximo(&viz, &v, &w)) {
+            s->relaxadas++;
+            if (s->bloqueada[v] == s->bloqueio || l->fechado[v] == rod) continue;
+            if (u == d && alternativa_proibida(v, proibidas, n_proibidas)) continue;
+            int nd = du + w, hv = alternativas_limite(s, v);
+            if (hv == INT_MAX || nd >= lado_dist(l, rod, v)) continue;
+            lado_poe(l, rod, v, nd, u, nd + hv);
+        }
+    }
+    lado_esvazia(l);
+    return km;
+}
+
+// ordem das rotas: km, número de cidades, sequência de ids
+static int alternativa_antes(const RotaAlternativa *a, const RotaAlternativa *b) {
+    if (a->dist != b->dist) return a->dist < b->dist;
+    if (a->tam != b->tam) return a->tam < b->tam;
+    for (int i = 0; i < a->tam; ++i)
+        if (a->cidades[i] != b->cidades[i]) return a->cidades[i] < b->cidades[i];
+    return 0;
+}
+
+static void alternativa_troca(RotaAlternativa *a, RotaAlternativa *b) {
+    RotaAlternativa tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+// índice da pior candidata (lista não vazia)
+static int alternativas_pior(const AlternativasScratch *s) {
+    int p = 0;
+    for (int j = 1; j < s->n_candidatas; ++j)
+        if (alternativa_antes(&s->candidatas[p], &s->candidatas[j])) p = j;
+    return p;
+}
+
+// guarda o rascunho entre as 'max' melhores candidatas, se couber e não for repetido
+static void alternativas_candidata(AlternativasScratch *s, int max) {
+    RotaAlternativa *c = &s->candidatas[ALTERNATIVAS_MAX];
+    for (int j = 0; j < s->n_candidatas; ++j) {
+        const RotaAlternativa *o = &s->candidatas[j];
+        if (o->dist == c->dist && o->tam == c->tam && memcmp(o->cidades, c->cidades, c->tam * sizeof(int)) == 0) return;
+    }
+    int pos;
+    if (s->n_candidatas < max) pos = s->n_candidatas++;
+    else if (!alternativa_antes(c, &s->candidatas[pos = alternativas_pior(s)])) return;
+    alternativa_troca(&s->candidatas[pos], c);
+}
+
+// km da aresta mais curta u -> v
+static int peso_entre(int u, int v) {
+    int melhor = INT_MAX, x, w;
+    VizinhoIter viz;
+    viz_inicio(u, &viz);
+    while (viz_proximo(&viz, &x, &w)) if (x == v && w < melhor) melhor = w;
+    return melhor;
+}
+
+// gera as candidatas que saem da última rota aceita
+static void alternativas_expande(AlternativasScratch *s, int destino, int k) {
+    const RotaAlternativa *P = &s->aceitas[s->n_aceitas - 1];
+    int max = k - s->n_aceitas;
+    if (++s->bloqueio == 0) {
+        memset(s->bloqueada, 0, s->cap * sizeof(unsigned));
+        s->bloqueio = 1;
+    }
+    memset(s->igual_raiz, 1, s->n_aceitas);
+    int raiz = 0;  // km de P[0] até P[i]
+    for (int i = 0; i + 1 < P->tam; ++i) {
+        int d = P->cidades[i];
+        if (i > 0) {
+            raiz += peso_entre(P->cidades[i - 1], d);
+            s->bloqueada[P->cidades[i - 1]] = s->bloqueio;
+        }
+        // rotas aceitas que começam com a mesma raiz: a próxima cidade delas fica proibida
+        int proibidas[ALTERNATIVAS_MAX], n_proibidas = 0;
+        for (int q = 0; q < s->n_aceitas; ++q) {
+            const RotaAlternativa *Q = &s->aceitas[q];
+            if (s->igual_raiz[q] && (Q->tam <= i || Q->cidades[i] != d)) s->igual_raiz[q] = 0;
+            if (s->igual_raiz[q] && Q->tam > i + 1) proibidas[n_proibidas++] = Q->cidades[i + 1];
+        }
+        if (i < P->desvio) continue;
+
+        int limite = INT_MAX;
+        if (s->n_candidatas == max) {
+            limite = s->candidatas[alternativas_pior(s)].dist - raiz;
+            if (limite < 0) continue;
+        }
+        int km, tam = alternativas_trecho_arvore(s, d, proibidas, n_proibidas);
+        if (tam > 0) {
+            km = s->arvore.dist[d];
+            if (km > limite) continue;
+            s->pela_arvore++;
+        } else {
+            km = alternativas_desvio(s, d, destino, proibidas, n_proibidas, limite);
+            if (km == INT_MAX) continue;
+            tam = rota_cadeia(&s->busca, destino, s->trecho);
+        }
+        RotaAlternativa *c = &s->candidatas[ALTERNATIVAS_MAX];
+        c->dist = raiz + km;
+        c->desvio = i;
+        c->tam = i + tam;
+        GARANTE_CAP(c->cidades, c->cap, (size_t)c->tam);
+        memcpy(c->cidades, P->cidades, i * sizeof(int));
+        memcpy(c->cidades + i, s->trecho, tam * sizeof(int));
+        alternativas_candidata(s, max);
+    }
+}
+
+/* Até k rotas (no máximo ALTERNATIVAS_MAX) de origem a destino, da mais
+   curta pra mais longa, em s->aceitas. Devolve quantas achou (0 = não há
+   caminho) ou -1 se o grafo tem peso negativo. */
+int rotas_alternativas_com(AlternativasScratch *s, int origem, int destino, int k) {
+    if (tem_peso_negativo) return -1;
+    if (k > ALTERNATIVAS_MAX) k = ALTERNATIVAS_MAX;
+    METRICA_BUSCA_INICIO(MET_ALTERNATIVAS);
+    alternativas_garante(s, city_count);
+    s->n_aceitas = s->n_candidatas = 0;
+    s->desvios = s->pela_arvore = s->fechados = s->relaxadas = 0;
+    BuscaLado *arv = &s->arvore;
+    if (k <= 0 || componente_de(origem) != componente_de(destino)) {
+        // sem rota
+    } else if (origem == destino) {
+        RotaAlternativa *r = &s->aceitas[s->n_aceitas++];
+        GARANTE_CAP(r->cidades, r->cap, 1);
+        r->cidades[0] = origem;
+        r->tam = 1;
+        r->dist = r->desvio = 0;
+    } else {
+        if (!s->arvore_valida || s->destino != destino || s->versao != grafo_versao || s->n != city_count) {
+            lado_esvazia(arv);
+            s->rodada_arvore = lado_nova_rodada(arv, s->rodada_arvore, s->cap);
+            lado_poe(arv, s->rodada_arvore, destino, 0, -1, 0);
+            s->destino = destino;
+            s->versao = grafo_versao;
+            s->n = city_count;
+            s->raio = 0;
+            s->arvore_valida = 1;
+        }
+        alternativas_arvore_ate(s, origem);
+        if (arv->fechado[origem] == s->rodada_arvore) {
+            // a primeira é o caminho da árvore
+            RotaAlternativa *r = &s->aceitas[s->n_aceitas++];
+            r->tam = 0;
+            for (int x = origem; x != -1; x = arv->prev[x]) r->tam++;
+            GARANTE_CAP(r->cidades, r->cap, (size_t)r->tam);
+            r->tam = 0;
+            for (int x = origem; x != -1; x = arv->prev[x]) r->cidades[r->tam++] = x;
+            r->dist = arv->dist[origem];
+            r->desvio = 0;
+            while (s->n_aceitas < k) {
+                alternativas_expande(s, destino, k);
+                if (s->n_candidatas == 0) break;
+                int melhor = 0;
+                for (int j = 1; j < s->n_candidatas; ++j)
+                    if (alternativa_antes(&s->candidatas[j], &s->candidatas[melhor])) melhor = j;
+                alternativa_troca(&s->aceitas[s->n_aceitas++], &s->candidatas[melhor]);
+                alternativa_troca(&s->candidatas[melhor], &s->candidatas[--s->n_candidatas]);
+            }
+        }
+    }
+    METRICA_BUSCA_FIM(MET_ALTERNATIVAS, s->fechados, s->relaxadas);
+    return s->n_aceitas;
+}
+
+int rotas_alternativas(int origem, int destino, int k) {
+    return rotas_alternativas_com(&alternativas_scratch_padrao, origem, destino, k);
+}
+
+/* --- matriz de distâncias (modo lote) --- */
+
+/* --matriz=arquivo calcula a distância de cada origem pra cada destino (todas
+   as cidades, ou as listas de --origens/--destinos) com um Dijkstra completo
+   por origem, repartidas entre --threads linhas de execução. Cada thread tem
+   seu DijkstraScratch e seus dist/prev e o grafo só é lido, então não há
+   trava durante a busca. As linhas ficam prontas fora de ordem num anel de
+   buffers e a thread principal grava na ordem das origens; a memória usada
+   não depende do tamanho da matriz.
+   CSV: cabeçalho "origem,<destinos...>", uma linha por origem, campo vazio
+   quando não há caminho. Binário (--formato=bin ou arquivo .bin): cabeçalho,
+   nomes das origens e dos destinos terminados em '\0', e a partir de
+   off_dist os int32 linha por linha (MATRIZ_SEM_CAMINHO = sem caminho). */
+#define MATRIZ_MAGIC "GRAFOMZ"
+#define MATRIZ_VERSAO 1
+#define MATRIZ_SEM_CAMINHO INT32_MAX
+#define MATRIZ_ANEL_POR_THREAD 4
+
+typedef struct {
+    char magic[8];
+    uint32_t versao;
+    uint32_t bom;
+    uint32_t n_origens, n_destinos;
+    uint64_t off_nomes;
+    uint64_t off_dist;
+} CabecalhoMatriz;
+
+typedef struct {
+    const int *origens, *destinos;
+    int n_origens, n_destinos;
+    int binario;
+    // anel de linhas: buf[k] guarda a linha linha[k] (-1 = livre)
+    int anel;
+    char **buf;
+    size_t *len, *cap;
+    int *linha;
+    char *pronta;
+    int proxima;  // próxima origem a calcular
+    int gravadas; // linhas já gravadas (sempre em ordem)
+#ifndef _WIN32
+    pthread_mutex_t trava;
+    pthread_cond_t sinal_pronta, sinal_livre;
+#endif
+} MatrizLote;
+
+typedef struct {
+    MatrizLote *lote;
+    DijkstraScratch s;
+    int *dist, *prev;
+} MatrizTrabalho;
+
+// escreve v em decimal e devolve o fim (snprintf por célula pesa na matriz toda)
+static char *escreve_int(char *p, int v) {
+    char tmp[12];
+    int k = 0;
+    unsigned u = v < 0 ? 0u - (unsigned)v : (unsigned)v;
+    do { tmp[k++] = '0' + u % 10; u /= 10; } while (u);
+    if (v < 0) *p++ = '-';
+    while (k) *p++ = tmp[--k];
+    return p;
+}
+
+// campo CSV com aspas só se precisar (vírgula, aspas ou quebra de linha)
+static void csv_campo(FILE *f, const char *s) {
+    if (strpbrk(s, ",\"\r\n") == NULL) { fputs(s, f); return; }
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"') fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// calcula a linha r da matriz e formata no buffer k do anel
+static void matriz_linha(MatrizTrabalho *t, int r, int k) {
+    MatrizLote *L = t->lote;
+    dijkstra_com(&t->s, L->origens[r], t->dist, t->prev);
+    size_t max = L->binario ? L->n_destinos * sizeof(int32_t) : (size_t)L->n_destinos * 12 + 1;
+    GARANTE_CAP(L->buf[k], L->cap[k], max);
+    if (L->binario) {
+        int32_t *out = (int32_t *)L->buf[k];
+        for (int j = 0; j < L->n_destinos; ++j) {
+            int d = t->dist[L->destinos[j]];
+            out[j] = d == INT_MAX ? MATRIZ_SEM_CAMINHO : d;
+        }
+        L->len[k] = max;
+    } else {
+        // o nome da origem vai na frente, na hora de gravar
+        char *p = L->buf[k];
+        for (int j = 0; j < L->n_destinos; ++j) {
+            int d = t->dist[L->destinos[j]];
+            *p++ = ',';
+            if (d != INT_MAX) p = escreve_int(p, d);
+        }
+        *p++ = '\n';
+        L->len[k] = p - L->buf[k];
+    }
+}
+
+#ifndef _WIN32
+static void *matriz_trabalhador(void *arg) {
+    MatrizTrabalho *t = arg;
+    MatrizLote *L = t->lote;
+    pthread_mutex_lock(&L->trava);
+    while (L->proxima < L->n_origens) {
+        int r = L->proxima++;
+        int k = r % L->anel;
+        // o buffer só fica livre depois que a linha r - anel foi gravada
+        while (r - L->anel >= L->gravadas) pthread_cond_wait(&L->sinal_livre, &L->trava);
+        L->linha[k] = r;
+        pthread_mutex_unlock(&L->trava);
+
+        matriz_linha(t, r, k);
+
+        pthread_mutex_lock(&L->trava);
+        L->pronta[k] = 1;
+        pthread_cond_signal(&L->sinal_pronta);
+    }
+    pthread_mutex_unlock(&L->trava);
+    return NULL;
+}
+#endif
+
+static void matriz_grava_linha(MatrizLote *L, FILE *f, int r, int k) {
+    if (!L->binario) csv_campo(f, city_name(L->origens[r]));
+    fwrite(L->buf[k], 1, L->len[k], f);
+}
+
+/* Grava a matriz origens x destinos em f. Devolve 0 ou -1 (erro de escrita). */
+int matriz_distancias(FILE *f, const int *origens, int n_origens,
+                      const int *destinos, int n_destinos, int binario, int threads) {
+    MatrizLote L;
+    memset(&L, 0, sizeof(L));
+    L.origens = origens; L.n_origens = n_origens;
+    L.destinos = destinos; L.n_destinos = n_destinos;
+    L.binario = binario;
+
+    if (binario) {
+        CabecalhoMatriz h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MATRIZ_MAGIC, sizeof(MATRIZ_MAGIC));
+        h.versao = MATRIZ_VERSAO;
+        h.bom = SNAPSHOT_BOM;
+        h.n_origens = n_origens;
+        h.n_destinos = n_destinos;
+        h.off_nomes = sizeof(h);
+        uint64_t pos = sizeof(h);
+        for (int i = 0; i < n_origens; ++i) pos += city_names[origens[i]].len + 1;
+        for (int j = 0; j < n_destinos; ++j) pos += city_names[destinos[j]].len + 1;
+        h.off_dist = (pos + 7) & ~(uint64_t)7;
+        fwrite(&h, sizeof(h), 1, f);
+        for (int i = 0; i < n_origens; ++i) fwrite(city_name(origens[i]), 1, city_names[origens[i]].len + 1, f);
+        for (int j = 0; j < n_destinos; ++j) fwrite(city_name(destinos[j]), 1, city_names[destinos[j]].len + 1, f);
+        static const char zeros[8] = {0};
+        fwrite(zeros, 1, h.off_dist - pos, f);
+    } else {
+        fputs("origem", f);
+        for (int j = 0; j < n_destinos; ++j) { fputc(',', f); csv_campo(f, city_name(destinos[j])); }
+        fputc('\n', f);
+    }
+
+#ifdef _WIN32
+    threads = 1;
+#endif
+    if (threads > n_origens) threads = n_origens;
+    if (threads < 1) threads = 1;
+    L.anel = threads == 1 ? 1 : threads * MATRIZ_ANEL_POR_THREAD;
+    L.buf = xrealloc(NULL, L.anel * sizeof(char *));
+    L.len = xrealloc(NULL, L.anel * sizeof(size_t));
+    L.cap = xrealloc(NULL, L.anel * sizeof(size_t));
+    L.linha = xrealloc(NULL, L.anel * sizeof(int));
+    L.pronta = xrealloc(NULL, L.anel);
+    for (int k = 0; k < L.anel; ++k) { L.buf[k] = NULL; L.cap[k] = 0; L.linha[k] = -1; L.pronta[k] = 0; }
+
+    MatrizTrabalho *trab = xrealloc(NULL, threads * sizeof(MatrizTrabalho));
+    memset(trab, 0, threads * sizeof(MatrizTrabalho));
+    for (int t = 0; t < threads; ++t) {
+        trab[t].lote = &L;
+        dijkstra_scratch_garante(&trab[t].s, city_count);
+        trab[t].dist = xrealloc(NULL, city_count * sizeof(int));
+        trab[t].prev = xrealloc(NULL, city_count * sizeof(int));
+    }
+
+    if (threads == 1) {
+        for (int r = 0; r < n_origens; ++r) {
+            matriz_linha(&trab[0], r, 0);
+            matriz_grava_linha(&L, f, r, 0);
+        }
+    }
+#ifndef _WIN32
+    else {
+        pthread_mutex_init(&L.trava, NULL);
+        pthread_cond_init(&L.sinal_pronta, NULL);
+        pthread_cond_init(&L.sinal_livre, NULL);
+        pthread_t *ids = xrealloc(NULL, threads * sizeof(pthread_t));
+        for (int t = 0; t < threads; ++t)
+            if (pthread_create(&ids[t], NULL, matriz_trabalhador, &trab[t]) != 0) {
+                fprintf(stderr, "ERRO: nao foi possivel criar thread\n");
+                exit(1);
+            }
+        // a thread principal só grava, na ordem das origens
+        for (int r = 0; r < n_origens; ++r) {
+            int k = r % L.anel;
+            pthread_mutex_lock(&L.trava);
+            while (L.linha[k] != r || !L.pronta[k]) pthread_cond_wait(&L.sinal_pronta, &L.trava);
+            pthread_mutex_unlock(&L.trava);
+
+            matriz_grava_linha(&L, f, r, k);
+
+            pthread_mutex_lock(&L.trava);
+            L.linha[k] = -1;
+            L.pronta[k] = 0;
+            L.gravadas++;
+            pthread_cond_broadcast(&L.sinal_livre);
+            pthread_mutex_unlock(&L.trava);
+        }
+        for (int t = 0; t < threads; ++t) pthread_join(ids[t], NULL);
+        free(ids);
+        pthread_mutex_destroy(&L.trava);
+        pthread_cond_destroy(&L.sinal_pronta);
+        pthread_cond_destroy(&L.sinal_livre);
+    }
+#endif
+
+    for (int t = 0; t < threads; ++t) {
+        free(trab[t].s.bin.heap); free(trab[t].s.bin.pos); free(trab[t].s.radix.zero); free(trab[t].s.fechado);
+        for (int b = 0; b < RADIX_BALDES; ++b) free(trab[t].s.radix.balde[b]);
+        free(trab[t].dist); free(trab[t].prev);
+    }
+    free(trab);
+    for (int k = 0; k < L.anel; ++k) free(L.buf[k]);
+    free(L.buf); free(L.len); free(L.cap); free(L.linha); free(L.pronta);
+    return ferror(f) ? -1 : 0;
+}
+
+// lê uma lista de nomes (um por linha, linhas vazias ignoradas); -1 se algum
+// nome não existe
+static int le_lista_cidades(const char *caminho, int **ids, int *n) {
+    FILE *f = fopen(caminho, "r");
+    if (f == NULL) { fprintf(stderr, "ERRO: nao foi possivel abrir '%s'\n", caminho); return -1; }
+    size_t cap = 0;
+    *ids = NULL;
+    *n = 0;
+    long linha = 0;
+    char *s;
+    while ((s = ler_linha(f)) != NULL) {
+        linha++;
+        char buf[CHAVE_BUF];
+        char *key = nome_para_chave(s, buf);
+        int id = key[0] ? city_lookup_key(key) : -2;
+        chave_libera(key, buf);
+        if (id == -2) continue;
+        if (id < 0) {
+            fprintf(stderr, "%s:%ld: cidade desconhecida '%s'\n", caminho, linha, s);
+            fclose(f);
+            free(*ids);
+            return -1;
+        }
+        GARANTE_CAP(*ids, cap, (size_t)*n + 1);
+        (*ids)[(*n)++] = id;
+    }
+    fclose(f);
+    return 0;
+}
+
+const char *bench_modo = NULL;      // --bench=levenshtein|incremental|carga|nomes|fuzzy|rotas|analise|todos
+const char *gerar_spec = NULL;      // --gerar=tipo:N[:semente]
+int mostrar_stats = 0;              // --stats
+const char *matriz_saida = NULL;    // --matriz=arquivo ("-" = saída padrão)
+const char *matriz_origens = NULL;  // --origens=arquivo
+const char *matriz_destinos = NULL; // --destinos=arquivo
+
+// --formato=...; a matriz aceita csv/bin, o modo de consultas csv/json
+typedef enum { FORMATO_AUTO, FORMATO_CSV, FORMATO_BIN, FORMATO_JSON } FormatoSaida;
+FormatoSaida formato_saida = FORMATO_AUTO;
+
+// modo lote da matriz; devolve o código de saída do programa
+int modo_matriz() {
+    if (formato_saida == FORMATO_JSON) {
+        fprintf(stderr, "ERRO: a matriz so sai em csv ou bin\n");
+        return 1;
+    }
+    int *origens = NULL, *destinos = NULL;
+    int n_origens = city_count, n_destinos = city_count;
+    if (matriz_origens && le_lista_cidades(matriz_origens, &origens, &n_origens) != 0) return 1;
+    if (matriz_destinos && le_lista_cidades(matriz_destinos, &destinos, &n_destinos) != 0) return 1;
+    int *todas = NULL;
+    if (!origens || !destinos) {
+        todas = xrealloc(NULL, city_count * sizeof(int));
+        for (int i = 0; i < city_count; ++i) todas[i] = i;
+    }
+
+    int binario = formato_saida == FORMATO_BIN;
+    if (formato_saida == FORMATO_AUTO) {
+        size_t n = strlen(matriz_saida);
+        binario = n > 4 && strcmp(matriz_saida + n - 4, ".bin") == 0;
+    }
+    int padrao = strcmp(matriz_saida, "-") == 0;
+    FILE *f = padrao ? stdout : fopen(matriz_saida, binario ? "wb" : "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERRO: nao foi possivel criar '%s'\n", matriz_saida);
+        return 1;
+    }
+    int threads = threads_lote > 0 ? threads_lote : threads_padrao();
+    if (threads > n_origens) threads = n_origens > 0 ? n_origens : 1;
+
+    double t0 = agora_seg();
+    int erro = matriz_distancias(f, origens ? origens : todas, n_origens,
+                                 destinos ? destinos : todas, n_destinos, binario, threads);
+    if (padrao) erro = fflush(f) != 0 || erro;
+    else erro = fclose(f) != 0 || erro;
+    double seg = agora_seg() - t0;
+    if (erro) fprintf(stderr, "ERRO: falha ao gravar '%s'\n", matriz_saida);
+    else fprintf(stderr, "Matriz %dx%d (%s) em %.3f s com %d thread(s), %.0f origens/s\n",
+                 n_origens, n_destinos, binario ? "binaria" : "csv", seg, threads,
+                 n_origens / (seg > 0 ? seg : 1e-9));
+    free(origens); free(destinos); free(todas);
+    return erro ? 1 : 0;
+}
+
+/* --- log de conexões novas (WAL) --- */
+
+/* Conexão criada pela opção 5 ou por "conexao" no modo lote vai primeiro pro
+   <csv>.wal, um arquivo só de acréscimos, e não direto pro CSV. Cada registro
+   leva o tamanho e um checksum do corpo; na partida os registros íntegros são
+   reaplicados sobre o grafo carregado do CSV/snapshot e um registro cortado
+   no meio (queda durante a escrita) é descartado junto com o que vem depois.
+   Os registros ficam num buffer e vão pro arquivo num write só (commit em
+   grupo): a cada conexão no menu, e no modo lote a cada WAL_GRUPO_BYTES ou no
+   fim do lote. --fsync escolhe a durabilidade:
+   - sempre:    fsync depois de cada conexão (no lote, cada uma é um commit);
+   - periodico: fsync no commit se o último foi há mais de WAL_FSYNC_MS, e
+                uma thread faz o write+fsync do que ficou pendente quando a
+                primeira conexão sem fsync completa WAL_FSYNC_MS (padrão; uma
+                queda perde no máximo esse intervalo; no Windows não há a
+                thread e o fsync espera o próximo commit ou a saída);
+   - nunca:     só write, o sistema decide quando vai pro disco.
+   Compactação: ao sair, na partida depois de reaplicar, ou quando o log passa
+   de WAL_COMPACTA registros, as conexões são acrescentadas no CSV e o log
+   recomeça vazio. Antes de mexer no CSV o cabeçalho do log marca o tamanho
+   dele; se o programa cair no meio, a partida corta o CSV de volta nesse
+   tamanho e refaz a compactação, então nenhuma conexão entra duas vezes. */
+#define WAL_MAGIC "GRAFOWL"
+#define WAL_VERSAO 1
+#define WAL_BOM 0x01020304u
+#define WAL_GRUPO_BYTES (64 * 1024)
+#define WAL_COMPACTA 1024
+#define WAL_FSYNC_MS 1000
+
+typedef struct {
+    char magic[8];
+    uint32_t versao;
+    uint32_t bom;
+    uint32_t compactando;  // 1 = CSV sendo reescrito a partir de csv_base
+    uint32_t reservado;
+    uint64_t csv_base;     // tamanho do CSV antes da compactação
+} CabecalhoWAL;
+
+// registro: uint32 tamanho do corpo, uint32 checksum do corpo, e o corpo:
+// int32 km, uint16 len_a, uint16 len_b, nome a, nome b (sem '\0')
+typedef struct {
+    uint32_t tam;
+    uint32_t verif;
+} CabecalhoRegistroWAL;
+
+typedef enum { FSYNC_SEMPRE, FSYNC_PERIODICO, FSYNC_NUNCA } PoliticaFsync;
+PoliticaFsync politica_fsync = FSYNC_PERIODICO;  // --fsync=sempre|periodico|nunca
+
+typedef struct {
+    const char *csv;       // NULL = sem log (CSV não é arquivo comum)
+    char caminho[4096];
+    FILE *f;               // NULL enquanto o arquivo do log não existe
+    unsigned char *buf;    // registros ainda não escritos
+    size_t len, cap;
+    long registros;        // registros no arquivo + no buffer
+    double ultimo_fsync;
+    int sujo;              // escrito depois do último fsync
+    double pendente_desde; // primeira conexão ainda sem fsync (buffer ou arquivo)
+} LogConexoes;
+
+static LogConexoes wal = {0};
+
+#ifndef _WIN32
+// o log é usado pela thread do --fsync=periodico e por quem cria conexões
+static pthread_mutex_t wal_trava = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_pendente = PTHREAD_COND_INITIALIZER;
+static int wal_sincronizador_ativo = 0;
+#define WAL_TRAVA() pthread_mutex_lock(&wal_trava)
+#define WAL_SOLTA() pthread_mutex_unlock(&wal_trava)
+#else
+#define WAL_TRAVA() ((void)0)
+#define WAL_SOLTA() ((void)0)
+#endif
+
+static void wal_caminho(const char *csv, char *out, size_t cap) {
+    snprintf(out, cap, "%s.wal", csv);
+}
+
+static int sincroniza_arquivo(FILE *f) {
+    if (fflush(f) != 0) return -1;
+#ifndef _WIN32
+    return fsync(fileno(f));
+#else
+    return _commit(_fileno(f));
+#endif
+}
+
+static int trunca_arquivo(FILE *f, uint64_t tam) {
+    if (fflush(f) != 0) return -1;
+#ifndef _WIN32
+    return ftruncate(fileno(f), (off_t)tam);
+#else
+    return _chsize_s(_fileno(f), (__int64)tam) == 0 ? 0 : -1;
+#endif
+}
+
+// lê o próximo registro íntegro de d[*pos..len); nomes vão pra a/b com '\0'
+static int wal_proximo(const unsigned char *d, size_t len, size_t *pos, int *km, char **a, char **b) {
+    static char *nomes = NULL;
+    static size_t cap = 0;
+    CabecalhoRegistroWAL r;
+    if (len - *pos < sizeof(r)) return 0;
+    memcpy(&r, d + *pos, sizeof(r));
+    if (r.tam < 8 || r.tam > len - *pos - sizeof(r)) return 0;
+    const unsigned char *c = d + *pos + sizeof(r);
+    if ((uint32_t)checksum_bytes(c, r.tam) != r.verif) return 0;
+    int32_t w;
+    uint16_t la, lb;
+    memcpy(&w, c, 4); memcpy(&la, c + 4, 2); memcpy(&lb, c + 6, 2);
+    if (8u + la + lb != r.tam) return 0;
+    GARANTE_CAP(nomes, cap, (size_t)la + lb + 2);
+    memcpy(nomes, c + 8, la); nomes[la] = '\0';
+    memcpy(nomes + la + 1, c + 8 + la, lb); nomes[la + 1 + lb] = '\0';
+    *km = w;
+    *a = nomes;
+    *b = nomes + la + 1;
+    *pos += sizeof(r) + r.tam;
+    return 1;
+}
+
+// log inteiro na memória; -1 se não existe ou não é um log
+static int wal_le(const char *caminho, CabecalhoWAL *h, unsigned char **dados, size_t *len) {
+    FILE *f = fopen(caminho, "rb");
+    if (f == NULL) return -1;
+    size_t cap = 0;
+    *dados = NULL;
+    *len = 0;
+    for (;;) {
+        GARANTE_CAP(*dados, cap, *len + 65536);
+        size_t lidos = fread(*dados + *len, 1, cap - *len, f);
+        *len += lidos;
+        if (lidos == 0) break;
+    }
+    fclose(f);
+    if (*len < sizeof(*h)) { free(*dados); return -1; }
+    memcpy(h, *dados, sizeof(*h));
+    if (memcmp(h->magic, WAL_MAGIC, sizeof(WAL_MAGIC)) != 0 || h->versao != WAL_VERSAO || h->bom != WAL_BOM) {
+        free(*dados);
+        return -1;
+    }
+    return 0;
+}
+
+// grava o log de novo (cabeçalho + corpo) num temporário e renomeia por cima
+static int wal_reescreve(const CabecalhoWAL *h, const unsigned char *corpo, size_t len) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", wal.caminho);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) return -1;
+    int ok = fwrite(h, sizeof(*h), 1, f) == 1 && (len == 0 || fwrite(corpo, 1, len, f) == len);
+    ok = ok && sincroniza_arquivo(f) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) { remove(tmp); return -1; }
+#ifdef _WIN32
+    remove(wal.caminho);
+#endif
+    if (rename(tmp, wal.caminho) != 0) { remove(tmp); return -1; }
+    return 0;
+}
+
+// abre o log que já está no disco pra continuar acrescentando; NULL se não dá
+static FILE *wal_reabre() {
+    FILE *f = fopen(wal.caminho, "r+b");
+    if (f != NULL && fseek(f, 0, SEEK_END) != 0) { fclose(f); f = NULL; }
+    return f;
+}
+
+static void wal_cabecalho_novo(CabecalhoWAL *h) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, WAL_MAGIC, sizeof(WAL_MAGIC));
+    h->versao = WAL_VERSAO;
+    h->bom = WAL_BOM;
+}
+
+/* Acrescenta no CSV (cortado antes em csv_base) as conexões do corpo do log.
+   Chamada com o cabeçalho já marcando a compactação. */
+static int wal_despeja_csv(const char *csv, uint64_t csv_base, const unsigned char *corpo, size_t len) {
+    FILE *c = fopen(csv, "r+b");
+    if (c == NULL) return -1;
+    int ok = trunca_arquivo(c, csv_base) == 0;
+    if (ok && csv_base > 0) {
+        // CSV sem '\n' no fim: a primeira conexão grudaria na última linha
+        ok = fseek(c, (long)csv_base - 1, SEEK_SET) == 0;
+        int ultimo = ok ? fgetc(c) : EOF;
+        ok = ok && fseek(c, 0, SEEK_END) == 0;
+        if (ok && ultimo != '\n') fputc('\n', c);
+    } else if (ok) {
+        ok = fseek(c, 0, SEEK_END) == 0;
+    }
+    size_t pos = 0;
+    int km;
+    char *a, *b;
+    while (ok && wal_proximo(corpo, len, &pos, &km, &a, &b)) {
+        csv_campo(c, a); fputc(',', c);
+        csv_campo(c, b);
+        fprintf(c, ",%d\n", km);
+    }
+    ok = ok && sincroniza_arquivo(c) == 0;
+    ok = (fclose(c) == 0) && ok;
+    return ok ? 0 : -1;
+}
+
+static int wal_grupo();
+
+// escreve o buffer no log; fsync conforme a política (ou sempre, se forca)
+static int wal_commit(int forca) {
+    if (wal.f == NULL) return wal.len == 0 ? 0 : -1;
+    METRICA_INICIO(MET_WAL_COMMIT);
+    if (wal.len > 0) {
+        if (fwrite(wal.buf, 1, wal.len, wal.f) != wal.len || fflush(wal.f) != 0) return -1;
+        wal.len = 0;
+        wal.sujo = 1;
+    }
+    if (!wal.sujo) return 0;
+    double t = agora_seg();
+    int sync = forca || politica_fsync == FSYNC_SEMPRE
+            || (politica_fsync == FSYNC_PERIODICO && (t - wal.ultimo_fsync) * 1000 >= WAL_FSYNC_MS);
+    if (sync && politica_fsync != FSYNC_NUNCA) {
+        if (sincroniza_arquivo(wal.f) != 0) return -1;
+        wal.ultimo_fsync = t;
+        wal.sujo = 0;
+    }
+    METRICA_FIM(MET_WAL_COMMIT);
+    return 0;
+}
+
+/* Passa as conexões do log pro CSV e zera o log. Retorna 0 se deu certo
+   (log vazio também); em erro o log continua valendo e aberto. */
+int wal_compacta() {
+    if (wal.f == NULL) return 0;
+    if (wal_commit(1) != 0) return -1;
+    if (wal.registros == 0) return 0;
+    METRICA_INICIO(MET_WAL_COMPACTA);
+    CabecalhoWAL h;
+    unsigned char *dados;
+    size_t len;
+    struct stat sb;
+    if (stat(wal.csv, &sb) != 0 || wal_le(wal.caminho, &h, &dados, &len) != 0) return -1;
+
+    // 1) marca no log onde o CSV termina hoje; se uma compactação anterior
+    //    falhou no meio, o CSV já pode ter parte do log e vale a marca dela
+    if (!h.compactando) {
+        h.compactando = 1;
+        h.csv_base = sb.st_size;
+    }
+    int ok = fseek(wal.f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, wal.f) == 1
+          && sincroniza_arquivo(wal.f) == 0;
+    // 2) acrescenta no CSV  3) log novo vazio
+    ok = ok && wal_despeja_csv(wal.csv, h.csv_base, dados + sizeof(h), len - sizeof(h)) == 0;
+    free(dados);
+    if (!ok) {
+        fseek(wal.f, 0, SEEK_END);  // o cabeçalho foi reescrito no começo
+        return -1;
+    }
+    fclose(wal.f);
+    wal.f = NULL;
+    wal_cabecalho_novo(&h);
+    int zerou = wal_reescreve(&h, NULL, 0) == 0;
+    wal.f = wal_reabre();  // sem zerar, continua o log antigo (marcado)
+    if (!zerou || wal.f == NULL) return -1;
+    wal.registros = 0;
+    wal.sujo = 0;
+    METRICA_FIM(MET_WAL_COMPACTA);
+    return 0;
+}
+
+/* Antes de carregar o grafo: termina uma compactação interrompida (o CSV
+   ainda pode ter metade das conexões acrescentadas). Depois de carregar,
+   wal_reaplica() põe no grafo as conexões que ficaram no log. O arquivo do
+   log só é criado na primeira conexão nova. */
+int wal_abre(const char *csv) {
+    struct stat sb;
+    if (stat(csv, &sb) != 0 || !S_ISREG(sb.st_mode)) return -1;  // pipe/FIFO: sem log
+    wal.csv = csv;
+    wal_caminho(csv, wal.caminho, sizeof(wal.caminho));
+    wal.ultimo_fsync = agora_seg();
+    if (stat(wal.caminho, &sb) != 0) return 0;
+
+    CabecalhoWAL h;
+    unsigned char *dados;
+    size_t len;
+    if (wal_le(wal.caminho, &h, &dados, &len) != 0) {
+        fprintf(stderr, "Aviso: '%s' nao e um log de conexoes valido; comecando outro\n", wal.caminho);
+        wal_cabecalho_novo(&h);
+        if (wal_reescreve(&h, NULL, 0) != 0) return -1;
+    } else {
+        if (h.compactando) {
+            fprintf(stderr, "Compactacao do log interrompida; refazendo em '%s'\n", csv);
+            int ok = wal_despeja_csv(csv, h.csv_base, dados + sizeof(h), len - sizeof(h)) == 0;
+            wal_cabecalho_novo(&h);
+            ok = ok && wal_reescreve(&h, NULL, 0) == 0;
+            if (!ok) { free(dados); return -1; }
+        }
+        free(dados);
+    }
+    wal.f = fopen(wal.caminho, "r+b");
+    return wal.f != NULL ? 0 : -1;
+}
+
+// reaplica as conexões do log no grafo; corta um registro incompleto no fim
+long wal_reaplica() {
+    if (wal.f == NULL) return 0;
+    CabecalhoWAL h;
+    unsigned char *dados;
+    size_t len;
+    if (wal_le(wal.caminho, &h, &dados, &len) != 0) return 0;
+    size_t pos = sizeof(h);
+    int km;
+    char *a, *b;
+    long n = 0;
+    while (wal_proximo(dados, len, &pos, &km, &a, &b)) {
+        int id1 = city_index(a);
+        int id2 = city_index(b);
+        add_edge(id1, id2, km);
+        n++;
+    }
+    grafo_congela_se_preciso();
+    if (pos < len) {
+        fprintf(stderr, "Aviso: %zu byte(s) incompleto(s) no fim de '%s' descartado(s)\n", len - pos, wal.caminho);
+        if (trunca_arquivo(wal.f, pos) != 0 || sincroniza_arquivo(wal.f) != 0) {
+            // registro novo depois do lixo seria descartado na próxima partida
+            fprintf(stderr, "Aviso: nao foi possivel cortar '%s'; conexoes novas ficam so na memoria\n", wal.caminho);
+            fclose(wal.f);
+            wal.f = NULL;
+            wal.csv = NULL;
+        }
+    }
+    free(dados);
+    if (wal.f != NULL) fseek(wal.f, 0, SEEK_END);
+    wal.registros = n;
+    return n;
+}
+
+#ifndef _WIN32
+/* --fsync=periodico: dorme até a primeira conexão sem fsync completar
+   WAL_FSYNC_MS e aí faz o commit com fsync do que estiver pendente */
+static void *wal_sincronizador(void *arg) {
+    (void)arg;
+    WAL_TRAVA();
+    for (;;) {
+        if (wal.f == NULL || (!wal.sujo && wal.len == 0)) {
+            pthread_cond_wait(&wal_pendente, &wal_trava);
+            continue;
+        }
+        double falta = wal.pendente_desde + WAL_FSYNC_MS / 1000.0 - agora_seg();
+        if (falta > 0) {
+            struct timespec ate;
+            clock_gettime(CLOCK_REALTIME, &ate);
+            long ns = ate.tv_nsec + (long)((falta - (long)falta) * 1e9);
+            ate.tv_sec += (time_t)falta + ns / 1000000000L;
+            ate.tv_nsec = ns % 1000000000L;
+            pthread_cond_timedwait(&wal_pendente, &wal_trava, &ate);
+            continue;
+        }
+        // em erro tenta de novo depois de mais um intervalo
+        if (wal_commit(1) != 0) wal.pendente_desde = agora_seg();
+    }
+    return NULL;
+}
+
+static void wal_sincronizador_garante() {
+    if (wal_sincronizador_ativo || politica_fsync != FSYNC_PERIODICO) return;
+    pthread_t id;
+    if (pthread_create(&id, NULL, wal_sincronizador, NULL) != 0) return;  // fica só o fsync no commit
+    pthread_detach(id);
+    wal_sincronizador_ativo = 1;
+}
+#endif
+
+/* Registra uma conexão nova. Com --fsync=sempre já faz o commit; senão fica
+   no buffer até wal_commit() ou até juntar WAL_GRUPO_BYTES. */
+static int wal_anexa_sem_trava(int id1, int id2, int km) {
+    if (wal.csv == NULL) return -1;
+    if (wal.f == NULL) {
+        // log novo só se não há nenhum no disco: um que ficou lá ainda guarda conexões
+        struct stat sb;
+        if (stat(wal.caminho, &sb) != 0) {
+            CabecalhoWAL h;
+            wal_cabecalho_novo(&h);
+            if (wal_reescreve(&h, NULL, 0) != 0) return -1;
+        }
+        if ((wal.f = wal_reabre()) == NULL) return -1;
+    }
+    const char *a = city_name(id1), *b = city_name(id2);
+    size_t la = strlen(a), lb = strlen(b);
+    if (la > UINT16_MAX || lb > UINT16_MAX) return -1;
+    CabecalhoRegistroWAL r;
+    r.tam = 8 + la + lb;
+    GARANTE_CAP(wal.buf, wal.cap, wal.len + sizeof(r) + r.tam);
+    unsigned char *c = wal.buf + wal.len + sizeof(r);
+    int32_t w = km;
+    uint16_t la16 = la, lb16 = lb;
+    memcpy(c, &w, 4); memcpy(c + 4, &la16, 2); memcpy(c + 6, &lb16, 2);
+    memcpy(c + 8, a, la); memcpy(c + 8 + la, b, lb);
+    r.verif = (uint32_t)checksum_bytes(c, r.tam);
+    memcpy(wal.buf + wal.len, &r, sizeof(r));
+    if (wal.len == 0 && !wal.sujo) wal.pendente_desde = agora_seg();
+    wal.len += sizeof(r) + r.tam;
+    wal.registros++;
+#ifndef _WIN32
+    wal_sincronizador_garante();
+    pthread_cond_signal(&wal_pendente);
+#endif
+    if (politica_fsync == FSYNC_SEMPRE || wal.len >= WAL_GRUPO_BYTES) return wal_grupo();
+    return 0;
+}
+
+int wal_anexa(int id1, int id2, int km) {
+    WAL_TRAVA();
+    int r = wal_anexa_sem_trava(id1, id2, km);
+    WAL_SOLTA();
+    return r;
+}
+
+// commit do grupo e compactação quando o log cresceu demais
+static int wal_grupo() {
+    if (wal_commit(0) != 0) return -1;
+    if (wal.registros >= WAL_COMPACTA && wal_compacta() != 0)
+        fprintf(stderr, "Aviso: falha ao compactar '%s'; conexoes continuam no log\n", wal.caminho);
+    return 0;
+}
+
+int wal_fim_de_grupo() {
+    WAL_TRAVA();
+    int r = wal_grupo();
+    WAL_SOLTA();
+    return r;
+}
+
+// saída normal (e partida, depois de reaplicar): conexões pro CSV e o log
+// (vazio) sai do disco. Se a compactação falha o log fica aberto como está,
+// e conexões novas continuam entrando nele
+void wal_fecha() {
+    WAL_TRAVA();
+    if (wal.f == NULL) {
+        WAL_SOLTA();
+        return;
+    }
+    if (wal_compacta() != 0) {
+        fprintf(stderr, "Aviso: falha ao compactar '%s'; conexoes continuam no log\n", wal.caminho);
+        wal_commit(1);
+    } else {
+        fclose(wal.f);
+        wal.f = NULL;
+        remove(wal.caminho);
+    }
+    WAL_SOLTA();
+}
+
+// já existe conexão a-b com esse mesmo km?
+static int aresta_existe(int a, int b, int w) {
+    int v, wv;
+    VizinhoIter viz;
+    int menor = grau(a) <= grau(b) || grafo_direcionado ? a : b;
+    viz_inicio(menor, &viz);
+    int outro = menor == a ? b : a;
+    while (viz_proximo(&viz, &v, &wv)) if (v == outro && wv == w) return 1;
+    return 0;
+}
+
+/* --- buffers das consultas --- */
+
+// memória usada pelos menus, alocada no heap uma vez e reaproveitada entre
+// consultas (cresce junto com o número de cidades)
+typedef struct {
+    int *caminho_a, *caminho_b;
+    int cap;
+} ScratchConsulta;
+
+static ScratchConsulta consulta;
+
+static void consulta_garante(int n) {
+    if (n <= consulta.cap) return;
+    int cap = consulta.cap ? consulta.cap : 64;
+    while (cap < n) cap *= 2;
+    consulta.caminho_a = xrealloc(consulta.caminho_a, cap * sizeof(int));
+    consulta.caminho_b = xrealloc(consulta.caminho_b, cap * sizeof(int));
+    consulta.cap = cap;
+}
+
+/* --- menus simples --- */
+
+void menu_listar_cidades() {
+    printf("\n--- Cidades Cadastradas (%d) ---\n", city_count);
+    for (int i = 0; i < city_count; i++) {
+        printf("%d. %s\n", i + 1, city_name(i));
+    }
+    printf("---------------------------------\n");
+}
+
+// lista direto do ranking de graus, faixa por faixa a partir do grau 0
+void menu_contar_conexoes() {
+    ranking_garante();
+    printf("\n--- Numero de Conexoes por Cidade (Ordem Crescente) ---\n");
+    for (int g = 0; g <= ranking.grau_max; ++g)
+        for (int i = ranking.lim[g + 1]; i < ranking.lim[g]; ++i)
+            printf("%s: %d conexoes\n", city_name(ranking.ordem[i]), g);
+    printf("-------------------------------------------------------\n");
+}
+
+/* Lê cidade do usuário com fuzzy match */
+int ler_cidade_input(char *prompt) {
+    char *input;
+    int idx = -1;
+    do {
+        printf("%s", prompt);
+        if ((input = ler_linha(stdin)) == NULL) return -1;
+        CandidatoNome cand[FUZZY_TOPK];
+        int n = fuzzy_candidatos(input, cand, FUZZY_TOPK);
+        idx = n > 0 ? cand[0].city_id : -1;
+        if (idx == -1) printf("Cidade '%s' nao encontrada ou ambigua. Tente novamente.\n", input);
+        else printf("-> Selecionado: %s\n", city_name(idx));
+        // nome aproximado: mostro as outras opções parecidas
+        if (n > 1 && cand[0].distancia > 0) {
+            printf("   (parecidas:");
+            for (int i = 1; i < n; ++i) printf("%s %s", i > 1 ? "," : "", city_name(cand[i].city_id));
+            printf(")\n");
+        }
+    } while (idx == -1);
+    return idx;
+}
+
+/* Mostra conexões de uma cidade, ordenadas por distância */
+void menu_conexoes_ordenadas() {
+    int cidade_idx = ler_cidade_input("\nDigite o nome da cidade para ver vizinhos: ");
+    if (cidade_idx == -1) return;
+
+    if (grau(cidade_idx) == 0) {
+        printf("Esta cidade nao possui conexoes diretas.\n");
+        return;
+    }
+
+    // as listas já estão em ordem de distância
+    printf("\nConexoes de %s (por distancia):\n", city_name(cidade_idx));
+    int i = 0, v, w;
+    VizinhoIter viz;
+    viz_inicio(cidade_idx, &viz);
+    while (viz_ordenado_proximo(&viz, &v, &w)) printf("%d. %s (%d km)\n", ++i, city_name(v), w);
+}
+
+/* --- reconstrução de caminho --- */
+
+// reconstrói caminho usando array prev (retorna tamanho; ordem from->to)
+int reconstruct_path(int prev[], int from, int to, int caminho[]) {
+    int tam = 0;
+    int cur = to;
+    while (cur != -1) {
+        caminho[tam++] = cur;
+        if (cur == from) break;
+        cur = prev[cur];
+    }
+    if (tam == 0 || caminho[tam-1] != from) return 0;
+    for (int i = 0; i < tam/2; ++i) {
+        int tmp = caminho[i];
+        caminho[i] = caminho[tam-1-i];
+        caminho[tam-1-i] = tmp;
+    }
+    return tam;
+}
+
+/* --- sugestão de ligação entre componentes --- */
+
+/* Par de cidades mais próximas geograficamente entre duas componentes (só
+   entram cidades com coordenada). Os pontos vão pra projeção equirretangular
+   em km; os da componente maior são distribuídos numa grade uniforme (células
+   em CSR, ~1 ponto por célula) e cada ponto da menor procura em anéis de
+   células a partir da sua, parando quando o anel já está mais longe que o
+   melhor par achado. O par escolhido é reportado com a distância haversine.
+   Devolve u = -1 quando alguma das componentes não tem coordenada. */
+typedef struct {
+    int u, v;   // u na componente a, v na componente b
+    double km;
+    int geo;    // 0 = centros das componentes, sem km
+} Ligacao;
+
+static Ligacao liga_componentes(int ca, int cb) {
+    Ligacao lig = { -1, -1, 0, 1 };
+    int *membros = xrealloc(NULL, city_count * sizeof(int));
+    int na = 0, nb = city_count;
+    for (int v = 0; v < city_count; ++v) {
+        if (isnan(city_coords[v].lat)) continue;
+        int c = componente_de(v);
+        if (c == ca) membros[na++] = v;
+        else if (c == cb) membros[--nb] = v;
+    }
+    int *a = membros, *b = membros + nb;
+    nb = city_count - nb;
+    if (na == 0 || nb == 0) { free(membros); return lig; }
+    int troca = na > nb;  // a grade fica com a maior
+    if (troca) { int *t = a; a = b; b = t; int n = na; na = nb; nb = n; }
+
+    const double rad = 3.14159265358979323846 / 180.0;
+    double lat_ref = 0;
+    for (int i = 0; i < nb; ++i) lat_ref += city_coords[b[i]].lat;
+    double kx = cos(lat_ref / nb * rad) * 111.32, ky = 110.574;
+    double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+    for (int i = 0; i < nb; ++i) {
+        double x = city_coords[b[i]].lon * kx, y = city_coords[b[i]].lat * ky;
+        if (x < x0) x0 = x;
+        if (x > x1) x1 = x;
+        if (y < y0) y0 = y;
+        if (y > y1) y1 = y;
+    }
+    double larg = x1 - x0, alt = y1 - y0;
+    double lado = sqrt(larg * alt / nb);
+    if (lado < (larg > alt ? larg : alt) / nb) lado = (larg > alt ? larg : alt) / nb;
+    if (lado < 1e-3) lado = 1e-3;
+    int nx = (int)(larg / lado) + 1, ny = (int)(alt / lado) + 1;
+
+    int *inicio = xrealloc(NULL, ((size_t)nx * ny + 1) * sizeof(int));
+    int *celula = xrealloc(NULL, nb * sizeof(int));
+    int *pontos = xrealloc(NULL, nb * sizeof(int));
+    memset(inicio, 0, ((size_t)nx * ny + 1) * sizeof(int));
+    for (int i = 0; i < nb; ++i) {
+        int cx = (int)((city_coords[b[i]].lon * kx - x0) / lado);
+        int cy = (int)((city_coords[b[i]].lat * ky - y0) / lado);
+        if (cx >= nx) cx = nx - 1;
+        if (cy >= ny) cy = ny - 1;
+        celula[i] = cy * nx + cx;
+        inicio[celula[i] + 1]++;
+    }
+    for (int c = 0; c < nx * ny; ++c) inicio[c + 1] += inicio[c];
+    for (int i = 0; i < nb; ++i) pontos[inicio[celula[i]]++] = b[i];
+    for (int c = nx * ny; c > 0; --c) inicio[c] = inicio[c - 1];
+    inicio[0] = 0;
+
+    double melhor = INFINITY;
+    int mu = -1, mv = -1;
+    for (int i = 0; i < na; ++i) {
+        double x = city_coords[a[i]].lon * kx, y = city_coords[a[i]].lat * ky;
+        int cx = (int)floor((x - x0) / lado), cy = (int)floor((y - y0) / lado);
+        // anéis que cruzam a grade: do mais perto ao mais longe
+        int rmin = 0, rmax = 0, d;
+        if ((d = -cx) > rmin) rmin = d;
+        if ((d = cx - (nx - 1)) > rmin) rmin = d;
+        if ((d = -cy) > rmin) rmin = d;
+        if ((d = cy - (ny - 1)) > rmin) rmin = d;
+        if ((d = abs(cx)) > rmax) rmax = d;
+        if ((d = abs(cx - (nx - 1))) > rmax) rmax = d;
+        if ((d = abs(cy)) > rmax) rmax = d;
+        if ((d = abs(cy - (ny - 1))) > rmax) rmax = d;
+        for (int r = rmin; r <= rmax; ++r) {
+            if ((r - 1) * lado > melhor) break;  // todo ponto do anel r está a >= (r-1)*lado
+            for (int gy = cy - r; gy <= cy + r; ++gy) {
+                if (gy < 0 || gy >= ny) continue;
+                int borda = gy == cy - r || gy == cy + r;
+                int passo = borda || r == 0 ? 1 : 2 * r;
+                for (int gx = cx - r; gx <= cx + r; gx += passo) {
+                    if (gx < 0 || gx >= nx) continue;
+                    int c = gy * nx + gx;
+                    for (int k = inicio[c]; k < inicio[c + 1]; ++k) {
+                        int v = pontos[k];
+                        double dx = city_coords[v].lon * kx - x, dy = city_coords[v].lat * ky - y;
+                        double dist = sqrt(dx * dx + dy * dy);
+                        if (dist < melhor) { melhor = dist; mu = a[i]; mv = v; }
+                    }
+                }
+            }
+        }
+    }
+    free(inicio); free(celula); free(pontos); free(membros);
+
+    if (troca) { int t = mu; mu = mv; mv = t; }
+    lig.u = mu;
+    lig.v = mv;
+    lig.km = haversine_km(city_coords[mu], city_coords[mv]);
+    return lig;
+}
+
+/* Sem coordenadas: a ligação sai do centro de cada componente. Três
+   Dijkstras com várias fontes (uma por componente; como as componentes não
+   se tocam, uma busca serve pra todas) acham em cada componente a cidade a
+   mais longe de uma qualquer, a cidade b mais longe de a, e as distâncias de
+   a e de b a todas as outras. max(dist_a(u), dist_b(u)) estima a
+   excentricidade de u (exata numa árvore) e o centro é quem tem a menor:
+   a cidade de onde o resto da componente fica mais perto. Guardo o centro e
+   o segundo colocado de cada componente, refeitos quando grafo_versao muda:
+   O((V + E) log V) uma vez e O(1) por consulta. Se os centros forem a
+   própria origem e o próprio destino, o lado que perde menos passa pro
+   segundo colocado, pra não sugerir ligar as duas pontas (a não ser que as
+   duas componentes sejam de uma cidade só). As buscas ignoram o sentido das
+   conexões, como as componentes (no modo direcionado o trecho até o centro
+   pode faltar). Empate: mais conexões, depois menor id. */
+static struct {
+    int *dist[2];        // dist[0] = de a, dist[1] = de b (da componente de cada cidade)
+    int *ponta;          // por raiz da componente: fonte da busca da vez
+    int *centro, *vice;  // por raiz da componente; vice = -1 se é uma cidade só
+    unsigned char *fechado;
+    HeapBinario heap;
+    unsigned long versao;
+    int cap, valido;
+} centros;
+
+static inline int centro_exc(int u) {
+    return centros.dist[0][u] > centros.dist[1][u] ? centros.dist[0][u] : centros.dist[1][u];
+}
+
+// u fica mais no centro que x
+static int centro_antes(int u, int x) {
+    if (x == -1) return 1;
+    int eu = centro_exc(u), ex = centro_exc(x);
+    if (eu != ex) return eu < ex;
+    if (grau(u) != grau(x)) return grau(u) > grau(x);
+    return u < x;
+}
+
+// Dijkstra sem sentido a partir de ponta[raiz] de cada componente; depois
+// ponta[raiz] vira a cidade mais longe dela
+static void centros_varre(int *dist) {
+    for (int u = 0; u < city_count; ++u) { dist[u] = INT_MAX; centros.fechado[u] = 0; }
+    for (int u = 0; u < city_count; ++u) {
+        if (componente_de(u) != u) continue;
+        dist[centros.ponta[u]] = 0;
+        heap_insere_ou_diminui(&centros.heap, dist, centros.ponta[u]);
+    }
+    while (centros.heap.size > 0) {
+        int u = heap_remove_min(&centros.heap, dist);
+        centros.fechado[u] = 1;  // com peso negativo não volta pra fila
+        for (int lado = 0; lado < (grafo_direcionado ? 2 : 1); ++lado) {
+            int v, w;
+            VizinhoIter viz;
+            if (lado) viz_entrada_inicio(u, &viz); else viz_inicio(u, &viz);
+            while (lado ? viz_entrada_proximo(&viz, &v, &w) : viz_proximo(&viz, &v, &w)) {
+                if (!centros.fechado[v] && dist[u] + w < dist[v]) {
+                    dist[v] = dist[u] + w;
+                    heap_insere_ou_diminui(&centros.heap, dist, v);
+                }
+            }
+        }
+    }
+    for (int u = 0; u < city_count; ++u) {
+        int *p = &centros.ponta[componente_de(u)];
+        if (dist[u] > dist[*p] || (dist[u] == dist[*p] && u < *p)) *p = u;
+    }
+}
+
+static void centros_atualiza() {
+    if (centros.valido && centros.versao == grafo_versao && centros.cap >= city_count) return;
+    if (centros.cap < city_count) {
+        int n = city_count;
+        for (int k = 0; k < 2; ++k) centros.dist[k] = xrealloc(centros.dist[k], n * sizeof(int));
+        centros.ponta = xrealloc(centros.ponta, n * sizeof(int));
+        centros.centro = xrealloc(centros.centro, n * sizeof(int));
+        centros.vice = xrealloc(centros.vice, n * sizeof(int));
+        centros.fechado = xrealloc(centros.fechado, n);
+        centros.heap.heap = xrealloc(centros.heap.heap, n * sizeof(int));
+        centros.heap.pos = xrealloc(centros.heap.pos, n * sizeof(int));
+        for (int i = 0; i < n; ++i) centros.heap.pos[i] = -1;
+        centros.cap = n;
+    }
+    for (int u = 0; u < city_count; ++u) if (componente_de(u) == u) centros.ponta[u] = u;
+    centros_varre(centros.dist[1]);  // ponta = a
+    centros_varre(centros.dist[0]);  // distâncias de a; ponta = b
+    centros_varre(centros.dist[1]);  // distâncias de b
+    for (int u = 0; u < city_count; ++u) if (componente_de(u) == u) centros.centro[u] = centros.vice[u] = -1;
+    for (int u = 0; u < city_count; ++u) {
+        int r = componente_de(u);
+        if (centro_antes(u, centros.centro[r])) { centros.vice[r] = centros.centro[r]; centros.centro[r] = u; }
+        else if (centro_antes(u, centros.vice[r])) centros.vice[r] = u;
+    }
+    centros.versao = grafo_versao;
+    centros.valido = 1;
+}
+
+static Ligacao liga_por_centros(int origem, int destino) {
+    centros_atualiza();
+    int ca = componente_de(origem), cb = componente_de(destino);
+    Ligacao lig = { centros.centro[ca], centros.centro[cb], 0, 0 };
+    if (lig.u == origem && lig.v == destino) {
+        int va = centros.vice[ca], vb = centros.vice[cb];
+        // o lado cujo segundo colocado fica menos longe do resto cede
+        if (va != -1 && (vb == -1 || centro_exc(va) - centro_exc(origem) <= centro_exc(vb) - centro_exc(destino)))
+            lig.u = va;
+        else if (vb != -1) lig.v = vb;
+    }
+    return lig;
+}
+
+/* --- análise da malha --- */
+
+/* Componentes, pontos de articulação (cidade cuja remoção separa a malha),
+   pontes (trecho cuja remoção separa a malha) e histograma de graus, tudo
+   numa passada de Tarjan em O(V + E). A busca em profundidade usa pilha
+   explícita no heap, então uma estrada em cadeia com milhões de cidades não
+   estoura a pilha do programa. Conexões repetidas entre o mesmo par não são
+   ponte: só a primeira aresta de volta pro pai é ignorada. No modo
+   direcionado a busca anda pelas arestas de saída e de entrada (malha sem
+   sentido) e o grau é o de saída. O resultado fica guardado até o grafo
+   mudar (grafo_versao). No servidor cada trabalhador calcula no seu
+   AnaliseMalha, só lendo o grafo. */
+typedef struct {
+    int n;                 // cidades analisadas
+    int componentes;
+    int maior;             // cidades na maior componente
+    int isoladas;          // cidades sem conexão
+    int *comp;             // componente de cada cidade, 0..componentes-1
+    int *articulacoes;     // cidades de articulação, em ordem de id
+    int n_articulacoes;
+    int *pontes;           // pares (u, v), u < v
+    int n_pontes, cap_pontes;
+    int *graus;            // graus[g] = cidades com g conexões, g = 0..grau_max
+    int grau_max;
+    int arestas;
+    unsigned long versao;
+    int valida;
+} AnaliseMalha;
+
+static AnaliseMalha analise = {0};
+
+typedef struct {
+    int u, pai;
+    int pulou_pai;  // já ignorou a aresta de volta pro pai
+    int entrada;    // já passou pras arestas de entrada (modo direcionado)
+    VizinhoIter it;
+} QuadroDFS;
+
+static void quadro_inicio(QuadroDFS *q, int u, int pai) {
+    q->u = u; q->pai = pai; q->pulou_pai = 0; q->entrada = 0;
+    viz_inicio(u, &q->it);
+}
+
+static int quadro_proximo(QuadroDFS *q, int *v, int *w) {
+    if (!q->entrada) {
+        if (viz_proximo(&q->it, v, w)) return 1;
+        if (!grafo_direcionado) return 0;
+        q->entrada = 1;
+        viz_entrada_inicio(q->u, &q->it);
+    }
+    return viz_entrada_proximo(&q->it, v, w);
+}
+
+static void analise_calcula_em(AnaliseMalha *a) {
+    if (a->valida && a->versao == grafo_versao && a->n == city_count) return;
+    METRICA_INICIO(MET_ANALISE);
+    int n = city_count;
+    int *ordem = xrealloc(NULL, n * sizeof(int));  // tempo de descoberta; 0 = não visitada
+    int *baixo = xrealloc(NULL, n * sizeof(int));
+    unsigned char *corte = xrealloc(NULL, n);
+    int *tam = xrealloc(NULL, n * sizeof(int));    // tamanho de cada componente
+    QuadroDFS *pilha = xrealloc(NULL, n * sizeof(QuadroDFS));
+    a->comp = xrealloc(a->comp, n * sizeof(int));
+    memset(ordem, 0, n * sizeof(int));
+    memset(corte, 0, n);
+    a->componentes = 0;
+    a->n_pontes = 0;
+
+    int tempo = 0;
+    for (int r = 0; r < n; ++r) {
+        if (ordem[r]) continue;
+        int c = a->componentes++;
+        int filhos_raiz = 0, topo = 0;
+        tam[c] = 1;
+        ordem[r] = baixo[r] = ++tempo;
+        a->comp[r] = c;
+        quadro_inicio(&pilha[topo++], r, -1);
+        while (topo > 0) {
+            QuadroDFS *q = &pilha[topo - 1];
+            int u = q->u, v, w;
+            if (quadro_proximo(q, &v, &w)) {
+                if (v == q->pai && !q->pulou_pai) { q->pulou_pai = 1; continue; }
+                if (ordem[v]) {
+                    if (ordem[v] < baixo[u]) baixo[u] = ordem[v];
+                    continue;
+                }
+                ordem[v] = baixo[v] = ++tempo;
+                a->comp[v] = c;
+                tam[c]++;
+                quadro_inicio(&pilha[topo++], v, u);
+                continue;
+            }
+            // u terminou: propaga o low pro pai e testa a aresta pai-u
+            if (--topo == 0) break;
+            int p = pilha[topo - 1].u;
+            if (baixo[u] < baixo[p]) baixo[p] = baixo[u];
+            if (baixo[u] > ordem[p]) {
+                GARANTE_CAP(a->pontes, a->cap_pontes, 2 * (a->n_pontes + 1));
+                a->pontes[2 * a->n_pontes] = p < u ? p : u;
+                a->pontes[2 * a->n_pontes + 1] = p < u ? u : p;
+                a->n_pontes++;
+            }
+            if (p == r) filhos_raiz++;
+            else if (baixo[u] >= ordem[p]) corte[p] = 1;
+        }
+        if (filhos_raiz >= 2) corte[r] = 1;
+    }
+
+    a->maior = 0;
+    a->isoladas = 0;  // grau 0 não serve no modo direcionado (só conta as que saem)
+    for (int c = 0; c < a->componentes; ++c) {
+        if (tam[c] > a->maior) a->maior = tam[c];
+        if (tam[c] == 1) a->isoladas++;
+    }
+    a->articulacoes = xrealloc(a->articulacoes, n * sizeof(int));
+    a->n_articulacoes = 0;
+    a->grau_max = 0;
+    a->arestas = 0;
+    for (int u = 0; u < n; ++u) {
+        if (corte[u]) a->articulacoes[a->n_articulacoes++] = u;
+        int g = grau(u);
+        if (g > a->grau_max) a->grau_max = g;
+        a->arestas += g;
+    }
+    if (!grafo_direcionado) a->arestas /= 2;
+    a->graus = xrealloc(a->graus, (a->grau_max + 1) * sizeof(int));
+    memset(a->graus, 0, (a->grau_max + 1) * sizeof(int));
+    for (int u = 0; u < n; ++u) a->graus[grau(u)]++;
+
+    free(ordem); free(baixo); free(corte); free(tam); free(pilha);
+    a->n = n;
+    a->versao = grafo_versao;
+    a->valida = 1;
+    METRICA_FIM(MET_ANALISE);
+}
+
+static void analise_calcula() {
+    analise_calcula_em(&analise);
+}
+
+// trecho origem -> destino dentro de uma componente (cidade só quando iguais)
+static int trecho_parcial(int origem, int destino, int caminho[]) {
+    if (origem == destino) { caminho[0] = origem; return 1; }
+    return rota_ponto_a_ponto(origem, destino, caminho).tam;
+}
+
+/* Opção 4: calcula distância/trajeto; sugere rota parcial se componentes diferentes */
+void menu_distancia_entre_cidades() {
+    printf("\n--- Calcular Distancia e Trajeto ---\n");
+    int origem = ler_cidade_input("Cidade de Origem: ");
+    int destino = ler_cidade_input("Cidade de Destino: ");
+    if (origem == -1 || destino == -1) return;
+
+    if (origem == destino) {
+        printf("Distancia: 0 km (mesma cidade).\n");
+        return;
+    }
+
+    consulta_garante(city_count);
+    int comp_origem = componente_de(origem), comp_destino = componente_de(destino);
+    if (comp_origem == comp_destino) {
+        ResultadoRota r = rota_ponto_a_ponto(origem, destino, consulta.caminho_a);
+        if (r.dist == INT_MAX) {
+            // só acontece no modo direcionado: ligadas, mas sem caminho nesse sentido
+            printf("\nNao ha caminho de %s para %s respeitando o sentido das conexoes.\n",
+                   city_name(origem), city_name(destino));
+            return;
+        }
+        printf("\nMenor distancia entre %s e %s: %d km\n", city_name(origem), city_name(destino), r.dist);
+        printf("Trajeto a ser percorrido: ");
+        for (int i = 0; i < r.tam; i++) {
+            printf("%s", city_name(consulta.caminho_a[i]));
+            if (i < r.tam - 1) printf(" -> ");
+        }
+        printf("\n");
+        if (r.do_cache) printf("(resposta do cache de rotas)\n");
+        else printf("(busca '%s': %ld cidades examinadas, %ld arestas relaxadas)\n",
+                    rota_nomes[r.motor], r.fechados, r.relaxadas);
+        if (r.motor != rota_motor && rota_motor == ROTA_CH)
+            printf("(hierarquia de contracao desatualizada por conexao nova; refeita ao reiniciar)\n");
+        return;
+    }
+
+    // componentes diferentes: ligo o par mais próximo no mapa; sem coordenada
+    // em algum dos lados, os centros das duas componentes
+    Ligacao lig = liga_componentes(comp_origem, comp_destino);
+    if (lig.u == -1) lig = liga_por_centros(origem, destino);
+
+    int *caminho_a = consulta.caminho_a, *caminho_b = consulta.caminho_b;
+    int tam_a = trecho_parcial(origem, lig.u, caminho_a);
+    int tam_b = trecho_parcial(lig.v, destino, caminho_b);
+
+    // exibo sugestão parcial e aviso que falta ligação entre u e v
+    printf("\nNao existe caminho completo registrado entre %s e %s.\n", city_name(origem), city_name(destino));
+    if (tam_a > 0 && tam_b > 0) {
+        printf("Sugestao parcial (componentes distintos):\n");
+        for (int i = 0; i < tam_a; ++i) {
+            printf("%s", city_name(caminho_a[i]));
+            if (i < tam_a - 1) printf(" -> ");
+        }
+        printf("\nFALTA LIGACAO ENTRE '%s' E '%s'", city_name(lig.u), city_name(lig.v));
+        if (lig.geo) printf(" (%.0f km em linha reta)", lig.km);
+        else printf(" (sem coordenadas: centros das duas componentes)");
+        printf("\nPara completar o trajeto, seria necessario ligar essas duas cidades.\n");
+        for (int i = 0; i < tam_b; ++i) {
+            if (i == 0) printf("%s", city_name(caminho_b[i]));
+            else printf(" -> %s", city_name(caminho_b[i]));
+        }
+        printf("\n");
+    } else {
+        printf("Nao foi possivel sugerir uma rota parcial entre as componentes.\n");
+    }
+}
+
+/* Opção 8: rotas alternativas (as k mais curtas sem repetir cidade) */
+void menu_rotas_alternativas() {
+    printf("\n--- Rotas Alternativas ---\n");
+    int origem = ler_cidade_input("Cidade de Origem: ");
+    int destino = ler_cidade_input("Cidade de Destino: ");
+    if (origem == -1 || destino == -1) return;
+
+    int k = ALTERNATIVAS_PADRAO;
+    char *buffer;
+    printf("Quantas rotas (1 a %d, ENTER = %d): ", ALTERNATIVAS_MAX, ALTERNATIVAS_PADRAO);
+    if ((buffer = ler_linha(stdin)) == NULL) return;
+    if (buffer[0] != '\0' && (!parse_int(buffer, strlen(buffer), &k) || k < 1 || k > ALTERNATIVAS_MAX)) {
+        printf("Erro: quantidade invalida.\n");
+        return;
+    }
+
+    AlternativasScratch *s = &alternativas_scratch_padrao;
+    int n = rotas_alternativas(origem, destino, k);
+    if (n < 0) {
+        printf("Rotas alternativas exigem distancias nao negativas.\n");
+        return;
+    }
+    if (n == 0) {
+        printf("\nNao ha caminho de %s para %s.\n", city_name(origem), city_name(destino));
+        return;
+    }
+    printf("\n%d rota(s) de %s para %s:\n", n, city_name(origem), city_name(destino));
+    for (int r = 0; r < n; ++r) {
+        const RotaAlternativa *a = &s->aceitas[r];
+        printf("\n%d) %d km", r + 1, a->dist);
+        if (r > 0) printf(" (+%d km)", a->dist - s->aceitas[0].dist);
+        printf(": ");
+        for (int i = 0; i < a->tam; i++) {
+            printf("%s", city_name(a->cidades[i]));
+            if (i < a->tam - 1) printf(" -> ");
+        }
+        printf("\n");
+    }
+    if (n < k) printf("\n(so existem %d rota(s) sem repetir cidade)\n", n);
+    printf("(%ld desvios por busca, %ld pela arvore ate o destino; %ld cidades examinadas)\n",
+           s->desvios, s->pela_arvore, s->fechados);
+}
+
+/* cria nova conexão (menu 5) e persiste no CSV */
+void menu_nova_conexao() {
+    char *buffer;
+    printf("\n--- Criar Nova Conexao e Salvar ---\n");
+
+    printf("Nome da primeira cidade: ");
+    if ((buffer = ler_linha(stdin)) == NULL) return;
+    int id1 = city_index(buffer);
+
+    printf("Nome da segunda cidade: ");
+    if ((buffer = ler_linha(stdin)) == NULL) return;
+    int id2 = city_index(buffer);
+
+    if (id1 == id2) {
+        printf("Erro: As cidades devem ser diferentes.\n");
+        return;
+    }
+
+    int dist;
+    printf("Distancia (km): ");
+    if (scanf("%d", &dist) != 1) {
+        descarta_linha();
+        printf("Erro: distancia invalida.\n");
+        return;
+    }
+    descarta_linha();
+
+    if (aresta_existe(id1, id2, dist)) {
+        printf("Conexao %s <--> %s (%d km) ja existe.\n", city_name(id1), city_name(id2), dist);
+        return;
+    }
+
+    add_edge(id1, id2, dist);
+    grafo_congela_se_preciso();
+
+    if (wal_anexa(id1, id2, dist) != 0 || wal_fim_de_grupo() != 0) {
+        printf("ERRO: Conexao criada na memoria, mas falha ao gravar em '%s'!\n", wal.caminho);
+    } else {
+        printf("Sucesso! Conexao registrada em '%s' (vai para '%s' ao sair).\n", wal.caminho, arquivo_csv);
+    }
+
+    printf("Conexao criada: %s <--> %s (%d km)\n", city_name(id1), city_name(id2), dist);
+}
+
+/* Opção 6: componentes, pontos críticos e distribuição de graus */
+#define ANALISE_LISTA_MAX 20
+
+void menu_analise_malha() {
+    analise_calcula();
+    printf("\n--- Analise da Malha ---\n");
+    printf("Cidades: %d, conexoes: %d\n", analise.n, analise.arestas);
+    printf("Componentes conexas: %d (maior com %d cidades, %d sem conexao)\n",
+           analise.componentes, analise.maior, analise.isoladas);
+
+    printf("Pontos de articulacao (cidades que separam a malha): %d\n", analise.n_articulacoes);
+    for (int i = 0; i < analise.n_articulacoes && i < ANALISE_LISTA_MAX; ++i)
+        printf("  %s\n", city_name(analise.articulacoes[i]));
+    if (analise.n_articulacoes > ANALISE_LISTA_MAX)
+        printf("  ... e mais %d\n", analise.n_articulacoes - ANALISE_LISTA_MAX);
+
+    printf("Pontes (trechos criticos): %d\n", analise.n_pontes);
+    for (int i = 0; i < analise.n_pontes && i < ANALISE_LISTA_MAX; ++i)
+        printf("  %s - %s\n", city_name(analise.pontes[2*i]), city_name(analise.pontes[2*i + 1]));
+    if (analise.n_pontes > ANALISE_LISTA_MAX)
+        printf("  ... e mais %d\n", analise.n_pontes - ANALISE_LISTA_MAX);
+
+    printf("Distribuicao de graus (conexoes: cidades):\n");
+    for (int g = 0; g <= analise.grau_max; ++g)
+        if (analise.graus[g]) printf("  %d: %d\n", g, analise.graus[g]);
+}
+
+/* Opção 7: tempo gasto em cada parte desde que o programa abriu */
+void menu_estatisticas() {
+    printf("\n--- Estatisticas de Desempenho ---\n");
+    metricas_imprime(stdout);
+    rota_cache_resumo(stdout);
+}
+
+// --stats: mesma tabela na saída de erro ao terminar, em qualquer modo
+static void metricas_na_saida() {
+    fprintf(stderr, "\n--- Estatisticas de Desempenho ---\n");
+    metricas_imprime(stderr);
+}
+
+/* --- gerador de malhas sintéticas e benchmarks --- */
+
+/* --gerar=tipo:N[:semente] escreve na saída padrão um CSV no formato de
+   sempre, com N cidades, e sai sem carregar nada:
+   - grade: malha quadriculada (~5 km entre cidades), estradas pros 4 lados;
+   - geometrico: cidades espalhadas ao acaso no retângulo do RS, ligadas às
+     que estão a menos de um raio escolhido pra dar ~6 conexões por cidade
+     (grade de células, O(N) esperado);
+   - livre: Barabási-Albert, cada cidade nova liga em 2 antigas escolhidas
+     com probabilidade proporcional ao grau (poucos polos muito conectados).
+   As duas primeiras levam coordenadas e a distância da estrada é a reta
+   vezes 1,0 a 1,4, então os limites do A* continuam valendo. Os nomes são
+   sílabas (Baca, Dafeli, ...) derivadas do id, todos diferentes.
+   --bench=carga|nomes|fuzzy|rotas|analise|todos mede o grafo carregado
+   (gerado ou real) e imprime um objeto JSON por linha, com p50/p99 por
+   operação e vazão, pra guardar e comparar entre versões. */
+#define BENCH_CONSULTAS 1000  // operações por medida (rotas/fuzzy)
+#define BENCH_SEG_MAX 10.0    // corta a medida se passar disso
+#define BENCH_LOTE_NOMES 64   // busca exata é rápida demais pra cronometrar uma a uma
+
+static uint64_t bench_estado = 88172645463325252ull;
+
+// xorshift64*: rand() pode ter só 15 bits (Windows), pouco pra milhões de cidades
+static uint32_t bench_aleatorio() {
+    bench_estado ^= bench_estado >> 12;
+    bench_estado ^= bench_estado << 25;
+    bench_estado ^= bench_estado >> 27;
+    return (uint32_t)((bench_estado * 2685821657736338717ull) >> 32);
+}
+
+static double bench_uniforme() {
+    return bench_aleatorio() / 4294967296.0;
+}
+
+static void gera_nome(int id, char *out) {
+    static const char consoantes[] = "bcdfgjlmnprstvxz", vogais[] = "aeio";
+    char silabas[16];
+    int k = 0;
+    do { silabas[k++] = id % 64; id /= 64; } while (id > 0 || k < 2);
+    char *o = out;
+    while (k-- > 0) { *o++ = consoantes[silabas[k] / 4]; *o++ = vogais[silabas[k] % 4]; }
+    *o = '\0';
+    out[0] = toupper((unsigned char)out[0]);
+}
+
+static void gera_estrada(FILE *f, int a, int b, const double *lat, const double *lon) {
+    char na[16], nb[16];
+    gera_nome(a, na);
+    gera_nome(b, nb);
+    if (lat == NULL) {
+        fprintf(f, "%s,%s,%d\n", na, nb, 5 + (int)(bench_aleatorio() % 196));
+        return;
+    }
+    Coord ca = { lat[a], lon[a] }, cb = { lat[b], lon[b] };
+    int km = (int)ceil(haversine_km(ca, cb) * (1.0 + 0.4 * bench_uniforme()));
+    fprintf(f, "%s,%s,%d,%.6f,%.6f,%.6f,%.6f\n", na, nb, km > 0 ? km : 1, lat[a], lon[a], lat[b], lon[b]);
+}
+
+static void gera_grade(FILE *f, int n, double *lat, double *lon) {
+    int lado = (int)ceil(sqrt((double)n));
+    for (int i = 0; i < n; ++i) { lat[i] = -27.0 - (i / lado) * 0.05; lon[i] = -57.5 + (i % lado) * 0.05; }
+    for (int i = 0; i < n; ++i) {
+        if (i % lado + 1 < lado && i + 1 < n) gera_estrada(f, i, i + 1, lat, lon);
+        if (i + lado < n) gera_estrada(f, i, i + lado, lat, lon);
+    }
+}
+
+static void gera_geometrico(FILE *f, int n, double *lat, double *lon) {
+    const double lat0 = -33.5, lat1 = -27.0, lon0 = -57.5, lon1 = -49.5;
+    const double km_lat = 111.2, km_lon = 111.2 * cos(30.0 * 3.14159265358979 / 180.0);
+    double larg = (lon1 - lon0) * km_lon, alt = (lat1 - lat0) * km_lat;
+    double raio = sqrt(6.0 * larg * alt / (3.14159265358979 * n));
+    int cx = (int)(larg / raio) + 1, cy = (int)(alt / raio) + 1;
+    if ((double)cx * cy > 4.0 * n) cx = cy = (int)ceil(sqrt(4.0 * n));  // N pequeno: raio grande
+    double cel_x = larg / cx, cel_y = alt / cy;
+    for (int i = 0; i < n; ++i) {
+        lat[i] = lat0 + (lat1 - lat0) * bench_uniforme();
+        lon[i] = lon0 + (lon1 - lon0) * bench_uniforme();
+    }
+    // CSR das células: cidades de cada célula em [ini[c], ini[c+1])
+    size_t nc = (size_t)cx * cy;
+    int *ini = xrealloc(NULL, (nc + 1) * sizeof(int)), *cel = xrealloc(NULL, n * sizeof(int));
+    int *ids = xrealloc(NULL, n * sizeof(int));
+    memset(ini, 0, (nc + 1) * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        int x = (int)((lon[i] - lon0) * km_lon / cel_x), y = (int)((lat[i] - lat0) * km_lat / cel_y);
+        if (x >= cx) x = cx - 1;
+        if (y >= cy) y = cy - 1;
+        cel[i] = y * cx + x;
+        ini[cel[i] + 1]++;
+    }
+    for (size_t c = 0; c < nc; ++c) ini[c + 1] += ini[c];
+    int *pos = xrealloc(NULL, nc * sizeof(int));
+    memcpy(pos, ini, nc * sizeof(int));
+    for (int i = 0; i < n; ++i) ids[pos[cel[i]]++] = i;
+    free(pos);
+    for (int i = 0; i < n; ++i) {
+        int x = cel[i] % cx, y = cel[i] / cx;
+        for (int yy = y - 1; yy <= y + 1; ++yy)
+            for (int xx = x - 1; xx <= x + 1; ++xx) {
+                if (xx < 0 || yy < 0 || xx >= cx || yy >= cy) continue;
+                int c = yy * cx + xx;
+                for (int k = ini[c]; k < ini[c + 1]; ++k) {
+                    int j = ids[k];
+                    if (j <= i) continue;
+                    double dx = (lon[j] - lon[i]) * km_lon, dy = (lat[j] - lat[i]) * km_lat;
+                    if (dx * dx + dy * dy <= raio * raio) gera_estrada(f, i, j, lat, lon);
+                }
+            }
+    }
+    free(ini); free(cel); free(ids);
+}
+
+static void gera_livre(FILE *f, int n) {
+    const int m = 2;
+    // cada aresta põe as duas pontas aqui; sortear uma posição = sortear por grau
+    int *pontas = xrealloc(NULL, (size_t)2 * m * n * sizeof(int));
+    size_t np = 0;
+    int base = n < m + 1 ? n : m + 1;
+    for (int a = 0; a < base; ++a)
+        for (int b = a + 1; b < base; ++b) {
+            gera_estrada(f, a, b, NULL, NULL);
+            pontas[np++] = a; pontas[np++] = b;
+        }
+    for (int v = base; v < n; ++v) {
+        int escolhidos[2] = { -1, -1 };
+        for (int k = 0; k < m; ++k) {
+            int u;
+            do u = pontas[(size_t)(bench_uniforme() * np)]; while (u == escolhidos[0]);
+            escolhidos[k] = u;
+            gera_estrada(f, v, u, NULL, NULL);
+        }
+        for (int k = 0; k < m; ++k) { pontas[np++] = v; pontas[np++] = escolhidos[k]; }
+    }
+    free(pontas);
+}
+
+// --gerar=tipo:N[:semente]; devolve o código de saída do programa
+int gera_malha(const char *spec) {
+    char tipo[32];
+    long n = 0;
+    unsigned long long semente = 1;
+    if (sscanf(spec, "%31[^:]:%ld:%llu", tipo, &n, &semente) < 2 || n < 2 || n > 100000000L) {
+        fprintf(stderr, "Uso: --gerar=grade|geometrico|livre:N[:semente] (2 <= N <= 100000000)\n");
+        return 1;
+    }
+    bench_estado = semente * 0x9E3779B97F4A7C15ull + 1;
+    static char buf[1 << 20];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    fputs("origem,destino,distancia\n", stdout);
+    double *lat = NULL, *lon = NULL;
+    if (strcmp(tipo, "livre") != 0) {
+        lat = xrealloc(NULL, n * sizeof(double));
+        lon = xrealloc(NULL, n * sizeof(double));
+    }
+    if (strcmp(tipo, "grade") == 0) gera_grade(stdout, (int)n, lat, lon);
+    else if (strcmp(tipo, "geometrico") == 0) gera_geometrico(stdout, (int)n, lat, lon);
+    else if (strcmp(tipo, "livre") == 0) gera_livre(stdout, (int)n);
+    else { fprintf(stderr, "Tipo de malha desconhecido: %s\n", tipo); free(lat); free(lon); return 1; }
+    free(lat); free(lon);
+    return fflush(stdout) != 0;
+}
+
+// medida da carga feita na partida (main preenche)
+typedef struct {
+    double segundos;
+    double mb;
+    long linhas;
+    int do_snapshot;
+} CargaMedida;
+
+CargaMedida carga_medida;
+
+static int compara_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static long bench_conexoes() {
+    long m = 0;
+    for (int u = 0; u < city_count; ++u) m += grau(u);
+    return grafo_direcionado ? m : m / 2;
+}
+
+// uma linha JSON com p50/p99/média (us por operação) e operações por segundo.
+// lat[] tem uma amostra por medida (reordenado aqui); cada amostra pode ser
+// a média de um lote, então operacoes >= amostras
+static void bench_json(const char *bench, const char *variante, double lat[], int amostras,
+                       long operacoes, double total, double preparo) {
+    qsort(lat, amostras, sizeof(double), compara_double);
+    printf("{\"bench\":\"%s\"", bench);
+    if (variante) printf(",\"variante\":\"%s\"", variante);
+    printf(",\"cidades\":%d,\"conexoes\":%ld,\"n\":%ld", city_count, bench_conexoes(), operacoes);
+    if (amostras > 0)
+        printf(",\"p50_us\":%.3f,\"p99_us\":%.3f,\"media_us\":%.3f,\"por_seg\":%.1f",
+               lat[amostras / 2] * 1e6, lat[(size_t)amostras * 99 / 100] * 1e6,
+               total / operacoes * 1e6, operacoes / (total > 0 ? total : 1e-9));
+    if (preparo >= 0) printf(",\"preparo_s\":%.3f", preparo);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void bench_carga() {
+    printf("{\"bench\":\"carga\",\"variante\":\"%s\",\"cidades\":%d,\"conexoes\":%ld,\"segundos\":%.4f",
+           carga_medida.do_snapshot ? "snapshot" : "csv", city_count, bench_conexoes(), carga_medida.segundos);
+    if (!carga_medida.do_snapshot) {
+        double seg = carga_medida.segundos > 0 ? carga_medida.segundos : 1e-9;
+        printf(",\"mb\":%.2f,\"linhas\":%ld,\"mb_por_seg\":%.1f,\"linhas_por_seg\":%.0f",
+               carga_medida.mb, carga_medida.linhas, carga_medida.mb / seg, carga_medida.linhas / seg);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+// busca exata (normaliza + índice hash) dos nomes como vieram no CSV
+static int bench_nomes() {
+    int lotes = 2000, erros = 0;
+    double *lat = xrealloc(NULL, lotes * sizeof(double)), total = 0;
+    char buf[CHAVE_BUF];
+    for (int l = 0; l < lotes; ++l) {
+        int ids[BENCH_LOTE_NOMES];
+        for (int k = 0; k < BENCH_LOTE_NOMES; ++k) ids[k] = bench_aleatorio() % city_count;
+        double t0 = agora_seg();
+        for (int k = 0; k < BENCH_LOTE_NOMES; ++k) {
+            char *key = nome_para_chave(city_name(ids[k]), buf);
+            erros += city_lookup_key(key) != ids[k];
+            chave_libera(key, buf);
+        }
+        double seg = agora_seg() - t0;
+        lat[l] = seg / BENCH_LOTE_NOMES;
+        total += seg;
+    }
+    bench_json("nomes", NULL, lat, lotes, (long)lotes * BENCH_LOTE_NOMES, total, -1);
+    free(lat);
+    return erros;
+}
+
+// busca aproximada: metade com até 2 letras trocadas, metade só um pedaço do nome
+static void bench_fuzzy() {
+    int n = BENCH_CONSULTAS, feitas = 0;
+    double *lat = xrealloc(NULL, n * sizeof(double)), total = 0;
+    char texto[CHAVE_BUF];
+    for (; feitas < n && total < BENCH_SEG_MAX; ++feitas) {
+        int id = bench_aleatorio() % city_count;
+        snprintf(texto, sizeof(texto), "%s", city_key(id));
+        int len = strlen(texto);
+        if (feitas % 2 == 0) {
+            for (int e = bench_aleatorio() % 3; len > 0 && e > 0; --e) texto[bench_aleatorio() % len] = 'a' + bench_aleatorio() % 26;
+        } else if (len > 3) {
+            int corte = 3 + bench_aleatorio() % (len - 2);
+            texto[corte] = '\0';
+        }
+        CandidatoNome cand[FUZZY_TOPK];
+        double t0 = agora_seg();
+        fuzzy_candidatos(texto, cand, FUZZY_TOPK);
+        lat[feitas] = agora_seg() - t0;
+        total += lat[feitas];
+    }
+    bench_json("fuzzy", NULL, lat, feitas, feitas, total, -1);
+    free(lat);
+}
+
+/* Pares sorteados dentro da mesma componente (senão a maioria sai na hora),
+   os mesmos pra todos os motores, sem o cache de rotas. As distâncias de
+   cada motor são conferidas com as do primeiro que respondeu o par. Com
+   --rota=X só o motor X; sem --rota, todos menos ch, cuja contração pode
+   levar minutos em malha grande. */
+static int bench_rotas() {
+    int n = BENCH_CONSULTAS, erros = 0;
+    int *orig = xrealloc(NULL, n * sizeof(int)), *dest = xrealloc(NULL, n * sizeof(int));
+    int *ref = xrealloc(NULL, n * sizeof(int));
+    double *lat = xrealloc(NULL, n * sizeof(double));
+    for (int i = 0; i < n; ++i) {
+        int tentativas = 0;
+        do {
+            orig[i] = bench_aleatorio() % city_count;
+            dest[i] = bench_aleatorio() % city_count;
+        } while (componente_de(orig[i]) != componente_de(dest[i]) && ++tentativas < 20);
+        ref[i] = -1;
+    }
+    consulta_garante(city_count);
+    RotaMotor salvo = rota_motor;
+    for (int m = ROTA_DIJKSTRA; m <= ROTA_CH; ++m) {
+        if (m == ROTA_GEO && cidades_com_coord == 0) continue;
+        if ((m == ROTA_ALT || m == ROTA_CH) && grafo_direcionado) continue;
+        if (rota_explicita ? m != (int)salvo : m == ROTA_CH) continue;
+        double preparo = -1, t0 = agora_seg();
+        if (m == ROTA_ALT) { alt_prepara(); preparo = agora_seg() - t0; }
+        if (m == ROTA_CH) {
+            if (!ch_atual() && ch_constroi() != 0) continue;  // pesos negativos
+            preparo = agora_seg() - t0;
+        }
+        rota_motor = (RotaMotor)m;
+        int feitas = 0;
+        double total = 0;
+        for (; feitas < n && total < BENCH_SEG_MAX; ++feitas) {
+            t0 = agora_seg();
+            ResultadoRota r = rota_ponto_a_ponto_com(&rota_scratch_padrao, orig[feitas], dest[feitas], consulta.caminho_a);
+            lat[feitas] = agora_seg() - t0;
+            total += lat[feitas];
+            if (ref[feitas] == -1) ref[feitas] = r.dist;
+            else if (ref[feitas] != r.dist) erros++;
+        }
+        bench_json("rotas", rota_nomes[m], lat, feitas, feitas, total, preparo);
+    }
+    rota_motor = salvo;
+    free(orig); free(dest); free(ref); free(lat);
+    return erros;
+}
+
+// Tarjan completo (opção 6) e união-busca refeita do zero
+static void bench_analise() {
+    int reps = 5;
+    double lat[5], total = 0;
+    int feitas = 0;
+    for (; feitas < reps && total < BENCH_SEG_MAX; ++feitas) {
+        analise.valida = 0;
+        double t0 = agora_seg();
+        analise_calcula();
+        lat[feitas] = agora_seg() - t0;
+        total += lat[feitas];
+    }
+    bench_json("analise", "tarjan", lat, feitas, feitas, total, -1);
+    total = 0;
+    for (feitas = 0; feitas < reps && total < BENCH_SEG_MAX; ++feitas) {
+        uniao.valido = 0;
+        double t0 = agora_seg();
+        componentes_total();
+        lat[feitas] = agora_seg() - t0;
+        total += lat[feitas];
+    }
+    bench_json("analise", "uniao", lat, feitas, feitas, total, -1);
+}
+
+/* Dijkstra completo das mesmas origens com o heap binário e com o
+   delta-stepping em 1, 2, 4... threads até --threads (padrão: uma por
+   núcleo). "aceleracao" é o tempo médio com 1 thread dividido pelo de N e
+   "vs_heap" o do heap dividido pelo de N. dist[] e prev[] de cada busca
+   paralela são conferidos com os do heap. */
+#define BENCH_ORIGENS_SSSP 16
+
+static void bench_paralelo_json(const char *variante, int threads, int origens, double total,
+                                double uma_thread, double heap) {
+    double media = total / origens;
+    printf("{\"bench\":\"paralelo\",\"variante\":\"%s\",\"threads\":%d", variante, threads);
+    if (uma_thread > 0) printf(",\"delta\":%d", delta_largura > 0 ? delta_largura : delta_pesos.media);
+    printf(",\"cidades\":%d,\"conexoes\":%ld,\"n\":%d,\"media_ms\":%.3f",
+           city_count, bench_conexoes(), origens, media * 1e3);
+    if (uma_thread > 0 && media > 0)
+        printf(",\"aceleracao\":%.2f,\"vs_heap\":%.2f", uma_thread / media, heap / media);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static int bench_paralelo() {
+#ifdef _WIN32
+    fprintf(stderr, "ERRO: o Dijkstra paralelo nao e suportado no Windows\n");
+    return 0;
+#endif
+    delta_pesos_atualiza();
+    if (delta_pesos.nao_positivo) {
+        fprintf(stderr, "ERRO: o Dijkstra paralelo exige pesos positivos\n");
+        return 0;
+    }
+    int maximo = delta_threads();
+    if (threads_lote > maximo)
+        fprintf(stderr, "Aviso: --threads=%d, mas a maquina tem %d nucleo(s); o delta usa no maximo %d\n",
+                threads_lote, maximo, maximo);
+    int niveis[32], n_niveis = 0;
+    for (int t = 1; t < maximo && n_niveis < 31; t *= 2) niveis[n_niveis++] = t;
+    niveis[n_niveis++] = maximo;
+
+    int *ref_dist = xrealloc(NULL, city_count * sizeof(int)), *ref_prev = xrealloc(NULL, city_count * sizeof(int));
+    int *dist = xrealloc(NULL, city_count * sizeof(int)), *prev = xrealloc(NULL, city_count * sizeof(int));
+    double tempo[33] = {0}, gasto = 0;  // [0] heap, [1 + j] delta com niveis[j] threads
+    DijkstraMotor motor_salvo = dijkstra_motor;
+    int threads_salvo = threads_lote, feitas = 0, erros = 0;
+    for (; feitas < BENCH_ORIGENS_SSSP && (feitas == 0 || gasto < BENCH_SEG_MAX); ++feitas) {
+        int src = bench_aleatorio() % city_count;
+        dijkstra_motor = DIJKSTRA_BINARIO;
+        double t0 = agora_seg();
+        dijkstra(src, ref_dist, ref_prev);
+        tempo[0] += agora_seg() - t0;
+        dijkstra_motor = DIJKSTRA_DELTA;
+        for (int j = 0; j < n_niveis; ++j) {
+            threads_lote = niveis[j];
+            t0 = agora_seg();
+            dijkstra(src, dist, prev);
+            tempo[1 + j] += agora_seg() - t0;
+            if (memcmp(dist, ref_dist, city_count * sizeof(int)) != 0
+                || memcmp(prev, ref_prev, city_count * sizeof(int)) != 0) erros++;
+        }
+        gasto = 0;
+        for (int j = 0; j <= n_niveis; ++j) gasto += tempo[j];
+    }
+    dijkstra_motor = motor_salvo;
+    threads_lote = threads_salvo;
 
-// aresta (lista ligada)
-typedef struct Edge {
-    int to;
-    int weight;
-    struct Edge *next;
-} Edge;
+    bench_paralelo_json("binario", 1, feitas, tempo[0], 0, 0);
+    for (int j = 0; j < n_niveis; ++j)
+        bench_paralelo_json("delta", niveis[j], feitas, tempo[1 + j], tempo[1] / feitas, tempo[0] / feitas);
+    free(ref_dist); free(ref_prev); free(dist); free(prev);
+    return erros;
+}
 
-// estrutura usada pra listar vizinhos (opção 3)
-typedef struct {
-    int city_id;
-    int distance;
-} VizinhoInfo;
+// --bench=carga|nomes|fuzzy|rotas|analise|paralelo|todos; -1 se o nome não é desses
+int bench_suite(const char *qual) {
+    static const char *nomes[] = { "carga", "nomes", "fuzzy", "rotas", "analise", "paralelo", "todos" };
+    int k = 0, erros = 0;
+    while (k < 7 && strcmp(qual, nomes[k]) != 0) k++;
+    if (k == 7) return -1;
+    if (city_count < 2) { fprintf(stderr, "ERRO: grafo com menos de 2 cidades\n"); return 1; }
+    int todos = k == 6;
+    bench_estado = 88172645463325252ull;
+    if (todos || k == 0) bench_carga();
+    if (todos || k == 1) erros += bench_nomes();
+    if (todos || k == 2) bench_fuzzy();
+    if (todos || k == 3) erros += bench_rotas();
+    if (todos || k == 4) bench_analise();
+    if (todos || k == 5) erros += bench_paralelo();
+    if (erros) fprintf(stderr, "ERRO: %d resultado(s) divergente(s)\n", erros);
+    return erros ? 1 : 0;
+}
 
-// estrutura pra contar conexões (opção 2)
-typedef struct {
-    int city_id;
-    int count;
-    char name[MAX_NAME];
-} ConexaoCount;
+/* --- modo de consultas em lote --- */
 
-char city_names[MAX_CITIES][MAX_NAME];
-int city_count = 0;
-Edge *adj[MAX_CITIES] = {NULL};
+/* --consultas[=arquivo] lê uma consulta por linha (arquivo ou "-" = entrada
+   padrão), campos separados por vírgula como no CSV do grafo (aspas quando o
+   nome tem vírgula):
+     rota,<origem>,<destino>
+     alternativas,<origem>,<destino>[,k]  (as k rotas mais curtas; padrão 3)
+     vizinhos,<cidade>[,k]                (os k mais perto; sem k, todos)
+     ranking[,k]                          (as k com mais conexões; padrão 10)
+     grau,<cidade>
+     candidatos,<texto>                   (nomes parecidos, do melhor pro pior)
+     analise[,articulacoes|pontes|graus]  (resumo da malha, ou a lista pedida)
+     conexao,<cidade1>,<cidade2>,<km>     (também grava no CSV, como a opção 5)
+   e escreve uma linha de resposta por consulta, em CSV (padrão) ou JSON
+   (--formato=json). Os nomes passam pela mesma busca aproximada do menu e a
+   resposta traz o nome encontrado. Linhas vazias ou começando com '#' são
+   ignoradas; consulta inválida vira uma linha "erro" e o lote continua.
+   A memória de trabalho (LoteContexto) é a mesma do menu, então nada é
+   alocado por consulta; o servidor (--servir) responde o mesmo protocolo
+   com um contexto por thread. */
+const char *consultas_entrada = NULL;  // --consultas=arquivo ("-" = entrada padrão)
 
-/* --- utilitárias de string --- */
+#define LOTE_CAMPOS 5
+#define RANKING_PADRAO 10  // cidades da consulta "ranking" sem quantidade
+
+typedef struct TravaGrafo TravaGrafo;
 
-// normalizo para minúsculas e tiro espaços nas pontas
-void str_to_lower_trim(char *s) {
-    char *p = s;
-    while (*p) {*p = tolower((unsigned char)*p); p++;}
-    char *start = s;
-    while (*start && isspace((unsigned char)*start)) start++;
-    if (start != s) memmove(s, start, strlen(start)+1);
-    int len = strlen(s);
-    while (len > 0 && isspace((unsigned char)s[len-1])) s[--len] = '\0';
+// memória de quem responde consultas: no lote, a do menu; no servidor, uma por thread
+typedef struct {
+    FuzzyScratch *fuzzy;
+    RotaScratch *rota;   // NULL = rota_ponto_a_ponto(), com o cache de rotas
+    AlternativasScratch *alternativas;
+    AnaliseMalha *analise;  // NULL = a da opção 6
+    int *caminho;
+    size_t cap;
+    TravaGrafo *trava;   // servidor: "conexao" escreve no grafo compartilhado
+} LoteContexto;
+
+// separa a linha em campos, no lugar; devolve quantos (até max)
+static int lote_campos(char *s, char *campos[], int max) {
+    int n = 0;
+    for (;;) {
+        while (*s == ' ' || *s == '\t') s++;
+        char *ini = s, *out = s;
+        if (*s == '"') {
+            s++;
+            while (*s) {
+                if (*s == '"' && s[1] == '"') { *out++ = '"'; s += 2; }
+                else if (*s == '"') { s++; break; }
+                else *out++ = *s++;
+            }
+            while (*s && *s != ',') s++;
+        } else {
+            while (*s && *s != ',') *out++ = *s++;
+            while (out > ini && isspace((unsigned char)out[-1])) out--;
+        }
+        int fim = *s == '\0';
+        *out = '\0';
+        if (n < max) campos[n++] = ini;
+        if (fim) return n;
+        s++;
+    }
 }
 
-// retorna índice da cidade (cria se não existir)
-int city_index(const char *name_in) {
-    char name[MAX_NAME];
-    strncpy(name, name_in, MAX_NAME-1);
-    name[MAX_NAME-1] = '\0';
-    str_to_lower_trim(name);
-
-    for (int i = 0; i < city_count; ++i) {
-        char tmp[MAX_NAME];
-        strncpy(tmp, city_names[i], MAX_NAME-1);
-        tmp[MAX_NAME-1] = '\0';
-        str_to_lower_trim(tmp);
-        if (strcmp(tmp, name) == 0) return i;
-    }
-    if (city_count >= MAX_CITIES) {
-        fprintf(stderr, "ERRO: Numero maximo de cidades atingidos\n");
-        exit(1);
+static void json_texto(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') { fputc('\\', f); fputc(c, f); }
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
     }
-    strncpy(city_names[city_count], name_in, MAX_NAME-1);
-    city_names[city_count][MAX_NAME-1] = '\0';
-    city_count++;
-    return city_count - 1;
+    fputc('"', f);
 }
 
-// adiciona aresta (grafo não direcionado)
-void add_edge(int a, int b, int w) {
-    Edge *e1 = malloc(sizeof(Edge));
-    e1->to = b; e1->weight = w; e1->next = adj[a]; adj[a] = e1;
-    Edge *e2 = malloc(sizeof(Edge));
-    e2->to = a; e2->weight = w; e2->next = adj[b]; adj[b] = e2;
+// início da resposta: "cmd," no CSV, {"cmd":"...", no JSON
+static void lote_abre(FILE *f, int json, const char *cmd) {
+    if (json) { fputs("{\"cmd\":", f); json_texto(f, cmd); }
+    else fputs(cmd, f);
 }
 
-/* Levenshtein - usado pra busca aproximada de nomes */
-int levenshtein(const char *s, const char *t) {
-    int n = strlen(s), m = strlen(t);
-    if (n == 0) return m;
-    if (m == 0) return n;
-    int *v0 = malloc((m+1)*sizeof(int));
-    int *v1 = malloc((m+1)*sizeof(int));
-    for (int j=0;j<=m;++j) v0[j] = j;
-    for (int i=1;i<=n;++i) {
-        v1[0] = i;
-        for (int j=1;j<=m;++j) {
-            int cost = (s[i-1] == t[j-1]) ? 0 : 1;
-            int deletion = v0[j] + 1;
-            int insertion = v1[j-1] + 1;
-            int substitution = v0[j-1] + cost;
-            int v = deletion;
-            if (insertion < v) v = insertion;
-            if (substitution < v) v = substitution;
-            v1[j] = v;
-        }
-        memcpy(v0, v1, (m+1)*sizeof(int));
+// campo texto com nome (o nome só aparece no JSON)
+static void lote_texto(FILE *f, int json, const char *nome, const char *valor) {
+    if (json) { fprintf(f, ",\"%s\":", nome); json_texto(f, valor); }
+    else { fputc(',', f); csv_campo(f, valor); }
+}
+
+// campo inteiro; INT_MAX sai como vazio/null
+static void lote_int(FILE *f, int json, const char *nome, int valor) {
+    if (json) {
+        if (valor == INT_MAX) fprintf(f, ",\"%s\":null", nome);
+        else fprintf(f, ",\"%s\":%d", nome, valor);
+    } else {
+        fputc(',', f);
+        if (valor != INT_MAX) fprintf(f, "%d", valor);
     }
-    int res = v0[m];
-    free(v0); free(v1);
-    return res;
 }
 
-/* Busca aproximada: tenta achar cidade pelo input do usuário */
-int fuzzy_match_city(const char *input, char *matched_name_out) {
-    char temp_input[MAX_NAME];
-    strncpy(temp_input, input, MAX_NAME-1);
-    temp_input[MAX_NAME-1] = '\0';
-    str_to_lower_trim(temp_input);
+static void lote_fecha(FILE *f, int json) {
+    fputs(json ? "}\n" : "\n", f);
+}
 
-    int best_idx = -1;
-    int best_dist = INT_MAX;
-    int threshold = strlen(temp_input) > 3 ? 4 : 2;
+static void lote_erro(FILE *f, int json, long linha, const char *motivo, const char *detalhe) {
+    lote_abre(f, json, "erro");
+    lote_int(f, json, "linha", (int)linha);
+    char buf[256];
+    snprintf(buf, sizeof(buf), detalhe ? "%s: %s" : "%s", motivo, detalhe);
+    lote_texto(f, json, "motivo", buf);
+    lote_fecha(f, json);
+}
 
-    for (int i=0; i<city_count; ++i) {
-        char tmp[MAX_NAME];
-        strncpy(tmp, city_names[i], MAX_NAME-1);
-        tmp[MAX_NAME-1] = '\0';
-        str_to_lower_trim(tmp);
+// resolve um nome; escreve a linha de erro e devolve -1 se não achar
+static int lote_cidade(LoteContexto *c, FILE *f, int json, long linha, const char *nome) {
+    int id = fuzzy_match_city_com(c->fuzzy, nome);
+    if (id < 0) lote_erro(f, json, linha, "cidade nao encontrada", nome);
+    return id;
+}
 
-        if (strstr(tmp, temp_input) != NULL) {
-             best_dist = 0;
-             best_idx = i;
-             break;
+// trajeto: lista no JSON; no CSV um campo só, cidades separadas por ';'
+static void lote_caminho(FILE *f, int json, const int caminho[], int tam) {
+    if (json) {
+        fputs(",\"caminho\":[", f);
+        for (int i = 0; i < tam; ++i) {
+            if (i) fputc(',', f);
+            json_texto(f, city_name(caminho[i]));
+        }
+        fputc(']', f);
+        return;
+    }
+    fputc(',', f);
+    int aspas = 0;
+    for (int i = 0; i < tam; ++i)
+        if (strpbrk(city_name(caminho[i]), ",\";\r\n")) aspas = 1;
+    if (aspas) fputc('"', f);
+    for (int i = 0; i < tam; ++i) {
+        if (i) fputc(';', f);
+        for (const char *p = city_name(caminho[i]); *p; ++p) {
+            if (*p == '"') fputc('"', f);
+            fputc(*p, f);
         }
+    }
+    if (aspas) fputc('"', f);
+}
+
+static void lote_rota(LoteContexto *c, FILE *f, int json, int origem, int destino) {
+    GARANTE_CAP(c->caminho, c->cap, (size_t)city_count);
+    int *caminho = c->caminho;
+    ResultadoRota r;
+    if (origem == destino) { r.dist = 0; r.tam = 1; caminho[0] = origem; }
+    else if (c->rota) r = rota_ponto_a_ponto_com(c->rota, origem, destino, caminho);
+    else r = rota_ponto_a_ponto(origem, destino, caminho);
+
+    lote_abre(f, json, "rota");
+    lote_texto(f, json, "origem", city_name(origem));
+    lote_texto(f, json, "destino", city_name(destino));
+    lote_int(f, json, "km", r.dist);
+    lote_caminho(f, json, caminho, r.dist != INT_MAX ? r.tam : 0);
+    lote_fecha(f, json);
+}
+
+// as rotas em ordem, cada uma com km e trajeto (no CSV, pares km,trajeto);
+// devolve -1 se a consulta não tem resposta (peso negativo)
+static int lote_alternativas(LoteContexto *c, FILE *f, int json, long linha, int origem, int destino, int k) {
+    AlternativasScratch *s = c->alternativas;
+    int n = rotas_alternativas_com(s, origem, destino, k);
+    if (n < 0) {
+        lote_erro(f, json, linha, "alternativas exigem distancias nao negativas", NULL);
+        return -1;
+    }
+    lote_abre(f, json, "alternativas");
+    lote_texto(f, json, "origem", city_name(origem));
+    lote_texto(f, json, "destino", city_name(destino));
+    if (json) fputs(",\"rotas\":[", f);
+    for (int r = 0; r < n; ++r) {
+        const RotaAlternativa *a = &s->aceitas[r];
+        if (json) fprintf(f, "%s{\"km\":%d", r ? "," : "", a->dist);
+        else lote_int(f, 0, NULL, a->dist);
+        lote_caminho(f, json, a->cidades, a->tam);
+        if (json) fputc('}', f);
+    }
+    if (json) fputc(']', f);
+    lote_fecha(f, json);
+    return 0;
+}
 
-        int d = levenshtein(temp_input, tmp);
-        if (d < best_dist) {
-            best_dist = d;
-            best_idx = i;
+// os k vizinhos mais próximos (k < 0 = todos), sem ordenar: O(k)
+static void lote_vizinhos(FILE *f, int json, int cidade, int k) {
+    lote_abre(f, json, "vizinhos");
+    lote_texto(f, json, "cidade", city_name(cidade));
+    if (json) fputs(",\"vizinhos\":[", f);
+    int i = 0, v, w;
+    VizinhoIter viz;
+    viz_inicio(cidade, &viz);
+    for (; i != k && viz_ordenado_proximo(&viz, &v, &w); ++i) {
+        if (json) {
+            fputs(i ? ",{\"cidade\":" : "{\"cidade\":", f);
+            json_texto(f, city_name(v));
+            fprintf(f, ",\"km\":%d}", w);
+        } else {
+            // pares cidade,km depois do nome
+            lote_texto(f, 0, NULL, city_name(v));
+            lote_int(f, 0, NULL, w);
         }
     }
+    if (json) fputc(']', f);
+    lote_fecha(f, json);
+}
 
-    if (best_idx >= 0 && best_dist <= threshold) {
-        if (matched_name_out) {
-            strncpy(matched_name_out, city_names[best_idx], MAX_NAME-1);
-            matched_name_out[MAX_NAME-1] = '\0';
+// as k cidades com mais conexões, direto do ranking de graus: O(k)
+static void lote_ranking(FILE *f, int json, int k) {
+    ranking_garante();
+    if (k > ranking.n) k = ranking.n;
+    lote_abre(f, json, "ranking");
+    if (json) fputs(",\"cidades\":[", f);
+    for (int i = 0; i < k; ++i) {
+        int u = ranking.ordem[i];
+        if (json) {
+            fputs(i ? ",{\"cidade\":" : "{\"cidade\":", f);
+            json_texto(f, city_name(u));
+            fprintf(f, ",\"grau\":%d}", grau(u));
+        } else {
+            lote_texto(f, 0, NULL, city_name(u));
+            lote_int(f, 0, NULL, grau(u));
         }
-        return best_idx;
     }
-    return -1;
+    if (json) fputc(']', f);
+    lote_fecha(f, json);
 }
 
-/* Dijkstra (menor distância) */
-void dijkstra(int src, int dist[], int prev[]) {
-    for (int i=0;i<city_count;++i) { dist[i] = INT_MAX; prev[i] = -1; }
-    dist[src] = 0;
-    int visited[MAX_CITIES] = {0};
+// quantidade opcional das consultas vizinhos/ranking; -1 se não for inteiro >= 0
+static int lote_quantidade(const char *s) {
+    int k;
+    if (!parse_int(s, strlen(s), &k) || k < 0) return -1;
+    return k;
+}
 
-    for (int it=0; it<city_count; ++it) {
-        int u = -1;
-        int best = INT_MAX;
-        for (int i=0;i<city_count;++i) if (!visited[i] && dist[i] < best) { best = dist[i]; u = i; }
-        if (u == -1) break;
-        visited[u] = 1;
-        for (Edge *e = adj[u]; e != NULL; e = e->next) {
-            int v = e->to;
-            int w = e->weight;
-            if (!visited[v] && dist[u] != INT_MAX && dist[u] + w < dist[v]) {
-                dist[v] = dist[u] + w;
-                prev[v] = u;
-            }
+// nomes parecidos com o texto, do melhor pro pior
+static void lote_candidatos(LoteContexto *c, FILE *f, int json, const char *texto) {
+    CandidatoNome cand[FUZZY_TOPK];
+    int n = fuzzy_candidatos_com(c->fuzzy, texto, cand, FUZZY_TOPK);
+    lote_abre(f, json, "candidatos");
+    lote_texto(f, json, "texto", texto);
+    if (json) fputs(",\"candidatos\":[", f);
+    for (int i = 0; i < n; ++i) {
+        if (json) {
+            fputs(i ? ",{\"cidade\":" : "{\"cidade\":", f);
+            json_texto(f, city_name(cand[i].city_id));
+            fprintf(f, ",\"distancia\":%d}", cand[i].distancia);
+        } else {
+            lote_texto(f, 0, NULL, city_name(cand[i].city_id));
+            lote_int(f, 0, NULL, cand[i].distancia);
         }
     }
+    if (json) fputc(']', f);
+    lote_fecha(f, json);
 }
 
-int compare_vizinhos(const void *a, const void *b) {
-    VizinhoInfo *va = (VizinhoInfo *)a;
-    VizinhoInfo *vb = (VizinhoInfo *)b;
-    return va->distance - vb->distance;
-}
+static void servidor_escrita_comeca(TravaGrafo *t);
+static void servidor_escrita_reserva(TravaGrafo *t, const char *nome1, const char *nome2);
+static void servidor_escrita_publica(TravaGrafo *t);
+static void servidor_escrita_termina(TravaGrafo *t);
+
+// aresta nova (mesmo efeito da opção 5), registrada no log de conexões em
+// grupo (no servidor, gravada a cada conexão como na opção 5); devolve -1
+// se a consulta for inválida
+static int lote_conexao(LoteContexto *c, FILE *f, int json, long linha, char *campos[]) {
+    int dist;
+    if (!parse_int(campos[3], strlen(campos[3]), &dist)) {
+        lote_erro(f, json, linha, "distancia invalida", campos[3]);
+        return -1;
+    }
+    int repetida = -1;  // -1 = conferir depois de criar as cidades
+    if (c->trava) {
+        // o escritor é o único que muda o grafo: conferir antes da trava
+        // exclusiva só lê
+        servidor_escrita_comeca(c->trava);
+        char buf1[CHAVE_BUF], buf2[CHAVE_BUF];
+        char *k1 = nome_para_chave(campos[1], buf1), *k2 = nome_para_chave(campos[2], buf2);
+        int a = city_lookup_key(k1), b = city_lookup_key(k2);
+        repetida = a != -1 && b != -1 && a != b && aresta_existe(a, b, dist);
+        chave_libera(k1, buf1);
+        chave_libera(k2, buf2);
+        servidor_escrita_reserva(c->trava, campos[1], campos[2]);
+    }
+    int id1 = city_index(campos[1]);
+    int id2 = city_index(campos[2]);
+    if (repetida == -1) repetida = id1 != id2 && aresta_existe(id1, id2, dist);
+    int ok = 0;
+    if (id1 == id2) lote_erro(f, json, linha, "as cidades devem ser diferentes", NULL);
+    else if (repetida) lote_erro(f, json, linha, "conexao ja existe", NULL);
+    else { add_edge(id1, id2, dist); ok = 1; }
+    if (c->trava) servidor_escrita_publica(c->trava);
+    else if (ok) grafo_congela_se_preciso();
 
-int compare_conexoes(const void *a, const void *b) {
-    ConexaoCount *ca = (ConexaoCount *)a;
-    ConexaoCount *cb = (ConexaoCount *)b;
-    if (ca->count != cb->count) return ca->count - cb->count;
-    return strcmp(ca->name, cb->name);
+    if (ok) {
+        int salvo = wal_anexa(id1, id2, dist) == 0 && (c->trava == NULL || wal_fim_de_grupo() == 0);
+        lote_abre(f, json, "conexao");
+        lote_texto(f, json, "cidade1", city_name(id1));
+        lote_texto(f, json, "cidade2", city_name(id2));
+        lote_int(f, json, "km", dist);
+        if (json) fprintf(f, ",\"salvo\":%s", salvo ? "true" : "false");
+        else fprintf(f, ",%d", salvo);
+        lote_fecha(f, json);
+    }
+    if (c->trava) servidor_escrita_termina(c->trava);
+    return ok ? 0 : -1;
 }
 
-/* --- menus simples --- */
+/* analise            -> resumo (cidades, conexoes, componentes, maior, isoladas,
+                         articulacoes, pontes)
+   analise,articulacoes / analise,pontes / analise,graus -> a lista completa */
+static int lote_analise(LoteContexto *c, FILE *f, int json, long linha, const char *parte) {
+    AnaliseMalha *a = c->analise ? c->analise : &analise;
+    analise_calcula_em(a);
+    if (parte == NULL) {
+        lote_abre(f, json, "analise");
+        lote_int(f, json, "cidades", a->n);
+        lote_int(f, json, "conexoes", a->arestas);
+        lote_int(f, json, "componentes", a->componentes);
+        lote_int(f, json, "maior", a->maior);
+        lote_int(f, json, "isoladas", a->isoladas);
+        lote_int(f, json, "articulacoes", a->n_articulacoes);
+        lote_int(f, json, "pontes", a->n_pontes);
+    } else if (strcmp(parte, "articulacoes") == 0) {
+        lote_abre(f, json, "articulacoes");
+        if (json) fputs(",\"cidades\":[", f);
+        for (int i = 0; i < a->n_articulacoes; ++i) {
+            if (json) { if (i) fputc(',', f); json_texto(f, city_name(a->articulacoes[i])); }
+            else lote_texto(f, 0, NULL, city_name(a->articulacoes[i]));
+        }
+        if (json) fputc(']', f);
+    } else if (strcmp(parte, "pontes") == 0) {
+        lote_abre(f, json, "pontes");
+        if (json) fputs(",\"pontes\":[", f);
+        for (int i = 0; i < a->n_pontes; ++i) {
+            const char *x = city_name(a->pontes[2*i]), *y = city_name(a->pontes[2*i + 1]);
+            if (json) {
+                fputs(i ? ",[" : "[", f);
+                json_texto(f, x); fputc(',', f); json_texto(f, y);
+                fputc(']', f);
+            } else {
+                lote_texto(f, 0, NULL, x);
+                lote_texto(f, 0, NULL, y);
+            }
+        }
+        if (json) fputc(']', f);
+    } else if (strcmp(parte, "graus") == 0) {
+        // pares grau,cidades só dos graus que aparecem
+        lote_abre(f, json, "graus");
+        if (json) fputs(",\"graus\":{", f);
+        int primeiro = 1;
+        for (int g = 0; g <= a->grau_max; ++g) {
+            if (!a->graus[g]) continue;
+            if (json) fprintf(f, "%s\"%d\":%d", primeiro ? "" : ",", g, a->graus[g]);
+            else fprintf(f, ",%d,%d", g, a->graus[g]);
+            primeiro = 0;
+        }
+        if (json) fputc('}', f);
+    } else {
+        lote_erro(f, json, linha, "analise invalida", parte);
+        return -1;
+    }
+    lote_fecha(f, json);
+    return 0;
+}
 
-void menu_listar_cidades() {
-    printf("\n--- Cidades Cadastradas (%d) ---\n", city_count);
-    for (int i = 0; i < city_count; i++) {
-        printf("%d. %s\n", i + 1, city_names[i]);
+// responde uma consulta já separada em campos; devolve 0 ou -1 (linha de erro escrita)
+static int lote_executa(LoteContexto *c, FILE *out, int json, long linha, char *campos[], int n) {
+    const char *cmd = campos[0];
+    int erro = 0;
+    if (strcmp(cmd, "rota") == 0 && n == 3) {
+        int a = lote_cidade(c, out, json, linha, campos[1]);
+        int b = a < 0 ? -1 : lote_cidade(c, out, json, linha, campos[2]);
+        if (b >= 0) lote_rota(c, out, json, a, b);
+        else erro = 1;
+    } else if (strcmp(cmd, "alternativas") == 0 && (n == 3 || n == 4)) {
+        int k = n == 4 ? lote_quantidade(campos[3]) : ALTERNATIVAS_PADRAO;
+        if (k < 1 || k > ALTERNATIVAS_MAX) { lote_erro(out, json, linha, "quantidade invalida", campos[3]); erro = 1; }
+        else {
+            int a = lote_cidade(c, out, json, linha, campos[1]);
+            int b = a < 0 ? -1 : lote_cidade(c, out, json, linha, campos[2]);
+            if (b < 0 || lote_alternativas(c, out, json, linha, a, b, k) != 0) erro = 1;
+        }
+    } else if (strcmp(cmd, "vizinhos") == 0 && (n == 2 || n == 3)) {
+        int k = n == 3 ? lote_quantidade(campos[2]) : -1;  // -1 = todos
+        if (n == 3 && k < 0) { lote_erro(out, json, linha, "quantidade invalida", campos[2]); erro = 1; }
+        else {
+            int a = lote_cidade(c, out, json, linha, campos[1]);
+            if (a >= 0) lote_vizinhos(out, json, a, k);
+            else erro = 1;
+        }
+    } else if (strcmp(cmd, "ranking") == 0 && n <= 2) {
+        int k = n == 2 ? lote_quantidade(campos[1]) : RANKING_PADRAO;
+        if (k >= 0) lote_ranking(out, json, k);
+        else { lote_erro(out, json, linha, "quantidade invalida", campos[1]); erro = 1; }
+    } else if (strcmp(cmd, "grau") == 0 && n == 2) {
+        int a = lote_cidade(c, out, json, linha, campos[1]);
+        if (a >= 0) {
+            lote_abre(out, json, "grau");
+            lote_texto(out, json, "cidade", city_name(a));
+            lote_int(out, json, "grau", grau(a));
+            lote_fecha(out, json);
+        } else erro = 1;
+    } else if (strcmp(cmd, "candidatos") == 0 && n == 2) {
+        lote_candidatos(c, out, json, campos[1]);
+    } else if (strcmp(cmd, "analise") == 0 && n <= 2) {
+        if (lote_analise(c, out, json, linha, n == 2 ? campos[1] : NULL) != 0) erro = 1;
+    } else if (strcmp(cmd, "conexao") == 0 && n == 4) {
+        if (lote_conexao(c, out, json, linha, campos) != 0) erro = 1;
+    } else {
+        lote_erro(out, json, linha, "consulta invalida", cmd);
+        erro = 1;
     }
-    printf("---------------------------------\n");
+    return erro ? -1 : 0;
 }
 
-void menu_contar_conexoes() {
-    ConexaoCount lista[MAX_CITIES];
-    for (int i = 0; i < city_count; i++) {
-        int count = 0;
-        for (Edge *e = adj[i]; e != NULL; e = e->next) count++;
-        lista[i].city_id = i;
-        lista[i].count = count;
-        strcpy(lista[i].name, city_names[i]);
+// modo lote de consultas; devolve o código de saída do programa
+int modo_consultas() {
+    if (formato_saida == FORMATO_BIN) {
+        fprintf(stderr, "ERRO: consultas saem em csv ou json\n");
+        return 1;
     }
-    qsort(lista, city_count, sizeof(ConexaoCount), compare_conexoes);
-    printf("\n--- Numero de Conexoes por Cidade (Ordem Crescente) ---\n");
-    for (int i = 0; i < city_count; i++) {
-        printf("%s: %d conexoes\n", lista[i].name, lista[i].count);
+    int json = formato_saida == FORMATO_JSON;
+    int padrao = strcmp(consultas_entrada, "-") == 0;
+    FILE *in = padrao ? stdin : fopen(consultas_entrada, "r");
+    if (in == NULL) {
+        fprintf(stderr, "ERRO: nao foi possivel abrir '%s'\n", consultas_entrada);
+        return 1;
     }
-    printf("-------------------------------------------------------\n");
+    FILE *out = stdout;
+    static char buf_saida[1 << 16];
+    setvbuf(out, buf_saida, _IOFBF, sizeof(buf_saida));
+
+    LoteContexto ctx = { &fuzzy_scratch_padrao, NULL, &alternativas_scratch_padrao, NULL, NULL, 0, NULL };
+    double t0 = agora_seg();
+    long linha = 0, feitas = 0, erros = 0;
+    char *s;
+    while ((s = ler_linha(in)) != NULL) {
+        linha++;
+        char *campos[LOTE_CAMPOS];
+        int n = lote_campos(s, campos, LOTE_CAMPOS);
+        if ((n == 1 && campos[0][0] == '\0') || campos[0][0] == '#') continue;
+        feitas++;
+        if (lote_executa(&ctx, out, json, linha, campos, n) != 0) erros++;
+    }
+    if (!padrao) fclose(in);
+    wal_fecha();
+    int erro_saida = fflush(out) != 0;
+    double seg = agora_seg() - t0;
+    fprintf(stderr, "%ld consulta(s) em %.3f s (%.0f consultas/s), %ld com erro\n",
+            feitas, seg, feitas / (seg > 0 ? seg : 1e-9), erros);
+    rota_cache_resumo(stderr);
+    return erro_saida ? 1 : 0;
 }
 
-/* Lê cidade do usuário com fuzzy match */
-int ler_cidade_input(char *prompt) {
-    char input[MAX_NAME];
-    char matched_name[MAX_NAME];
-    int idx = -1;
-    do {
-        printf("%s", prompt);
-        if (fgets(input, sizeof(input), stdin) == NULL) return -1;
-        input[strcspn(input, "\n")] = 0;
-        idx = fuzzy_match_city(input, matched_name);
-        if (idx == -1) printf("Cidade '%s' nao encontrada ou ambigua. Tente novamente.\n", input);
-        else printf("-> Selecionado: %s\n", matched_name);
-    } while (idx == -1);
-    return idx;
+/* --- servidor de consultas --- */
+
+/* --servir=caminho (socket Unix) ou --servir=tcp:[host:]porta (padrão
+   127.0.0.1) responde o protocolo do --consultas: uma consulta por linha,
+   uma resposta por linha, em csv ou json (--formato). A thread principal
+   aceita as conexões e as passa por uma fila pra --threads trabalhadores;
+   cada um atende uma conexão até o cliente fechar, com a própria memória de
+   busca (nomes, rota, caminho) e a resposta montada na memória, então
+   cliente lento não segura trava nenhuma.
+   O grafo fica numa trava de leitura/escrita. Consultas leem juntas; a
+   "conexao" confere e prepara tudo fora dela (espaço pras cidades, a
+   aresta, o nome, os trigramas e o ranking; ver escrita_reserva) e pega a
+   trava exclusiva só pra trocar os ponteiros e gravar a aresta no delta.
+   Quando o delta passa do limite, o CSR novo é montado fora da trava, com
+   os leitores ainda no antigo, e a trava exclusiva só cobre a troca dos
+   ponteiros; o antigo é liberado depois, quando ninguém mais o enxerga (a
+   ideia do RCU, sem passar um ponteiro de grafo por todas as buscas).
+   "analise" roda com a trava de leitura, cada trabalhador no seu resultado.
+   Nenhum leitor monta nada: sem cache de rotas, e depois da primeira
+   conexão nova os marcos do ALT e a hierarquia da CH ficam desatualizados,
+   então "rota" com esses motores cai pra 'parada' até o servidor reiniciar.
+   Ctrl+C (ou SIGTERM) para de aceitar, fecha as conexões e grava o log. */
+const char *servir_endereco = NULL;  // --servir=caminho|tcp:[host:]porta
+
+#ifndef _WIN32
+
+#define SERVIDOR_FILA 64          // conexões aceitas esperando trabalhador
+#define SERVIDOR_LINHA_MAX 4096   // consulta maior que isso vira erro
+
+struct TravaGrafo {
+    pthread_rwlock_t grafo;      // consultas x escrita
+    pthread_mutex_t escritor;    // uma conexão nova por vez
+};
+
+typedef struct {
+    LoteContexto ctx;
+    FuzzyScratch fuzzy;
+    RotaScratch rota;
+    AlternativasScratch alternativas;
+    AnaliseMalha analise;
+    pthread_t id;
+    int fd;                      // conexão em atendimento (-1 = nenhuma)
+    long conexoes, consultas, erros;
+} ServidorTrabalho;
+
+typedef struct {
+    TravaGrafo trava;
+    pthread_mutex_t fila_trava;
+    pthread_cond_t tem_conexao, tem_vaga;
+    int fila[SERVIDOR_FILA];
+    int ini, len;
+    int parar;
+    int json;
+    ServidorTrabalho *trab;
+    int threads;
+} Servidor;
+
+static Servidor servidor;
+static volatile sig_atomic_t servidor_sinal = 0;
+
+static void servidor_ao_sinal(int sig) {
+    (void)sig;
+    servidor_sinal = 1;
 }
 
-/* Mostra conexões de uma cidade, ordenadas por distância */
-void menu_conexoes_ordenadas() {
-    int cidade_idx = ler_cidade_input("\nDigite o nome da cidade para ver vizinhos: ");
-    if (cidade_idx == -1) return;
+/* Reserva da conexão nova. Antes da trava exclusiva o escritor monta
+   cópias maiores de tudo que a aresta e as cidades novas fariam crescer:
+   arrays por cidade, delta, arena de nomes, índice de nomes, união-busca,
+   ranking e índice de trigramas com as listas dele. Só o escritor muda
+   essas estruturas, então ele lê as atuais sem trava; as cópias ficam
+   invisíveis até escrita_troca(), que com a trava exclusiva só troca
+   ponteiros. Depois disso city_index, add_edge, trigramas_atualiza e
+   ranking_garante cabem no espaço reservado e só gravam. Os blocos velhos
+   são liberados depois de soltar a trava (quem os lia tinha a trava de
+   leitura e já saiu). */
+typedef struct {
+    int slot;  // na tabela de trigramas que vai ser publicada
+    int *ids;
+    int cap;
+} TrocaLista;
 
-    VizinhoInfo vizinhos[MAX_CITIES];
-    int count = 0;
-    for (Edge *e = adj[cidade_idx]; e != NULL; e = e->next) {
-        vizinhos[count].city_id = e->to;
-        vizinhos[count].distance = e->weight;
-        count++;
-    }
+static struct {
+    NomeRef *names, *keys;
+    Coord *coords;
+    int cap;
+    DeltaArestas delta, delta_entrada;
+    ArenaNomes arena;
+    IndiceNomes indice;
+    UniaoBusca uniao;
+    RankingGraus ranking;
+    IndiceTrigramas trigramas;
+    TrocaLista *listas;
+    int n_listas;
+    size_t cap_listas;
+    void **velhos;   // substituídos na troca
+    int n_velhos;
+    size_t cap_velhos;
+} reserva;
 
-    if (count == 0) {
-        printf("Esta cidade nao possui conexoes diretas.\n");
-        return;
-    }
+// cópia de p com tam bytes (os usado primeiros iguais); p vira velho
+static void *reserva_copia(void *p, size_t usado, size_t tam) {
+    void *novo = xrealloc(NULL, tam);
+    if (usado) memcpy(novo, p, usado);
+    GARANTE_CAP(reserva.velhos, reserva.cap_velhos, (size_t)reserva.n_velhos + 1);
+    reserva.velhos[reserva.n_velhos++] = p;
+    return novo;
+}
 
-    qsort(vizinhos, count, sizeof(VizinhoInfo), compare_vizinhos);
+// mesma conta do GARANTE_CAP
+static size_t reserva_cap(size_t cap, size_t n, size_t inicial) {
+    size_t novo = cap ? cap : inicial;
+    while (novo < n) novo *= 2;
+    return novo;
+}
 
-    printf("\nConexoes de %s (por distancia):\n", city_names[cidade_idx]);
-    for (int i = 0; i < count; i++) {
-        printf("%d. %s (%d km)\n", i+1, city_names[vizinhos[i].city_id], vizinhos[i].distance);
+static void reserva_delta(DeltaArestas *d, int arestas, int cap_cidades) {
+    if (cap_cidades > city_cap) {
+        d->head = reserva_copia(d->head, city_cap * sizeof(int), cap_cidades * sizeof(int));
+        d->grau = reserva_copia(d->grau, city_cap * sizeof(int), cap_cidades * sizeof(int));
+        for (int u = city_cap; u < cap_cidades; ++u) { d->head[u] = -1; d->grau[u] = 0; }
+    }
+    if (d->len + arestas > d->cap) {
+        int cap = reserva_cap(d->cap, d->len + arestas, 256);
+        d->to = reserva_copia(d->to, d->len * sizeof(int), cap * sizeof(int));
+        d->weight = reserva_copia(d->weight, d->len * sizeof(int), cap * sizeof(int));
+        d->next = reserva_copia(d->next, d->len * sizeof(int), cap * sizeof(int));
+        d->cap = cap;
     }
 }
 
-/* --- auxiliars para componentes e reconstrução de caminho --- */
+// trigramas das cidades novas: tabela com folga pros códigos novos, listas
+// prontas pra eles e listas maiores onde a cidade não caberia
+static void reserva_trigramas(uint32_t t[], int n) {
+    IndiceTrigramas *r = &reserva.trigramas;
+    *r = trigramas;
+    if (n == 0) return;
+    qsort(t, n, sizeof(uint32_t), compara_u32);
+    int novos = 0;
+    for (int i = 0; i < n; ++i)
+        if ((i == 0 || t[i] != t[i-1]) && trigrama_lista(t[i]) == NULL) novos++;
+    if (2 * (trigramas.usados + novos + 1) > trigramas.cap) {
+        int cap = reserva_cap(trigramas.cap, 2 * (trigramas.usados + novos + 1), 4096);
+        trigramas_monta(r, cap);
+        GARANTE_CAP(reserva.velhos, reserva.cap_velhos, (size_t)reserva.n_velhos + 2);
+        reserva.velhos[reserva.n_velhos++] = trigramas.codigos;
+        reserva.velhos[reserva.n_velhos++] = trigramas.listas;
+    }
+    GARANTE_CAP(listas_prontas.ids, listas_prontas.cap, (size_t)novos);
+    while (listas_prontas.n < novos)
+        listas_prontas.ids[listas_prontas.n++] = xrealloc(NULL, TRIGRAMA_LISTA_INICIAL * sizeof(int));
 
-// marca componente por DFS
-void dfs_mark_component(int u, int comp_id, int comp[]) {
-    comp[u] = comp_id;
-    for (Edge *e = adj[u]; e != NULL; e = e->next) {
-        if (comp[e->to] == -1) dfs_mark_component(e->to, comp_id, comp);
+    reserva.n_listas = 0;
+    for (int i = 0, j; i < n; i = j) {
+        for (j = i; j < n && t[j] == t[i]; ++j) {}
+        ListaTrigrama *l = trigrama_lista(t[i]);
+        if (l == NULL || l->len + (j - i) <= l->cap) continue;
+        GARANTE_CAP(reserva.listas, reserva.cap_listas, (size_t)reserva.n_listas + 1);
+        TrocaLista *x = &reserva.listas[reserva.n_listas++];
+        x->slot = trigrama_slot_em(r, t[i]);
+        x->cap = reserva_cap(l->cap, l->len + (j - i), TRIGRAMA_LISTA_INICIAL);
+        x->ids = reserva_copia(l->ids, l->len * sizeof(int), x->cap * sizeof(int));
     }
 }
 
-// reconstrói caminho usando array prev (retorna tamanho; ordem from->to)
-int reconstruct_path(int prev[], int from, int to, int caminho[]) {
-    int tam = 0;
-    int cur = to;
-    while (cur != -1) {
-        caminho[tam++] = cur;
-        if (cur == from) break;
-        cur = prev[cur];
+// prepara a conexão nome1 - nome2 sem trava (só com a do escritor)
+static void escrita_reserva(const char *nome1, const char *nome2) {
+    const char *nomes[2] = {nome1, nome2};
+    char buf[2][CHAVE_BUF];
+    char *chave[2];
+    int novas = 0, nova[2];
+    size_t bytes = 0, n_t = 0;
+    for (int i = 0; i < 2; ++i) {
+        chave[i] = nome_para_chave(nomes[i], buf[i]);
+        nova[i] = city_lookup_key(chave[i]) == -1 && (i == 0 || !nova[0] || strcmp(chave[0], chave[1]) != 0);
+        if (!nova[i]) continue;
+        novas++;
+        bytes += strlen(nomes[i]) + strlen(chave[i]) + 2;
+        n_t += strlen(chave[i]) + 2;
+        GARANTE_CAP(trigramas_nome, cap_trigramas_nome, strlen(chave[i]) + 2);
     }
-    if (tam == 0 || caminho[tam-1] != from) return 0;
-    for (int i = 0; i < tam/2; ++i) {
-        int tmp = caminho[i];
-        caminho[i] = caminho[tam-1-i];
-        caminho[tam-1-i] = tmp;
+
+    int n = city_count + novas;
+    reserva.names = city_names;
+    reserva.keys = city_keys;
+    reserva.coords = city_coords;
+    reserva.cap = city_cap;
+    if (n > city_cap) {
+        reserva.cap = reserva_cap(city_cap, n, 64);
+        reserva.names = reserva_copia(city_names, city_count * sizeof(NomeRef), reserva.cap * sizeof(NomeRef));
+        reserva.keys = reserva_copia(city_keys, city_count * sizeof(NomeRef), reserva.cap * sizeof(NomeRef));
+        reserva.coords = reserva_copia(city_coords, city_count * sizeof(Coord), reserva.cap * sizeof(Coord));
+        for (int i = city_count; i < reserva.cap; ++i) reserva.coords[i].lat = reserva.coords[i].lon = NAN;
     }
-    return tam;
-}
+    reserva.delta = delta;
+    reserva_delta(&reserva.delta, grafo_direcionado ? 1 : 2, reserva.cap);
+    reserva.delta_entrada = delta_entrada;
+    if (grafo_direcionado) reserva_delta(&reserva.delta_entrada, 1, reserva.cap);
 
-/* Opção 4: calcula distância/trajeto; sugere rota parcial se componentes diferentes */
-void menu_distancia_entre_cidades() {
-    printf("\n--- Calcular Distancia e Trajeto ---\n");
-    int origem = ler_cidade_input("Cidade de Origem: ");
-    int destino = ler_cidade_input("Cidade de Destino: ");
+    reserva.arena = arena_nomes;
+    if (arena_nomes.len + bytes > arena_nomes.cap) {
+        reserva.arena.cap = reserva_cap(arena_nomes.cap, arena_nomes.len + bytes, 16);
+        reserva.arena.buf = reserva_copia(arena_nomes.buf, arena_nomes.len, reserva.arena.cap);
+    }
 
-    if (origem == destino) {
-        printf("Distancia: 0 km (mesma cidade).\n");
-        return;
+    // city_index confere a carga antes de cada procura, até de nome que já existe
+    int usados = indice_nomes.usados + novas + 1;
+    reserva.indice = indice_nomes;
+    if (2 * usados > indice_nomes.cap) {
+        indice_monta(&reserva.indice, reserva_cap(indice_nomes.cap, 2 * usados, 1024));
+        GARANTE_CAP(reserva.velhos, reserva.cap_velhos, (size_t)reserva.n_velhos + 2);
+        reserva.velhos[reserva.n_velhos++] = indice_nomes.slots;
+        reserva.velhos[reserva.n_velhos++] = indice_nomes.hashes;
     }
 
-    int dist[MAX_CITIES], prev[MAX_CITIES];
-    dijkstra(origem, dist, prev);
+    reserva.uniao = uniao;
+    if (uniao.valido && reserva.cap > uniao.cap) {
+        UniaoBusca *u = &reserva.uniao;
+        u->pai = reserva_copia(uniao.pai, uniao.cap * sizeof(int), reserva.cap * sizeof(int));
+        u->tam = reserva_copia(uniao.tam, uniao.cap * sizeof(int), reserva.cap * sizeof(int));
+        for (int i = uniao.cap; i < reserva.cap; ++i) { u->pai[i] = i; u->tam[i] = 1; }
+        u->cap = reserva.cap;
+    }
 
-    if (dist[destino] != INT_MAX) {
-        // caminho completo existe
-        printf("\nMenor distancia entre %s e %s: %d km\n", city_names[origem], city_names[destino], dist[destino]);
-        printf("Trajeto a ser percorrido: ");
-        int caminho[MAX_CITIES];
-        int tam_caminho = 0;
-        int atual = destino;
-        while (atual != -1) {
-            caminho[tam_caminho++] = atual;
-            atual = prev[atual];
+    reserva.ranking = ranking;
+    if (ranking.valido) {
+        RankingGraus *r = &reserva.ranking;
+        if (n > r->cap) {
+            r->cap = reserva_cap(ranking.cap, n, 16);
+            r->ordem = reserva_copia(ranking.ordem, ranking.n * sizeof(int), r->cap * sizeof(int));
+            r->pos = reserva_copia(ranking.pos, ranking.n * sizeof(int), r->cap * sizeof(int));
         }
-        for (int i = tam_caminho - 1; i >= 0; i--) {
-            printf("%s", city_names[caminho[i]]);
-            if (i > 0) printf(" -> ");
+        // a conexão sobe o grau máximo de no máximo 1
+        if ((size_t)ranking.grau_max + 3 > r->cap_lim) {
+            r->cap_lim = reserva_cap(ranking.cap_lim, (size_t)ranking.grau_max + 3, 16);
+            r->lim = reserva_copia(ranking.lim, (ranking.grau_max + 2) * sizeof(int), r->cap_lim * sizeof(int));
         }
-        printf("\n");
-        return;
     }
 
-    // componentes diferentes: identifico componentes
-    int comp[MAX_CITIES];
-    for (int i = 0; i < city_count; ++i) comp[i] = -1;
-    int comp_id = 0;
-    for (int i = 0; i < city_count; ++i) {
-        if (comp[i] == -1) {
-            dfs_mark_component(i, comp_id, comp);
-            comp_id++;
+    // trigramas_atualiza só olha as cidades novas, e só se o índice já existe
+    static uint32_t *t = NULL;
+    static size_t cap_t = 0;
+    GARANTE_CAP(t, cap_t, n_t);
+    int k = 0;
+    if (trigramas.indexadas == city_count && trigramas.cap > 0) {
+        for (int i = 0; i < 2; ++i) {
+            if (!nova[i]) continue;
+            int m = trigramas_de(chave[i], strlen(chave[i]), t + k);
+            k += trigramas_unicos(t + k, m);
         }
     }
+    reserva_trigramas(t, k);
+    for (int i = 0; i < 2; ++i) chave_libera(chave[i], buf[i]);
+}
+
+// com a trava exclusiva: publica o que escrita_reserva montou
+static void escrita_troca() {
+    city_names = reserva.names;
+    city_keys = reserva.keys;
+    city_coords = reserva.coords;
+    city_cap = reserva.cap;
+    delta = reserva.delta;
+    delta_entrada = reserva.delta_entrada;
+    arena_nomes = reserva.arena;
+    indice_nomes = reserva.indice;
+    uniao = reserva.uniao;
+    ranking = reserva.ranking;
+    trigramas = reserva.trigramas;
+    for (int i = 0; i < reserva.n_listas; ++i) {
+        trigramas.listas[reserva.listas[i].slot].ids = reserva.listas[i].ids;
+        trigramas.listas[reserva.listas[i].slot].cap = reserva.listas[i].cap;
+    }
+}
+
+// sem trava: ninguém mais enxerga os blocos trocados
+static void escrita_libera_velhos() {
+    for (int i = 0; i < reserva.n_velhos; ++i) free(reserva.velhos[i]);
+    reserva.n_velhos = 0;
+}
 
-    int comp_origem = comp[origem];
-    int comp_destino = comp[destino];
+// uma conexão nova por vez; as consultas continuam lendo
+static void servidor_escrita_comeca(TravaGrafo *t) {
+    pthread_mutex_lock(&t->escritor);
+}
 
-    if (comp_origem == comp_destino) {
-        // caso raro, trato como sem caminho
-        printf("Nao ha caminho registrado entre %s e %s.\n", city_names[origem], city_names[destino]);
-        return;
+// prepara a conexão fora da trava exclusiva e a pega só pra trocar os ponteiros
+static void servidor_escrita_reserva(TravaGrafo *t, const char *nome1, const char *nome2) {
+    escrita_reserva(nome1, nome2);
+    pthread_rwlock_wrlock(&t->grafo);
+    escrita_troca();
+}
+
+// solta os leitores; se o delta cresceu demais, recongela em estilo RCU
+static void servidor_escrita_publica(TravaGrafo *t) {
+    trigramas_atualiza();  // cidades novas entram na busca de nomes
+    ranking_garante();
+    pthread_rwlock_unlock(&t->grafo);
+    escrita_libera_velhos();
+    if (!grafo_delta_grande()) return;
+
+    // só o escritor muda o grafo e ele está aqui: montar com leitores em paralelo é seguro
+    METRICA_INICIO(MET_CONGELA);
+    GrafoCSR novo, velho, novo_in = {0}, velho_in = {0};
+    congela_monta(&novo, &csr, &delta, 1);
+    if (grafo_direcionado) congela_monta(&novo_in, &csr_entrada, &delta_entrada, 0);
+    pthread_rwlock_wrlock(&t->grafo);
+    congela_troca(&csr, &delta, &novo, &velho);
+    if (grafo_direcionado) congela_troca(&csr_entrada, &delta_entrada, &novo_in, &velho_in);
+    delta_ordenado = 1;
+    pthread_rwlock_unlock(&t->grafo);
+    // quem lia o antigo terminou antes da troca (tinha a trava de leitura)
+    csr_libera(&velho);
+    if (grafo_direcionado) csr_libera(&velho_in);
+    METRICA_FIM(MET_CONGELA);
+}
+
+static void servidor_escrita_termina(TravaGrafo *t) {
+    pthread_mutex_unlock(&t->escritor);
+}
+
+static int escreve_tudo(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return -1;
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+// uma linha do cliente: consulta com a trava certa, resposta em out
+static void servidor_consulta(ServidorTrabalho *w, FILE *out, long linha, char *s) {
+    Servidor *sv = &servidor;
+    char *campos[LOTE_CAMPOS];
+    int n = lote_campos(s, campos, LOTE_CAMPOS);
+    if ((n == 1 && campos[0][0] == '\0') || campos[0][0] == '#') return;
+    w->consultas++;
+    int r;
+    if (strcmp(campos[0], "conexao") == 0) {
+        r = lote_executa(&w->ctx, out, sv->json, linha, campos, n);  // trava por conta própria
+    } else {
+        pthread_rwlock_rdlock(&sv->trava.grafo);
+        r = lote_executa(&w->ctx, out, sv->json, linha, campos, n);
+        pthread_rwlock_unlock(&sv->trava.grafo);
     }
+    if (r != 0) w->erros++;
+}
 
-    // escolho par (u,v) entre componentes com heurística (Levenshtein nos nomes)
-    int best_u = -1, best_v = -1, best_lev = INT_MAX;
-    for (int u = 0; u < city_count; ++u) {
-        if (comp[u] != comp_origem) continue;
-        for (int v = 0; v < city_count; ++v) {
-            if (comp[v] != comp_destino) continue;
-            char a[MAX_NAME], b[MAX_NAME];
-            strncpy(a, city_names[u], MAX_NAME-1); a[MAX_NAME-1] = '\0';
-            strncpy(b, city_names[v], MAX_NAME-1); b[MAX_NAME-1] = '\0';
-            str_to_lower_trim(a); str_to_lower_trim(b);
-            int lev = levenshtein(a, b);
-            if (lev < best_lev) { best_lev = lev; best_u = u; best_v = v; }
+// atende uma conexão até o cliente fechar; fecha fd
+static void servidor_atende(ServidorTrabalho *w, int fd) {
+    Servidor *sv = &servidor;
+    FILE *in = fdopen(fd, "r");
+    char *resp = NULL;
+    size_t resp_len = 0;
+    FILE *out = in ? open_memstream(&resp, &resp_len) : NULL;
+    if (in == NULL || out == NULL) {
+        if (in) fclose(in); else close(fd);
+        return;
+    }
+    char *s = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    long linha = 0;
+    while ((len = getline(&s, &cap, in)) != -1) {
+        linha++;
+        while (len > 0 && (s[len-1] == '\n' || s[len-1] == '\r')) s[--len] = '\0';
+        if (len > SERVIDOR_LINHA_MAX) {
+            lote_erro(out, sv->json, linha, "consulta longa demais", NULL);
+            w->consultas++;
+            w->erros++;
+        } else {
+            servidor_consulta(w, out, linha, s);
         }
+        if (fflush(out) != 0) break;
+        if (resp_len > 0 && escreve_tudo(fd, resp, resp_len) != 0) break;
+        rewind(out);
     }
+    fclose(out);
+    free(resp);
+    free(s);
+    pthread_mutex_lock(&sv->fila_trava);
+    w->fd = -1;  // antes de fechar: o número pode ser reusado
+    pthread_mutex_unlock(&sv->fila_trava);
+    fclose(in);
+}
 
-    // caminho da origem até best_u (já tenho prev do Dijkstra com origem)
-    int caminho_a[MAX_CITIES], tam_a = reconstruct_path(prev, origem, best_u, caminho_a);
-
-    // caminho de best_v até destino (rodo Dijkstra com source = best_v)
-    int dist2[MAX_CITIES], prev2[MAX_CITIES];
-    dijkstra(best_v, dist2, prev2);
-    int caminho_b[MAX_CITIES], tam_b = reconstruct_path(prev2, best_v, destino, caminho_b);
+static void *servidor_trabalhador(void *arg) {
+    ServidorTrabalho *w = arg;
+    Servidor *sv = &servidor;
+    for (;;) {
+        pthread_mutex_lock(&sv->fila_trava);
+        while (sv->len == 0 && !sv->parar) pthread_cond_wait(&sv->tem_conexao, &sv->fila_trava);
+        if (sv->parar) { pthread_mutex_unlock(&sv->fila_trava); break; }
+        int fd = sv->fila[sv->ini];
+        sv->ini = (sv->ini + 1) % SERVIDOR_FILA;
+        sv->len--;
+        w->fd = fd;
+        w->conexoes++;
+        pthread_cond_signal(&sv->tem_vaga);
+        pthread_mutex_unlock(&sv->fila_trava);
+        servidor_atende(w, fd);
+    }
+    return NULL;
+}
 
-    // exibo sugestão parcial e aviso que falta ligação entre best_u e best_v
-    printf("\nNao existe caminho completo registrado entre %s e %s.\n", city_names[origem], city_names[destino]);
-    if (best_u != -1 && best_v != -1 && tam_a > 0 && tam_b > 0) {
-        printf("Sugestao parcial (componentes distintos):\n");
-        for (int i = 0; i < tam_a; ++i) {
-            printf("%s", city_names[caminho_a[i]]);
-            if (i < tam_a - 1) printf(" -> ");
+// abre o socket de escuta; -1 com a mensagem já escrita
+static int servidor_escuta(const char *endereco) {
+    int fd = -1;
+    if (strncmp(endereco, "tcp:", 4) == 0) {
+        char host[256] = "127.0.0.1";
+        const char *porta = endereco + 4;
+        const char *dp = strrchr(porta, ':');
+        if (dp) {
+            size_t n = dp - porta;
+            if (n >= sizeof(host)) n = sizeof(host) - 1;
+            memcpy(host, porta, n);
+            host[n] = '\0';
+            porta = dp + 1;
         }
-        printf("\nFALTA LIGACAO ENTRE '%s' E '%s'\n", city_names[best_u], city_names[best_v]);
-        printf("Para completar o trajeto, seria necessario ligar essas duas cidades.\n");
-        for (int i = 0; i < tam_b; ++i) {
-            if (i == 0) printf("%s", city_names[caminho_b[i]]);
-            else printf(" -> %s", city_names[caminho_b[i]]);
+        struct addrinfo dicas, *res, *a;
+        memset(&dicas, 0, sizeof(dicas));
+        dicas.ai_family = AF_UNSPEC;
+        dicas.ai_socktype = SOCK_STREAM;
+        dicas.ai_flags = AI_PASSIVE;
+        int e = getaddrinfo(host[0] ? host : NULL, porta, &dicas, &res);
+        if (e != 0) {
+            fprintf(stderr, "ERRO: endereco '%s' invalido: %s\n", endereco, gai_strerror(e));
+            return -1;
         }
-        printf("\n");
+        for (a = res; a != NULL; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd < 0) continue;
+            int um = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &um, sizeof(um));
+            if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
     } else {
-        printf("Nao foi possivel sugerir uma rota parcial entre as componentes.\n");
+        struct sockaddr_un a;
+        memset(&a, 0, sizeof(a));
+        a.sun_family = AF_UNIX;
+        if (strlen(endereco) >= sizeof(a.sun_path)) {
+            fprintf(stderr, "ERRO: caminho do socket longo demais: %s\n", endereco);
+            return -1;
+        }
+        strcpy(a.sun_path, endereco);
+        struct stat sb;
+        if (stat(endereco, &sb) == 0 && S_ISSOCK(sb.st_mode)) unlink(endereco);  // sobra de execução anterior
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && (bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, SOMAXCONN) != 0)) {
+            close(fd);
+            fd = -1;
+        }
     }
+    if (fd < 0) fprintf(stderr, "ERRO: nao foi possivel escutar em '%s': %s\n", endereco, strerror(errno));
+    return fd;
 }
 
-/* cria nova conexão (menu 5) e persiste no CSV */
-void menu_nova_conexao() {
-    char buffer[MAX_NAME];
-    printf("\n--- Criar Nova Conexao e Salvar ---\n");
+// modo servidor; devolve o código de saída do programa
+int modo_servidor() {
+    if (formato_saida == FORMATO_BIN) {
+        fprintf(stderr, "ERRO: consultas saem em csv ou json\n");
+        return 1;
+    }
+    Servidor *sv = &servidor;
+    int escuta = servidor_escuta(servir_endereco);
+    if (escuta < 0) return 1;
 
-    printf("Nome da primeira cidade: ");
-    fgets(buffer, sizeof(buffer), stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
-    int id1 = city_index(buffer);
+    // tudo que as buscas montariam sob demanda fica pronto antes das threads
+    snapshot_desanexa();  // conexões novas trocam os arrays do grafo
+    componentes_total();
+    ranking_garante();
+    trigramas_atualiza();
+    if (rota_motor == ROTA_ALT) alt_prepara();
+    grafo_compartilhado = 1;
 
-    printf("Nome da segunda cidade: ");
-    fgets(buffer, sizeof(buffer), stdin);
-    buffer[strcspn(buffer, "\n")] = 0;
-    int id2 = city_index(buffer);
+    sv->json = formato_saida == FORMATO_JSON;
+    sv->threads = threads_lote > 0 ? threads_lote : threads_padrao();
+    pthread_rwlock_init(&sv->trava.grafo, NULL);
+    pthread_mutex_init(&sv->trava.escritor, NULL);
+    pthread_mutex_init(&sv->fila_trava, NULL);
+    pthread_cond_init(&sv->tem_conexao, NULL);
+    pthread_cond_init(&sv->tem_vaga, NULL);
 
-    if (id1 == id2) {
-        printf("Erro: As cidades devem ser diferentes.\n");
-        return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = servidor_ao_sinal;  // sem SA_RESTART: o accept volta com EINTR
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);  // cliente que fechou vira erro de write
+    // os sinais ficam só com a thread principal, que está no accept
+    sigset_t sinais, antes;
+    sigemptyset(&sinais);
+    sigaddset(&sinais, SIGINT);
+    sigaddset(&sinais, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sinais, &antes);
+    sv->trab = xrealloc(NULL, sv->threads * sizeof(ServidorTrabalho));
+    memset(sv->trab, 0, sv->threads * sizeof(ServidorTrabalho));
+    int criadas = 0;
+    for (int t = 0; t < sv->threads; ++t) {
+        ServidorTrabalho *w = &sv->trab[t];
+        w->ctx.fuzzy = &w->fuzzy;
+        w->ctx.rota = &w->rota;
+        w->ctx.alternativas = &w->alternativas;
+        w->ctx.analise = &w->analise;
+        w->ctx.trava = &sv->trava;
+        w->fd = -1;
+        if (pthread_create(&w->id, NULL, servidor_trabalhador, w) != 0) break;
+        criadas++;
     }
+    pthread_sigmask(SIG_SETMASK, &antes, NULL);
+    if (criadas == 0) {
+        fprintf(stderr, "ERRO: nao foi possivel criar as threads do servidor\n");
+        close(escuta);
+        return 1;
+    }
+    fprintf(stderr, "Servidor em '%s' com %d thread(s); Ctrl+C encerra\n", servir_endereco, criadas);
 
-    int dist;
-    printf("Distancia (km): ");
-    scanf("%d", &dist);
-    while (getchar() != '\n');
-
-    add_edge(id1, id2, dist);
+    while (!servidor_sinal) {
+        int fd = accept(escuta, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "ERRO: accept: %s\n", strerror(errno));
+            break;
+        }
+        pthread_mutex_lock(&sv->fila_trava);
+        // o sinal não acorda a espera: olho a flag de tempos em tempos
+        while (sv->len == SERVIDOR_FILA && !servidor_sinal) {
+            struct timespec ate;
+            clock_gettime(CLOCK_REALTIME, &ate);
+            ate.tv_nsec += 200000000L;
+            if (ate.tv_nsec >= 1000000000L) { ate.tv_sec++; ate.tv_nsec -= 1000000000L; }
+            pthread_cond_timedwait(&sv->tem_vaga, &sv->fila_trava, &ate);
+        }
+        if (servidor_sinal) {
+            // encerrando (a fila pode estar cheia): essa conexão não entra
+            pthread_mutex_unlock(&sv->fila_trava);
+            close(fd);
+            break;
+        }
+        sv->fila[(sv->ini + sv->len++) % SERVIDOR_FILA] = fd;
+        pthread_cond_signal(&sv->tem_conexao);
+        pthread_mutex_unlock(&sv->fila_trava);
+    }
 
-    FILE *f = fopen("cidades_rs_grafo.csv", "a");
-    if (f == NULL) {
-        printf("ERRO: Conexao criada na memoria, mas falha ao abrir arquivo para salvar!\n");
-    } else {
-        fprintf(f, "%s,%s,%d\n", city_names[id1], city_names[id2], dist);
-        fclose(f);
-        printf("Sucesso! Dados salvos em 'cidades_rs_grafo.csv'.\n");
+    // encerra: fecha o que está na fila e derruba as conexões em atendimento
+    close(escuta);
+    pthread_mutex_lock(&sv->fila_trava);
+    sv->parar = 1;
+    for (; sv->len > 0; sv->len--, sv->ini = (sv->ini + 1) % SERVIDOR_FILA) close(sv->fila[sv->ini]);
+    for (int t = 0; t < criadas; ++t) if (sv->trab[t].fd >= 0) shutdown(sv->trab[t].fd, SHUT_RDWR);
+    pthread_cond_broadcast(&sv->tem_conexao);
+    pthread_mutex_unlock(&sv->fila_trava);
+    long conexoes = 0, consultas = 0, erros = 0;
+    for (int t = 0; t < criadas; ++t) {
+        pthread_join(sv->trab[t].id, NULL);
+        conexoes += sv->trab[t].conexoes;
+        consultas += sv->trab[t].consultas;
+        erros += sv->trab[t].erros;
     }
+    if (strncmp(servir_endereco, "tcp:", 4) != 0) unlink(servir_endereco);
+    wal_fecha();
+    fprintf(stderr, "\nServidor encerrado: %ld conexao(oes), %ld consulta(s), %ld com erro\n",
+            conexoes, consultas, erros);
+    return 0;
+}
+
+#else
 
-    printf("Conexao criada: %s <--> %s (%d km)\n", city_names[id1], city_names[id2], dist);
+static void servidor_escrita_comeca(TravaGrafo *t) { (void)t; }
+static void servidor_escrita_reserva(TravaGrafo *t, const char *nome1, const char *nome2) {
+    (void)t; (void)nome1; (void)nome2;
 }
+static void servidor_escrita_publica(TravaGrafo *t) { (void)t; }
+static void servidor_escrita_termina(TravaGrafo *t) { (void)t; }
+
+int modo_servidor() {
+    fprintf(stderr, "ERRO: --servir nao e suportado no Windows\n");
+    return 1;
+}
+
+#endif
 
 /* main: carrega CSV e mostra menu */
-int main() {
-    FILE *arquivo;
-    char origem[50], destino[50];
-    int distancia;
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--dijkstra=linear") == 0) dijkstra_motor = DIJKSTRA_LINEAR;
+        else if (strcmp(argv[i], "--dijkstra=binario") == 0) dijkstra_motor = DIJKSTRA_BINARIO;
+        else if (strcmp(argv[i], "--dijkstra=radix") == 0) dijkstra_motor = DIJKSTRA_RADIX;
+        else if (strcmp(argv[i], "--dijkstra=delta") == 0) dijkstra_motor = DIJKSTRA_DELTA;
+        else if (strncmp(argv[i], "--delta=", 8) == 0 && atoi(argv[i] + 8) > 0) delta_largura = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--csv=", 6) == 0) arquivo_csv = argv[i] + 6;
+        else if (strcmp(argv[i], "--sem-snapshot") == 0) usar_snapshot = 0;
+        else if (strcmp(argv[i], "--direcionado") == 0) {
+            grafo_direcionado = 1;
+            csr_in = &csr_entrada;
+            delta_in = &delta_entrada;
+        }
+        else if (strncmp(argv[i], "--rota=", 7) == 0) {
+            int k = 0;
+            while (k <= ROTA_CH && strcmp(argv[i] + 7, rota_nomes[k]) != 0) k++;
+            if (k > ROTA_CH) { fprintf(stderr, "Motor de rota desconhecido: %s\n", argv[i] + 7); return 1; }
+            rota_motor = (RotaMotor)k;
+            rota_explicita = 1;
+        }
+        else if (strncmp(argv[i], "--matriz=", 9) == 0) matriz_saida = argv[i] + 9;
+        else if (strncmp(argv[i], "--bench=", 8) == 0) bench_modo = argv[i] + 8;
+        else if (strncmp(argv[i], "--gerar=", 8) == 0) gerar_spec = argv[i] + 8;
+        else if (strcmp(argv[i], "--stats") == 0) mostrar_stats = 1;
+        else if (strncmp(argv[i], "--servir=", 9) == 0) servir_endereco = argv[i] + 9;
+        else if (strcmp(argv[i], "--consultas") == 0) consultas_entrada = "-";
+        else if (strncmp(argv[i], "--consultas=", 12) == 0) consultas_entrada = argv[i] + 12;
+        else if (strncmp(argv[i], "--origens=", 10) == 0) matriz_origens = argv[i] + 10;
+        else if (strncmp(argv[i], "--destinos=", 11) == 0) matriz_destinos = argv[i] + 11;
+        else if (strcmp(argv[i], "--formato=csv") == 0) formato_saida = FORMATO_CSV;
+        else if (strcmp(argv[i], "--formato=bin") == 0) formato_saida = FORMATO_BIN;
+        else if (strcmp(argv[i], "--formato=json") == 0) formato_saida = FORMATO_JSON;
+        else if (strncmp(argv[i], "--threads=", 10) == 0 && atoi(argv[i] + 10) > 0) threads_lote = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--cache-mb=", 11) == 0) cache_rotas_mb = atol(argv[i] + 11);
+        else if (strcmp(argv[i], "--fsync=sempre") == 0) politica_fsync = FSYNC_SEMPRE;
+        else if (strcmp(argv[i], "--fsync=periodico") == 0) politica_fsync = FSYNC_PERIODICO;
+        else if (strcmp(argv[i], "--fsync=nunca") == 0) politica_fsync = FSYNC_NUNCA;
+        else {
+            fprintf(stderr, "Uso: %s [--dijkstra=linear|binario|radix|delta [--delta=N] [--threads=N]]\n"
+                            "       [--rota=dijkstra|parada|bidir|geo|alt|ch]\n"
+                            "       [--csv=arquivo] [--sem-snapshot] [--direcionado] [--cache-mb=N] [--fsync=sempre|periodico|nunca]\n"
+                            "       [--stats]\n"
+                            "       [--matriz=saida|- [--origens=lista] [--destinos=lista] [--formato=csv|bin] [--threads=N]]\n"
+                            "       [--consultas[=arquivo] [--formato=csv|json]]\n"
+                            "       [--servir=socket|tcp:[host:]porta [--threads=N] [--formato=csv|json]]\n"
+                            "       [--bench=levenshtein|incremental|carga|nomes|fuzzy|rotas|analise|paralelo|todos]\n"
+                            "       [--gerar=grade|geometrico|livre:N[:semente]]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
 
-    arquivo = fopen("cidades_rs_grafo.csv", "r");
+    if (gerar_spec) return gera_malha(gerar_spec);
+    if (mostrar_stats) atexit(metricas_na_saida);
 
-    if (arquivo == NULL) {
-        printf("ERRO CRITICO: Arquivo 'cidades_rs_grafo.csv' nao encontrado.\n");
-        return 1;
+    // no modo lote a saída padrão pode ser o próprio resultado
+    FILE *msg = matriz_saida || consultas_entrada || bench_modo || servir_endereco ? stderr : stdout;
+    fprintf(msg, "Carregando grafo...\n");
+    char arquivo_snap[4096];
+    snapshot_caminho(arquivo_csv, arquivo_snap, sizeof(arquivo_snap));
+    if (wal_abre(arquivo_csv) != 0 && wal.csv != NULL) {
+        fprintf(msg, "Aviso: log de conexoes '%s' indisponivel; conexoes novas ficam so na memoria\n", wal.caminho);
+        wal.csv = NULL;
+    }
+    double t0 = agora_seg();
+    if (usar_snapshot && snapshot_atual(arquivo_snap, arquivo_csv)
+        && snapshot_carrega(arquivo_snap, arquivo_csv) == 0) {
+        fprintf(msg, "Dados carregados! Total de cidades: %d\n", city_count);
+        carga_medida.segundos = agora_seg() - t0;
+        carga_medida.do_snapshot = 1;
+        fprintf(msg, "Snapshot '%s' mapeado em %.3f ms\n", arquivo_snap, carga_medida.segundos * 1000.0);
+    } else {
+        CargaStats carga;
+        if (carrega_csv(arquivo_csv, &carga) != 0) {
+            fprintf(msg, "ERRO CRITICO: Arquivo '%s' nao encontrado.\n", arquivo_csv);
+            return 1;
+        }
+        grafo_congela();
+        Consolidacao cons = grafo_consolida();
+        carga_medida.segundos = agora_seg() - t0;  // leitura + congelamento
+        carga_medida.mb = carga.bytes / (1024.0 * 1024.0);
+        carga_medida.linhas = carga.linhas;
+        fprintf(msg, "Dados carregados! Total de cidades: %d\n", city_count);
+        double mb = carga.bytes / (1024.0 * 1024.0);
+        double seg = carga.segundos > 0 ? carga.segundos : 1e-9;
+        fprintf(msg, "Leitura: %.2f MB, %ld linhas em %.3f s (%.1f MB/s, %.0f linhas/s)\n",
+                    mb, carga.linhas, carga.segundos, mb / seg, carga.linhas / seg);
+        if (carga.invalidas > 0) fprintf(msg, "Aviso: %ld linha(s) invalida(s) ignorada(s)\n", carga.invalidas);
+        if (cons.repetidas > 0)
+            fprintf(msg, "%ld conexao(oes) repetida(s) consolidada(s) (fica a menor distancia)\n", cons.repetidas);
+        if (cons.lacos > 0) fprintf(msg, "Aviso: %ld conexao(oes) de uma cidade com ela mesma ignorada(s)\n", cons.lacos);
+        struct stat sb;
+        if (usar_snapshot && stat(arquivo_csv, &sb) == 0 && S_ISREG(sb.st_mode)
+            && snapshot_grava(arquivo_snap, arquivo_csv) != 0)
+            fprintf(msg, "Aviso: nao foi possivel gravar o snapshot '%s'\n", arquivo_snap);
+    }
+    unsigned long versao_csv = grafo_versao;  // antes das conexões do log
+    long reaplicadas = wal_reaplica();
+    if (reaplicadas > 0) {
+        // queda antes de compactar: o que estava no log vai pro CSV agora
+        fprintf(msg, "%ld conexao(oes) recuperada(s) de '%s'\n", reaplicadas, wal.caminho);
+        wal_fecha();
     }
 
-    printf("Carregando grafo...\n");
-    char cabecalho[150];
-    fgets(cabecalho, sizeof(cabecalho), arquivo);
+    if (matriz_saida) return modo_matriz();
+    if (bench_modo) {
+        if (strcmp(bench_modo, "levenshtein") == 0) return bench_levenshtein(200000);
+        if (strcmp(bench_modo, "incremental") == 0) return bench_incremental(20, 200);
+        int r = bench_suite(bench_modo);
+        if (r >= 0) return r;
+        fprintf(stderr, "Benchmark desconhecido: %s\n", bench_modo);
+        return 1;
+    }
 
-    while (fscanf(arquivo, " %[^,],%[^,],%d", origem, destino, &distancia) == 3) {
-        int id_origem = city_index(origem);
-        int id_destino = city_index(destino);
-        add_edge(id_origem, id_destino, distancia);
+    if (grafo_direcionado && (rota_motor == ROTA_ALT || rota_motor == ROTA_CH)) {
+        fprintf(msg, "Aviso: --rota=%s supoe conexoes nos dois sentidos; usando busca 'parada'\n", rota_nomes[rota_motor]);
+        rota_motor = ROTA_PARADA;
+    } else if (rota_motor == ROTA_GEO && cidades_com_coord > 0) {
+        geo_escala_calcula();
+        if (geo_escala.fator < 1.0)
+            fprintf(msg, "Aviso: ha conexao mais curta que a linha reta; o limite do motor 'geo' usa %.0f%% dela\n",
+                    geo_escala.fator * 100.0);
+    } else if (rota_motor == ROTA_CH) {
+        char arquivo_ch[4096];
+        ch_caminho(arquivo_csv, arquivo_ch, sizeof(arquivo_ch));
+        t0 = agora_seg();
+        if (ch_carrega(arquivo_ch, arquivo_csv, versao_csv) == 0 && ch_atual()) {
+            fprintf(msg, "Hierarquia de contracao carregada de '%s' (%d atalhos)\n", arquivo_ch, ch.atalhos);
+        } else if (ch_constroi() == 0) {
+            fprintf(msg, "Hierarquia de contracao construida em %.3f s (%d atalhos)\n", agora_seg() - t0, ch.atalhos);
+            // com conexões que ficaram no log (compactação falhou) ela não é a do CSV
+            struct stat sb;
+            if (wal.registros == 0 && stat(arquivo_csv, &sb) == 0 && S_ISREG(sb.st_mode)
+                && ch_grava(arquivo_ch, arquivo_csv) != 0)
+                fprintf(msg, "Aviso: nao foi possivel gravar '%s'\n", arquivo_ch);
+        } else {
+            fprintf(msg, "Aviso: hierarquia de contracao exige pesos nao negativos; usando busca 'parada'\n");
+        }
     }
-    fclose(arquivo);
-    printf("Dados carregados! Total de cidades: %d\n", city_count);
+
+    if (servir_endereco) return modo_servidor();
+    if (consultas_entrada) return modo_consultas();
 
     int opcao = 0;
 
@@ -445,15 +7078,21 @@ int main() {
         printf("3) Ver conexoes de uma cidade\n");
         printf("4) Calcular distancia e trajeto entre cidades\n");
         printf("5) Criar nova conexao\n");
+        printf("6) Analisar malha (componentes, pontos criticos, graus)\n");
+        printf("7) Estatisticas de desempenho\n");
+        printf("8) Rotas alternativas\n");
         printf("0) Sair\n");
         printf("======================================\n");
         printf("Escolha uma opcao: ");
 
-        if (scanf("%d", &opcao) != 1) {
-            while (getchar() != '\n');
-            opcao = -1;
+        int lidos = scanf("%d", &opcao);
+        if (lidos == EOF) {
+            // entrada acabou (pipe/arquivo): sai em vez de repetir o menu pra sempre
+            printf("\n");
+            break;
         }
-        while (getchar() != '\n');
+        if (lidos != 1) opcao = -1;
+        descarta_linha();
 
         switch (opcao) {
             case 1: menu_listar_cidades(); break;
@@ -461,6 +7100,9 @@ int main() {
             case 3: menu_conexoes_ordenadas(); break;
             case 4: menu_distancia_entre_cidades(); break;
             case 5: menu_nova_conexao(); break;
+            case 6: menu_analise_malha(); break;
+            case 7: menu_estatisticas(); break;
+            case 8: menu_rotas_alternativas(); break;
             case 0: printf("Saindo do sistema...\n"); break;
             default: printf("Opcao invalida!\n");
         }
@@ -472,5 +7114,6 @@ int main() {
 
     } while (opcao != 0);
 
+    wal_fecha();
     return 0;
 }